@@ -72,7 +72,7 @@ Rectangle {
         ImageButton {
             Layout.alignment: Qt.AlignBottom
             Layout.margins: 8
-            ToolTip.text: qsTr("Send a file")
+            ToolTip.text: room && room.input.uploading ? qsTr("Uploading... %1%").arg(Math.round(room.input.uploadProgress * 100)) : qsTr("Send a file")
             ToolTip.visible: hovered
             Layout.preferredHeight: 22
             hoverEnabled: true
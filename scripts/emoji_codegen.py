@@ -50,9 +50,133 @@ def generate_qml_list(**kwargs):
     ''')
     d = dict(kwargs=kwargs, entrycount=entrycount)
     print(tmpl.render(d))
+def generate_properties(filename):
+    # Keep in sync with the enum in the template below
+    EMOJI = 0x01
+    EMOJI_PRESENTATION = 0x02
+    MODIFIER = 0x04
+    REGIONAL_INDICATOR = 0x08
+    KEYCAP_BASE = 0x10
+    EXTEND = 0x20
+    JOINER = 0x40
+
+    props = {}
+    def mark(cp, prop):
+        props[cp] = props.get(cp, 0) | prop
+
+    # Tag characters used by subdivision flags, only some of them appear in emoji-test.txt
+    for cp in range(0xE0020, 0xE0080):
+        mark(cp, EXTEND)
+
+    for line in open(filename, 'r', encoding="utf8"):
+        if not line or line.startswith('#'):
+            continue
+
+        segments = re.split(r'\s+[#;] ', line.strip())
+        if len(segments) != 3:
+            continue
+
+        code, qualification, charAndName = segments
+        cps = [int(c, 16) for c in code.split()]
+
+        base = cps[0]
+        if cps[-1] == 0x20E3:
+            mark(base, KEYCAP_BASE)
+        elif 0x1F1E6 <= base <= 0x1F1FF:
+            mark(base, REGIONAL_INDICATOR | EMOJI | EMOJI_PRESENTATION)
+        else:
+            mark(base, EMOJI)
+            if len(cps) == 1 and qualification in ('fully-qualified', 'component'):
+                mark(base, EMOJI_PRESENTATION)
+            if qualification == 'component' and 'skin tone' in charAndName:
+                mark(base, MODIFIER)
+
+        for cp in cps[1:]:
+            if cp == 0x200D:
+                mark(cp, JOINER)
+            elif cp in (0xFE0F, 0x20E3):
+                mark(cp, EXTEND)
+            elif 0x1F1E6 <= cp <= 0x1F1FF:
+                mark(cp, REGIONAL_INDICATOR | EMOJI | EMOJI_PRESENTATION)
+            elif not props.get(cp, 0) & EXTEND:
+                mark(cp, EMOJI)
+
+    # two level table of 256 code point blocks, identical blocks are only stored once
+    blockCount = 0x110000 >> 8
+    blocks = [bytes(256)]
+    blockIndex = []
+    for b in range(blockCount):
+        block = bytes(props.get((b << 8) | i, 0) for i in range(256))
+        if block not in blocks:
+            blocks.append(block)
+        blockIndex.append(blocks.index(block))
+
+    def rows(values):
+        values = list(values)
+        return '\n'.join('  ' + ', '.join(str(v) for v in values[i:i + 24]) + ','
+                         for i in range(0, len(values), 24))
+
+    tmpl = """\
+// SPDX-FileCopyrightText: Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// DO NOT EDIT Properties.h DIRECTLY! EDIT IT IN scripts/emoji_codegen.py AND RUN scripts/codegen.sh!
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace emoji {
+//! Emoji properties of a code point, derived from emoji-test.txt.
+enum Property : std::uint8_t
+{
+    //! Can start an emoji sequence.
+    Emoji = 0x01,
+    //! Displayed as emoji without a variation selector.
+    EmojiPresentation = 0x02,
+    //! Skin tone modifier.
+    Modifier = 0x04,
+    //! Two of these form a flag.
+    RegionalIndicator = 0x08,
+    //! Forms a keycap emoji with U+20E3.
+    KeycapBase = 0x10,
+    //! Variation selector 16, the combining keycap and tag characters.
+    Extend = 0x20,
+    //! Zero width joiner.
+    Joiner = 0x40,
+};
+
+namespace detail {
+constexpr std::array<std::uint8_t, %d> propertyBlockIndex = {
+%s
+};
+
+constexpr std::array<std::uint8_t, %d> propertyBlocks = {
+%s
+};
+}
+
+constexpr std::uint8_t
+properties(char32_t codepoint)
+{
+    if (codepoint > 0x10ffff)
+        return 0;
+    return detail::propertyBlocks[detail::propertyBlockIndex[codepoint >> 8] * 256u +
+                                  (codepoint & 0xff)];
+}
+} // namespace emoji"""
+    print(tmpl % (blockCount, rows(blockIndex), len(blocks) * 256, rows(b''.join(blocks))))
+
 def usage():
     print('usage: emoji_codegen.py {impl|header} /path/to/emoji-test /path/to/shortcodes.txt')
+    print('       emoji_codegen.py properties /path/to/emoji-test')
 if __name__ == '__main__':
+    if len(sys.argv) == 3 and sys.argv[1] == 'properties':
+        generate_properties(sys.argv[2])
+        sys.exit(0)
+
     if len(sys.argv) < 4:
         usage()
         sys.exit(1)
@@ -3,7 +3,6 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include <QBuffer>
-#include <QPixmapCache>
 #include <QPointer>
 #include <memory>
 
@@ -11,28 +10,20 @@
 #include "Cache.h"
 #include "MxcImageProvider.h"
 
-static QPixmapCache avatar_cache;
-
 namespace AvatarProvider {
 void
 resolve(QString avatarUrl, int size, QObject *receiver, AvatarCallback callback)
 {
-    const auto cacheKey = QStringLiteral("%1_size_%2").arg(avatarUrl).arg(size);
-
     QPixmap pixmap;
     if (avatarUrl.isEmpty()) {
         callback(pixmap);
         return;
     }
 
-    if (avatar_cache.find(cacheKey, &pixmap)) {
-        callback(pixmap);
-        return;
-    }
-
+    // Decoded avatars are cached by the MxcImageProvider.
     MxcImageProvider::download(avatarUrl.remove(QStringLiteral("mxc://")),
                                QSize(size, size),
-                               [callback, cacheKey, recv = QPointer<QObject>(receiver)](
+                               [callback, recv = QPointer<QObject>(receiver)](
                                  QString, QSize, QImage img, QString) {
                                    if (!recv)
                                        return;
@@ -41,11 +32,7 @@ resolve(QString avatarUrl, int size, QObject *receiver, AvatarCallback callback)
                                    QObject::connect(proxy.get(),
                                                     &AvatarProxy::avatarDownloaded,
                                                     recv,
-                                                    [callback, cacheKey](QPixmap pm) {
-                                                        if (!pm.isNull())
-                                                            avatar_cache.insert(cacheKey, pm);
-                                                        callback(pm);
-                                                    });
+                                                    [callback](QPixmap pm) { callback(pm); });
 
                                    if (img.isNull()) {
                                        emit proxy->avatarDownloaded(QPixmap{});
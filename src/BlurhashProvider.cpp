@@ -6,6 +6,10 @@
 
 #include <QUrl>
 
+#include <vector>
+
+#include "ImageCache.h"
+
 #include "blurhash.hpp"
 
 void
@@ -22,28 +26,41 @@ BlurhashRunnable::run()
         return;
     }
 
+    // Blurhashes are smooth, so a small decode looks the same, once the scene graph scaled it up.
     auto blurhashDecodeSize = m_requestedSize;
     if (blurhashDecodeSize.height() > 100 && blurhashDecodeSize.width() > 100) {
         blurhashDecodeSize.scale(100, 100, Qt::AspectRatioMode::KeepAspectRatio);
     }
 
-    auto decoded = blurhash::decode(QUrl::fromPercentEncoding(m_id.toUtf8()).toStdString(),
-                                    blurhashDecodeSize.width(),
-                                    blurhashDecodeSize.height());
+    // The same placeholders are requested over and over, while the images they stand in for load.
+    const auto hash = QUrl::fromPercentEncoding(m_id.toUtf8());
+    const auto key =
+      ImageCache::key(QStringLiteral("blurhash:") + hash, blurhashDecodeSize, false, 0);
+    if (auto cached = ImageCache::find(key)) {
+        emit done(cached->image);
+        return;
+    }
+
+    // Decode straight into the pixel layout of a QImage, so no conversion is needed.
+    auto decoded = blurhash::decode(
+      hash.toStdString(), blurhashDecodeSize.width(), blurhashDecodeSize.height(), 4);
     if (decoded.image.empty()) {
         emit error(QStringLiteral("Failed decode!"));
         return;
     }
 
-    QImage image(decoded.image.data(),
-                 (int)decoded.width,
-                 (int)decoded.height,
-                 (int)decoded.width * 3,
-                 QImage::Format_RGB888);
-
-    image = image.scaled(m_requestedSize);
+    auto pixels = new std::vector<unsigned char>(std::move(decoded.image));
+    QImage image(
+      pixels->data(),
+      static_cast<int>(decoded.width),
+      static_cast<int>(decoded.height),
+      static_cast<qsizetype>(decoded.width) * 4,
+      QImage::Format_RGBX8888,
+      [](void *p) { delete static_cast<std::vector<unsigned char> *>(p); },
+      pixels);
 
-    emit done(image.convertToFormat(QImage::Format_RGB32));
+    ImageCache::insert(key, image, {});
+    emit done(image);
 }
 
 #include "moc_BlurhashProvider.cpp"
@@ -5,6 +5,7 @@
 #include "Cache.h"
 #include "Cache_p.h"
 
+#include <algorithm>
 #include <stdexcept>
 #include <unordered_set>
 #include <variant>
@@ -17,6 +18,8 @@
 #include <QMap>
 #include <QMessageBox>
 #include <QStandardPaths>
+#include <QThreadPool>
+#include <QTimer>
 
 #if __has_include(<lmdbxx/lmdb++.h>)
 #include <lmdbxx/lmdb++.h>
@@ -45,7 +48,7 @@
 
 //! Should be changed when a breaking change occurs in the cache format.
 //! This will reset client's data.
-static constexpr std::string_view CURRENT_CACHE_FORMAT_VERSION{"2023.10.22"};
+static constexpr std::string_view CURRENT_CACHE_FORMAT_VERSION{"2026.10.20"};
 static constexpr std::string_view MAX_DBS_SETTINGS_KEY{"database/maxdbs"};
 static constexpr std::string_view MAX_DB_SIZE_SETTINGS_KEY{"database/maxsize"};
 
@@ -57,6 +60,15 @@ static const std::string_view CURRENT_ONLINE_BACKUP_VERSION("current_online_back
 
 static constexpr auto MAX_DBS_DEFAULT = 32384U;
 
+//! How long to wait for more users before sending a /keys/query and how many users to put into
+//! a single request.
+static constexpr int KEY_QUERY_COALESCE_MS       = 50;
+static constexpr std::size_t MAX_KEY_QUERY_USERS = 100;
+
+//! Member search terms are keys, which LMDB limits to mdb_env_get_maxkeysize(), 511 bytes by
+//! default. Longer names are only found by their beginning.
+static constexpr std::size_t MAX_SEARCH_TERM_BYTES = 256;
+
 #if Q_PROCESSOR_WORDSIZE >= 5 // 40-bit or more, up to 2^(8*WORDSIZE) words addressable.
 static constexpr auto DB_SIZE_DEFAULT         = 32ULL * 1024ULL * 1024ULL * 1024ULL; // 32 GB
 static constexpr size_t MAX_RESTORED_MESSAGES = 30'000;
@@ -99,6 +111,14 @@ static constexpr auto OUTBOUND_MEGOLM_SESSIONS_DB("outbound_megolm_sessions");
 static constexpr auto MEGOLM_SESSIONS_DATA_DB("megolm_sessions_data_db");
 //! Curve25519 key to session_id and json encoded olm session, separated by null. Dupsorted.
 static constexpr auto OLM_SESSIONS_DB("olm_sessions.v3");
+//! Same keys as OLM_SESSIONS_DB, json encoded OlmSessionMeta.
+static constexpr auto OLM_SESSIONS_META_DB("olm_sessions_meta.v1");
+
+//! The most recently used olm sessions per device are never pruned, older ones are after they
+//! have not been used for a while. Peers always encrypt with their newest session, so only
+//! delayed messages could still arrive for the old ones.
+static constexpr std::size_t OLM_SESSIONS_KEPT_PER_DEVICE = 5;
+static constexpr std::uint64_t OLM_SESSION_MAX_IDLE_MS     = 90ULL * 24 * 60 * 60 * 1000;
 
 //! flag to be set, when the db should be compacted on startup
 bool needsCompact = false;
@@ -121,6 +141,7 @@ struct CacheDb
     lmdb::dbi outboundMegolmSessions;
     lmdb::dbi megolmSessionsData;
     lmdb::dbi olmSessions;
+    lmdb::dbi olmSessionsMeta;
 
     lmdb::dbi encryptedRooms_;
 
@@ -282,6 +303,13 @@ Cache::getMembersDb(lmdb::txn &txn, const std::string &room_id)
     return lmdb::dbi::open(txn, std::string(room_id + "/members").c_str(), MDB_CREATE);
 }
 
+lmdb::dbi
+Cache::getMemberSearchDb(lmdb::txn &txn, const std::string &room_id)
+{
+    return lmdb::dbi::open(
+      txn, std::string(room_id + "/member_search").c_str(), MDB_CREATE | MDB_DUPSORT);
+}
+
 lmdb::dbi
 Cache::getUserKeysDb(lmdb::txn &txn)
 {
@@ -422,6 +450,13 @@ Cache::Cache(const QString &userId, QObject *parent)
   , db(std::make_unique<CacheDb>())
 {
     connect(this, &Cache::userKeysUpdate, this, &Cache::updateUserKeys, Qt::QueuedConnection);
+
+    auto olmPruneTimer = new QTimer(this);
+    olmPruneTimer->setInterval(std::chrono::hours(6));
+    connect(olmPruneTimer, &QTimer::timeout, this, [this] {
+        QThreadPool::globalInstance()->start([this] { pruneOlmSessions(); });
+    });
+    olmPruneTimer->start();
     connect(
       this,
       &Cache::verificationStatusChanged,
@@ -611,7 +646,8 @@ Cache::setup()
     db->outboundMegolmSessions = lmdb::dbi::open(txn, OUTBOUND_MEGOLM_SESSIONS_DB, MDB_CREATE);
     db->megolmSessionsData     = lmdb::dbi::open(txn, MEGOLM_SESSIONS_DATA_DB, MDB_CREATE);
 
-    db->olmSessions = lmdb::dbi::open(txn, OLM_SESSIONS_DB, MDB_CREATE);
+    db->olmSessions     = lmdb::dbi::open(txn, OLM_SESSIONS_DB, MDB_CREATE);
+    db->olmSessionsMeta = lmdb::dbi::open(txn, OLM_SESSIONS_META_DB, MDB_CREATE);
 
     // What rooms are encrypted
     db->encryptedRooms_   = lmdb::dbi::open(txn, ENCRYPTED_ROOMS_DB, MDB_CREATE);
@@ -954,23 +990,27 @@ Cache::roomEncryptionSettings(const std::string &room_id)
     return std::nullopt;
 }
 
-mtx::crypto::ExportedSessionKeys
-Cache::exportSessionKeys()
+std::size_t
+Cache::exportSessionKeys(
+  const std::function<bool(const mtx::crypto::ExportedSession &, std::size_t, std::size_t)>
+    &callback)
 {
     using namespace mtx::crypto;
 
-    ExportedSessionKeys keys;
-
     auto txn    = ro_txn(db->env_);
     auto cursor = lmdb::cursor::open(txn, db->inboundMegolmSessions);
 
+    const std::size_t total   = db->inboundMegolmSessions.size(txn);
+    std::size_t visited       = 0;
+    std::size_t exportedCount = 0;
+
     std::string_view key, value;
     while (cursor.get(key, value, MDB_NEXT)) {
+        visited++;
+
         ExportedSession exported;
         MegolmSessionIndex index;
 
-        auto saved_session = unpickle<InboundSessionObject>(std::string(value), pickle_secret_);
-
         try {
             index = nlohmann::json::parse(key).get<MegolmSessionIndex>();
         } catch (const nlohmann::json::exception &e) {
@@ -982,7 +1022,7 @@ Cache::exportSessionKeys()
             using namespace mtx::crypto;
 
             std::string_view v;
-            if (db->megolmSessionsData.get(txn, nlohmann::json(index).dump(), v)) {
+            if (db->megolmSessionsData.get(txn, key, v)) {
                 auto data           = nlohmann::json::parse(v).get<GroupSessionData>();
                 exported.sender_key = data.sender_key;
                 if (!data.sender_claimed_ed25519_key.empty())
@@ -997,16 +1037,26 @@ Cache::exportSessionKeys()
             continue;
         }
 
-        exported.room_id     = index.room_id;
-        exported.session_id  = index.session_id;
-        exported.session_key = export_session(saved_session.get(), -1);
+        try {
+            auto saved_session = unpickle<InboundSessionObject>(std::string(value), pickle_secret_);
+            exported.session_key = export_session(saved_session.get(), -1);
+        } catch (const olm_exception &e) {
+            nhlog::db()->critical(
+              "failed to export megolm session {}: {}", index.session_id, e.what());
+            continue;
+        }
+
+        exported.room_id    = index.room_id;
+        exported.session_id = index.session_id;
 
-        keys.sessions.push_back(exported);
+        exportedCount++;
+        if (!callback(exported, visited, total))
+            break;
     }
 
     cursor.close();
 
-    return keys;
+    return exportedCount;
 }
 
 void
@@ -1289,24 +1339,50 @@ Cache::getMegolmSessionData(const MegolmSessionIndex &index)
 //
 
 void
-Cache::saveOlmSessions(std::vector<std::pair<std::string, mtx::crypto::OlmSessionPtr>> sessions,
-                       uint64_t timestamp)
+Cache::putOlmSession(lmdb::txn &txn,
+                     const std::string &curve25519,
+                     mtx::crypto::OlmSessionPtr &session,
+                     uint64_t timestamp,
+                     bool received)
 {
     using namespace mtx::crypto;
 
-    auto txn = lmdb::txn::begin(db->env_);
-    for (const auto &[curve25519, session] : sessions) {
-        const auto pickled    = pickle<SessionObject>(session.get(), pickle_secret_);
-        const auto session_id = mtx::crypto::session_id(session.get());
+    const auto pickled    = pickle<SessionObject>(session.get(), pickle_secret_);
+    const auto session_id = mtx::crypto::session_id(session.get());
+    const auto key        = combineOlmSessionKeyFromCurveAndSessionId(curve25519, session_id);
 
-        StoredOlmSession stored_session;
-        stored_session.pickled_session = pickled;
-        stored_session.last_message_ts = timestamp;
+    StoredOlmSession stored_session;
+    stored_session.pickled_session = pickled;
+    stored_session.last_message_ts = timestamp;
 
-        db->olmSessions.put(txn,
-                            combineOlmSessionKeyFromCurveAndSessionId(curve25519, session_id),
-                            nlohmann::json(stored_session).dump());
+    OlmSessionMeta meta;
+    std::string_view oldMeta;
+    if (db->olmSessionsMeta.get(txn, key, oldMeta)) {
+        try {
+            meta = nlohmann::json::parse(oldMeta).get<OlmSessionMeta>();
+        } catch (const nlohmann::json::exception &e) {
+            nhlog::db()->warn("Failed to parse olm session metadata: {}", e.what());
+        }
     }
+    if (meta.created_ts == 0)
+        meta.created_ts = timestamp;
+    meta.last_used_ts = std::max(meta.last_used_ts, timestamp);
+    if (received)
+        meta.messages_received++;
+    else
+        meta.messages_sent++;
+
+    db->olmSessions.put(txn, key, nlohmann::json(stored_session).dump());
+    db->olmSessionsMeta.put(txn, key, nlohmann::json(meta).dump());
+}
+
+void
+Cache::saveOlmSessions(std::vector<std::pair<std::string, mtx::crypto::OlmSessionPtr>> sessions,
+                       uint64_t timestamp)
+{
+    auto txn = lmdb::txn::begin(db->env_);
+    for (auto &[curve25519, session] : sessions)
+        putOlmSession(txn, curve25519, session, timestamp, false);
 
     txn.commit();
 }
@@ -1316,22 +1392,42 @@ Cache::saveOlmSession(const std::string &curve25519,
                       mtx::crypto::OlmSessionPtr session,
                       uint64_t timestamp)
 {
-    using namespace mtx::crypto;
-
     auto txn = lmdb::txn::begin(db->env_);
+    putOlmSession(txn, curve25519, session, timestamp, true);
+    txn.commit();
+}
 
-    const auto pickled    = pickle<SessionObject>(session.get(), pickle_secret_);
-    const auto session_id = mtx::crypto::session_id(session.get());
+std::vector<std::pair<std::string, OlmSessionMeta>>
+Cache::olmSessionsByLastUse(lmdb::txn &txn, const std::string &curve25519)
+{
+    std::vector<std::pair<std::string, OlmSessionMeta>> sessions;
 
-    StoredOlmSession stored_session;
-    stored_session.pickled_session = pickled;
-    stored_session.last_message_ts = timestamp;
+    std::string_view key = curve25519, value;
+    auto cursor          = lmdb::cursor::open(txn, db->olmSessionsMeta);
+    bool first           = true;
+    while (cursor.get(key, value, first ? MDB_SET_RANGE : MDB_NEXT)) {
+        first = false;
 
-    db->olmSessions.put(txn,
-                        combineOlmSessionKeyFromCurveAndSessionId(curve25519, session_id),
-                        nlohmann::json(stored_session).dump());
+        auto [storedCurve, session_id] = splitCurve25519AndOlmSessionId(key);
+        if (storedCurve != curve25519)
+            break;
 
-    txn.commit();
+        try {
+            sessions.emplace_back(session_id, nlohmann::json::parse(value).get<OlmSessionMeta>());
+        } catch (const nlohmann::json::exception &e) {
+            nhlog::db()->warn("Failed to parse olm session metadata: {}", e.what());
+            sessions.emplace_back(session_id, OlmSessionMeta{});
+        }
+    }
+    cursor.close();
+
+    std::stable_sort(sessions.begin(), sessions.end(), [](const auto &a, const auto &b) {
+        if (a.second.last_used_ts != b.second.last_used_ts)
+            return a.second.last_used_ts > b.second.last_used_ts;
+        return a.second.created_ts > b.second.created_ts;
+    });
+
+    return sessions;
 }
 
 std::optional<mtx::crypto::OlmSessionPtr>
@@ -1364,60 +1460,100 @@ Cache::getLatestOlmSession(const std::string &curve25519)
     try {
         auto txn = ro_txn(db->env_);
 
-        std::string_view key = curve25519, pickled_session;
-
-        std::optional<StoredOlmSession> currentNewest;
-
-        auto cursor = lmdb::cursor::open(txn, db->olmSessions);
-        bool first  = true;
-        while (cursor.get(key, pickled_session, first ? MDB_SET_RANGE : MDB_NEXT)) {
-            first = false;
+        for (const auto &[session_id, meta] : olmSessionsByLastUse(txn, curve25519)) {
+            (void)meta;
 
-            auto storedCurve = splitCurve25519AndOlmSessionId(key).first;
-            if (storedCurve != curve25519)
-                break;
+            std::string_view pickled;
+            if (!db->olmSessions.get(
+                  txn, combineOlmSessionKeyFromCurveAndSessionId(curve25519, session_id), pickled))
+                continue;
 
-            auto data = nlohmann::json::parse(pickled_session).get<StoredOlmSession>();
-            if (!currentNewest || currentNewest->last_message_ts < data.last_message_ts)
-                currentNewest = data;
+            auto data = nlohmann::json::parse(pickled).get<StoredOlmSession>();
+            return unpickle<SessionObject>(data.pickled_session, pickle_secret_);
         }
-        cursor.close();
-
-        return currentNewest ? std::optional(unpickle<SessionObject>(currentNewest->pickled_session,
-                                                                     pickle_secret_))
-                             : std::nullopt;
     } catch (...) {
-        return std::nullopt;
     }
+    return std::nullopt;
 }
 
 std::vector<std::string>
 Cache::getOlmSessions(const std::string &curve25519)
 {
-    using namespace mtx::crypto;
-
     try {
         auto txn = ro_txn(db->env_);
 
-        std::string_view key = curve25519, value;
         std::vector<std::string> res;
+        for (auto &[session_id, meta] : olmSessionsByLastUse(txn, curve25519)) {
+            (void)meta;
+            res.push_back(std::move(session_id));
+        }
+        return res;
+    } catch (...) {
+        return {};
+    }
+}
+
+void
+Cache::pruneOlmSessions()
+{
+    if (!databaseReady_)
+        return;
 
-        auto cursor = lmdb::cursor::open(txn, db->olmSessions);
+    try {
+        const std::uint64_t now = QDateTime::currentMSecsSinceEpoch();
 
-        bool first = true;
-        while (cursor.get(key, value, first ? MDB_SET_RANGE : MDB_NEXT)) {
-            first = false;
+        auto txn    = lmdb::txn::begin(db->env_);
+        auto cursor = lmdb::cursor::open(txn, db->olmSessionsMeta);
 
-            auto [storedCurve, session_id] = splitCurve25519AndOlmSessionId(key);
-            if (storedCurve != curve25519)
-                break;
-            res.emplace_back(session_id);
+        std::string currentCurve;
+        std::vector<std::pair<std::string, OlmSessionMeta>> deviceSessions;
+        std::vector<std::string> toDelete;
+
+        auto collectPrunable = [&] {
+            if (deviceSessions.size() <= OLM_SESSIONS_KEPT_PER_DEVICE)
+                return;
+
+            std::sort(
+              deviceSessions.begin(), deviceSessions.end(), [](const auto &a, const auto &b) {
+                  return a.second.last_used_ts > b.second.last_used_ts;
+              });
+            for (auto it = deviceSessions.begin() + OLM_SESSIONS_KEPT_PER_DEVICE;
+                 it != deviceSessions.end();
+                 ++it)
+                if (it->second.last_used_ts + OLM_SESSION_MAX_IDLE_MS < now)
+                    toDelete.push_back(std::move(it->first));
+        };
+
+        std::string_view key, value;
+        while (cursor.get(key, value, MDB_NEXT)) {
+            auto curve = splitCurve25519AndOlmSessionId(key).first;
+            if (curve != currentCurve) {
+                collectPrunable();
+                deviceSessions.clear();
+                currentCurve = curve;
+            }
+
+            OlmSessionMeta meta;
+            try {
+                meta = nlohmann::json::parse(value).get<OlmSessionMeta>();
+            } catch (const nlohmann::json::exception &) {
+                // unknown usage, let it age out like a session that was never used
+            }
+            deviceSessions.emplace_back(std::string(key), meta);
         }
+        collectPrunable();
         cursor.close();
 
-        return res;
-    } catch (...) {
-        return {};
+        for (const auto &k : toDelete) {
+            db->olmSessions.del(txn, k);
+            db->olmSessionsMeta.del(txn, k);
+        }
+        txn.commit();
+
+        if (!toDelete.empty())
+            nhlog::crypto()->info("Pruned {} unused olm sessions", toDelete.size());
+    } catch (const lmdb::error &e) {
+        nhlog::db()->warn("Failed to prune olm sessions: {}", e.what());
     }
 }
 
@@ -1493,6 +1629,10 @@ Cache::removeRoom(lmdb::txn &txn, const std::string &roomid)
     getStatesDb(txn, roomid).drop(txn, true);
     getAccountDataDb(txn, roomid).drop(txn, true);
     getMembersDb(txn, roomid).drop(txn, true);
+    getMemberSearchDb(txn, roomid).drop(txn, true);
+
+    std::unique_lock<std::mutex> lock(key_recipients.mtx);
+    key_recipients.rooms.erase(roomid);
 }
 
 void
@@ -1559,6 +1699,10 @@ Cache::deleteData()
         db->env_.close();
 
         verification_storage.status.clear();
+        {
+            std::unique_lock<std::mutex> lock(key_recipients.mtx);
+            key_recipients.rooms.clear();
+        }
 
         if (!cacheDirectory_.isEmpty()) {
             QDir(cacheDirectory_).removeRecursively();
@@ -1963,6 +2107,85 @@ Cache::runMigrations()
            nhlog::db()->info("Successfully updated olm sessions database format.");
            return true;
        }},
+      {"2026.10.19",
+       [this]() {
+           // index olm sessions by their last use
+           try {
+               auto txn    = lmdb::txn::begin(db->env_, nullptr);
+               auto cursor = lmdb::cursor::open(txn, db->olmSessions);
+
+               std::string_view key, json;
+               while (cursor.get(key, json, MDB_NEXT)) {
+                   OlmSessionMeta meta;
+                   try {
+                       auto ts =
+                         nlohmann::json::parse(json).get<StoredOlmSession>().last_message_ts;
+                       // sent messages used to be stored with a timestamp in seconds
+                       if (ts < 100'000'000'000ULL)
+                           ts *= 1000;
+                       meta.created_ts   = ts;
+                       meta.last_used_ts = ts;
+                   } catch (const nlohmann::json::exception &e) {
+                       nhlog::db()->warn("Failed to parse olm session during migration: {}",
+                                         e.what());
+                   }
+                   db->olmSessionsMeta.put(txn, key, nlohmann::json(meta).dump());
+               }
+               cursor.close();
+
+               txn.commit();
+           } catch (const lmdb::error &e) {
+               nhlog::db()->critical("Failed to index olm sessions in migration! {}", e.what());
+               return false;
+           }
+
+           nhlog::db()->info("Successfully indexed olm sessions.");
+           return true;
+       }},
+      {"2026.10.20",
+       [this]() {
+           // index member names for completion
+           try {
+               auto txn = lmdb::txn::begin(db->env_, nullptr);
+
+               std::vector<std::string> rooms;
+               {
+                   auto roomsCursor = lmdb::cursor::open(txn, db->rooms);
+                   std::string_view room_id, unused;
+                   while (roomsCursor.get(room_id, unused, MDB_NEXT))
+                       rooms.emplace_back(room_id);
+                   roomsCursor.close();
+               }
+
+               for (const auto &room_id : rooms) {
+                   auto searchdb = getMemberSearchDb(txn, room_id);
+                   auto cursor   = lmdb::cursor::open(txn, getMembersDb(txn, room_id));
+
+                   std::string_view user_id_, info;
+                   while (cursor.get(user_id_, info, MDB_NEXT)) {
+                       // values from a cursor are invalidated by writes
+                       std::string user_id(user_id_);
+                       try {
+                           auto member = nlohmann::json::parse(info).get<MemberInfo>();
+                           for (const auto &term : memberSearchTerms(user_id, member.name))
+                               searchdb.put(txn, term, user_id);
+                       } catch (const nlohmann::json::exception &e) {
+                           nhlog::db()->warn("Failed to parse member during migration: {}",
+                                             e.what());
+                       }
+                   }
+                   cursor.close();
+               }
+
+               txn.commit();
+           } catch (const lmdb::error &e) {
+               nhlog::db()->critical("Failed to index members in migration! {}", e.what());
+               return false;
+           }
+
+           nhlog::db()->info("Successfully indexed members.");
+           return true;
+       }},
     };
 
     nhlog::db()->info("Running migrations, this may take a while!");
@@ -2156,6 +2379,7 @@ Cache::updateState(const std::string &room, const mtx::responses::StateEvents &s
 
     if (wipe) {
         membersdb.drop(txn);
+        getMemberSearchDb(txn, room).drop(txn);
         statesdb.drop(txn);
         stateskeydb.drop(txn);
     }
@@ -2337,14 +2561,16 @@ Cache::saveStateEvent(lmdb::txn &txn,
               e->content.is_direct,
             };
 
-            membersdb.put(txn, e->state_key, nlohmann::json(tmp).dump());
+            updateMember(txn, membersdb, room_id, e->state_key, tmp);
             break;
         }
         default: {
-            membersdb.del(txn, e->state_key, "");
+            updateMember(txn, membersdb, room_id, e->state_key, std::nullopt);
             break;
         }
         }
+
+        markKeyRecipientChanged(room_id, e->state_key, mdb_txn_id(txn.handle()));
     } else if (auto encr = std::get_if<StateEvent<Encryption>>(&event)) {
         if (!encr->state_key.empty())
             return;
@@ -2359,7 +2585,7 @@ Cache::saveStateEvent(lmdb::txn &txn,
     }
 
     std::visit(
-      [&txn, &statesdb, &stateskeydb, &eventsDb, &membersdb](const auto &e) {
+      [this, &txn, &statesdb, &stateskeydb, &eventsDb, &membersdb, &room_id](const auto &e) {
           if constexpr (isStateEvent_<decltype(e)>) {
               eventsDb.put(txn, e.event_id, nlohmann::json(e).dump());
 
@@ -2370,8 +2596,8 @@ Cache::saveStateEvent(lmdb::txn &txn,
                       if (e.type == EventType::RoomMember) {
                           // membership is not revoked, but names are yeeted (so we set the name
                           // to the mxid)
-                          MemberInfo tmp{e.state_key, ""};
-                          membersdb.put(txn, e.state_key, nlohmann::json(tmp).dump());
+                          updateMember(
+                            txn, membersdb, room_id, e.state_key, MemberInfo{e.state_key, ""});
                       } else if (e.state_key.empty()) {
                           // strictly speaking some stuff in those events can be redacted, but
                           // this is close enough. Ref:
@@ -3833,6 +4059,163 @@ Cache::getMember(const std::string &room_id, const std::string &user_id)
     return std::nullopt;
 }
 
+void
+Cache::updateMember(lmdb::txn &txn,
+                    lmdb::dbi &membersdb,
+                    const std::string &room_id,
+                    const std::string &user_id,
+                    const std::optional<MemberInfo> &info)
+{
+    auto searchdb = getMemberSearchDb(txn, room_id);
+
+    std::string_view oldInfo;
+    if (membersdb.get(txn, user_id, oldInfo)) {
+        try {
+            auto old = nlohmann::json::parse(oldInfo).get<MemberInfo>();
+            for (const auto &term : memberSearchTerms(user_id, old.name))
+                searchdb.del(txn, term, user_id);
+        } catch (const nlohmann::json::exception &err) {
+            nhlog::db()->warn("{}", err.what());
+        }
+    }
+
+    if (info) {
+        membersdb.put(txn, user_id, nlohmann::json(*info).dump());
+        for (const auto &term : memberSearchTerms(user_id, info->name))
+            searchdb.put(txn, term, user_id);
+    } else {
+        membersdb.del(txn, user_id, "");
+    }
+}
+
+//! Shortens a search term to MAX_SEARCH_TERM_BYTES without splitting a UTF-8 sequence.
+static std::string
+truncateSearchTerm(std::string term)
+{
+    if (term.size() > MAX_SEARCH_TERM_BYTES) {
+        auto size = MAX_SEARCH_TERM_BYTES;
+        while (size > 0 && (static_cast<unsigned char>(term[size]) & 0xC0) == 0x80)
+            size--;
+        term.resize(size);
+    }
+    return term;
+}
+
+std::vector<std::string>
+Cache::memberSearchTerms(std::string_view user_id, const std::string &display_name)
+{
+    std::vector<std::string> terms;
+
+    auto name = QString::fromStdString(display_name).toCaseFolded();
+    if (!name.isEmpty())
+        terms.push_back(truncateSearchTerm(name.toStdString()));
+
+    const auto words = QStringView(name).split(u' ', Qt::SkipEmptyParts);
+    if (words.size() > 1)
+        for (const auto &word : words)
+            terms.push_back(truncateSearchTerm(word.toString().toStdString()));
+
+    if (user_id.starts_with('@'))
+        user_id.remove_prefix(1);
+    terms.push_back(truncateSearchTerm(
+      QString::fromUtf8(user_id.data(), user_id.size()).toCaseFolded().toStdString()));
+
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+    return terms;
+}
+
+std::vector<RoomMember>
+Cache::searchMembers(const std::string &room_id, const QString &prefix_, std::size_t limit)
+{
+    auto prefix = QStringView(prefix_).trimmed().toString().toCaseFolded().toStdString();
+    if (prefix.starts_with('@'))
+        prefix.erase(0, 1);
+    prefix = truncateSearchTerm(std::move(prefix));
+
+    std::vector<RoomMember> members;
+    try {
+        auto txn       = ro_txn(db->env_);
+        auto searchdb  = getMemberSearchDb(txn, room_id);
+        auto membersdb = getMembersDb(txn, room_id);
+        auto cursor    = lmdb::cursor::open(txn, searchdb);
+
+        std::unordered_set<std::string_view> seen;
+        std::string_view term = prefix, user_id;
+        bool found = prefix.empty() ? cursor.get(term, user_id, MDB_FIRST)
+                                    : cursor.get(term, user_id, MDB_SET_RANGE);
+        while (found && members.size() < limit && term.starts_with(prefix)) {
+            std::string_view info;
+            if (seen.insert(user_id).second && membersdb.get(txn, user_id, info)) {
+                try {
+                    auto tmp = nlohmann::json::parse(info).get<MemberInfo>();
+                    members.emplace_back(RoomMember{
+                      QString::fromStdString(std::string(user_id)),
+                      QString::fromStdString(tmp.name),
+                      QString::fromStdString(tmp.avatar_url),
+                    });
+                } catch (const nlohmann::json::exception &e) {
+                    nhlog::db()->warn("{}", e.what());
+                }
+            }
+
+            found = cursor.get(term, user_id, MDB_NEXT);
+        }
+
+        cursor.close();
+    } catch (const lmdb::error &e) {
+        nhlog::db()->error("Failed to search members in room {}: {}", room_id, e.what());
+    }
+
+    return members;
+}
+
+std::vector<RoomMember>
+Cache::recentSenders(const std::string &room_id, std::size_t messages)
+{
+    std::vector<RoomMember> senders;
+    try {
+        auto txn       = ro_txn(db->env_);
+        auto order2msg = getOrderToMessageDb(txn, room_id);
+        auto eventsDb  = getEventsDb(txn, room_id);
+        auto membersDb = getMembersDb(txn, room_id);
+        auto cursor    = lmdb::cursor::open(txn, order2msg);
+
+        std::vector<std::string> seen;
+        std::string_view indexVal, event_id, event, user_data;
+        bool found = cursor.get(indexVal, event_id, MDB_LAST);
+        for (; found && messages > 0; messages--) {
+            if (eventsDb.get(txn, event_id, event)) {
+                try {
+                    auto sender = nlohmann::json::parse(event).value("sender", std::string());
+                    if (!sender.empty() && std::ranges::find(seen, sender) == seen.end()) {
+                        // skip senders, who left the room since
+                        if (membersDb.get(txn, sender, user_data)) {
+                            MemberInfo tmp = nlohmann::json::parse(user_data).get<MemberInfo>();
+                            senders.emplace_back(RoomMember{
+                              QString::fromStdString(sender),
+                              QString::fromStdString(tmp.name),
+                              QString::fromStdString(tmp.avatar_url),
+                            });
+                        }
+                        seen.push_back(std::move(sender));
+                    }
+                } catch (const nlohmann::json::exception &e) {
+                    nhlog::db()->warn("{}", e.what());
+                }
+            }
+
+            found = cursor.get(indexVal, event_id, MDB_PREV);
+        }
+
+        cursor.close();
+    } catch (const lmdb::error &e) {
+        nhlog::db()->error("Failed to read recent senders in room {}: {}", room_id, e.what());
+    }
+
+    return senders;
+}
+
 std::vector<RoomMember>
 Cache::getMembers(const std::string &room_id, std::size_t startIndex, std::size_t len)
 {
@@ -4958,69 +5341,163 @@ Cache::roomVerificationStatus(const std::string &room_id)
     return trust;
 }
 
-std::map<std::string, std::optional<UserKeyCache>>
-Cache::getMembersWithKeys(const std::string &room_id, bool verified_only)
+bool
+Cache::memberKeysForSharing_(lmdb::txn &txn,
+                             lmdb::dbi &keysDb,
+                             const std::string &user_id,
+                             bool verified_only,
+                             std::optional<UserKeyCache> &keys)
 {
-    std::string_view keys;
+    std::string_view keysJson;
+    if (!keysDb.get(txn, user_id, keysJson)) {
+        keys = std::nullopt;
+        return !verified_only;
+    }
+
+    auto k = nlohmann::json::parse(keysJson).get<UserKeyCache>();
+    if (!verified_only) {
+        keys = std::move(k);
+        return true;
+    }
+
+    auto verif = verificationStatus_(user_id, txn);
+    if (verif.user_verified != crypto::Trust::Verified && verif.verified_devices.empty())
+        return false;
+
+    auto keyCopy = k;
+    keyCopy.device_keys.clear();
+
+    std::copy_if(k.device_keys.begin(),
+                 k.device_keys.end(),
+                 std::inserter(keyCopy.device_keys, keyCopy.device_keys.end()),
+                 [&verif](const auto &key) {
+                     auto curve25519 = key.second.keys.find("curve25519:" + key.first);
+                     if (curve25519 == key.second.keys.end())
+                         return false;
+                     if (auto t = verif.verified_device_keys.find(curve25519->second);
+                         t == verif.verified_device_keys.end() ||
+                         t->second != crypto::Trust::Verified)
+                         return false;
+
+                     return key.first == key.second.device_id &&
+                            std::find(verif.verified_devices.begin(),
+                                      verif.verified_devices.end(),
+                                      key.first) != verif.verified_devices.end();
+                 });
+
+    if (keyCopy.device_keys.empty())
+        return false;
+
+    keys = std::move(keyCopy);
+    return true;
+}
 
+void
+Cache::addKeyRecipient_(lmdb::txn &txn,
+                        lmdb::dbi &keysDb,
+                        KeyRecipients &recipients,
+                        const std::string &user_id,
+                        bool verified_only)
+{
+    std::optional<UserKeyCache> keys;
+    if (!memberKeysForSharing_(txn, keysDb, user_id, verified_only, keys))
+        return;
+
+    auto &devices = recipients[user_id];
+    if (keys)
+        for (const auto &[device_id, key] : keys->device_keys) {
+            (void)key;
+            devices.insert(device_id);
+        }
+}
+
+std::shared_ptr<const KeyRecipients>
+Cache::roomKeyRecipients(const std::string &room_id, bool verified_only)
+{
     try {
         auto txn = ro_txn(db->env_);
-        std::map<std::string, std::optional<UserKeyCache>> members;
+        // Id of the last committed write transaction, which this snapshot includes.
+        const std::uint64_t txnId = mdb_txn_id(txn.handle());
 
-        auto db_    = getMembersDb(txn, room_id);
-        auto keysDb = getUserKeysDb(txn);
+        auto membersDb = getMembersDb(txn, room_id);
+        auto keysDb    = getUserKeysDb(txn);
 
-        std::string_view user_id, unused;
-        auto cursor = lmdb::cursor::open(txn, db_);
-        while (cursor.get(user_id, unused, MDB_NEXT)) {
-            auto res = keysDb.get(txn, user_id, keys);
+        std::unique_lock<std::mutex> lock(key_recipients.mtx);
+        auto &entry = key_recipients.rooms[room_id];
 
-            if (res) {
-                auto k = nlohmann::json::parse(keys).get<UserKeyCache>();
-                if (verified_only) {
-                    auto verif = verificationStatus_(std::string(user_id), txn);
-
-                    if (verif.user_verified == crypto::Trust::Verified ||
-                        !verif.verified_devices.empty()) {
-                        auto keyCopy = k;
-                        keyCopy.device_keys.clear();
-
-                        std::copy_if(
-                          k.device_keys.begin(),
-                          k.device_keys.end(),
-                          std::inserter(keyCopy.device_keys, keyCopy.device_keys.end()),
-                          [&verif](const auto &key) {
-                              auto curve25519 = key.second.keys.find("curve25519:" + key.first);
-                              if (curve25519 == key.second.keys.end())
-                                  return false;
-                              if (auto t = verif.verified_device_keys.find(curve25519->second);
-                                  t == verif.verified_device_keys.end() ||
-                                  t->second != crypto::Trust::Verified)
-                                  return false;
-
-                              return key.first == key.second.device_id &&
-                                     std::find(verif.verified_devices.begin(),
-                                               verif.verified_devices.end(),
-                                               key.first) != verif.verified_devices.end();
-                          });
-
-                        if (!keyCopy.device_keys.empty())
-                            members[std::string(user_id)] = std::move(keyCopy);
-                    }
-                } else {
-                    members[std::string(user_id)] = std::move(k);
-                }
-            } else {
-                if (!verified_only)
-                    members[std::string(user_id)] = {};
+        if (!entry.recipients || entry.verified_only != verified_only) {
+            auto recipients = std::make_shared<KeyRecipients>();
+
+            std::string_view user_id, unused;
+            auto cursor = lmdb::cursor::open(txn, membersDb);
+            while (cursor.get(user_id, unused, MDB_NEXT))
+                addKeyRecipient_(txn, keysDb, *recipients, std::string(user_id), verified_only);
+            cursor.close();
+
+            std::erase_if(entry.dirty, [txnId](const auto &e) { return e.second <= txnId; });
+
+            entry.verified_only = verified_only;
+            // A membership write was still in flight while we read, so we might have missed it.
+            // Use the result once, but build it again next time.
+            if (key_recipients.last_member_change > txnId) {
+                entry.recipients = nullptr;
+                return recipients;
             }
+            entry.recipients = std::move(recipients);
+        } else if (!entry.dirty.empty()) {
+            auto recipients = std::make_shared<KeyRecipients>(*entry.recipients);
+
+            for (auto it = entry.dirty.begin(); it != entry.dirty.end();) {
+                recipients->erase(it->first);
+
+                std::string_view unused;
+                if (membersDb.get(txn, it->first, unused))
+                    addKeyRecipient_(txn, keysDb, *recipients, it->first, verified_only);
+
+                // Keep changes we can't see yet, they will be applied on the next call.
+                if (it->second <= txnId)
+                    it = entry.dirty.erase(it);
+                else
+                    ++it;
+            }
+
+            entry.recipients = std::move(recipients);
         }
-        cursor.close();
 
-        return members;
+        return entry.recipients;
     } catch (std::exception &e) {
-        nhlog::db()->debug("Error retrieving members: {}", e.what());
-        return {};
+        nhlog::db()->debug("Error retrieving key recipients: {}", e.what());
+        return std::make_shared<const KeyRecipients>();
+    }
+}
+
+void
+Cache::markKeyRecipientChanged(const std::string &room_id,
+                               const std::string &user_id,
+                               std::uint64_t txn_id)
+{
+    std::unique_lock<std::mutex> lock(key_recipients.mtx);
+    key_recipients.last_member_change = std::max(key_recipients.last_member_change, txn_id);
+
+    if (auto room = key_recipients.rooms.find(room_id); room != key_recipients.rooms.end()) {
+        auto &changed = room->second.dirty[user_id];
+        changed       = std::max(changed, txn_id);
+    }
+}
+
+void
+Cache::invalidateKeyRecipients(const std::string &user_id)
+{
+    // Our own cross-signing keys decide which devices of other users count as verified.
+    const bool ownKeys = user_id == localUserId_.toStdString();
+
+    std::unique_lock<std::mutex> lock(key_recipients.mtx);
+    for (auto &[room_id, entry] : key_recipients.rooms) {
+        (void)room_id;
+        if (ownKeys && entry.verified_only)
+            entry.recipients = nullptr;
+        else
+            entry.dirty.try_emplace(user_id, 0);
     }
 }
 
@@ -5268,6 +5745,11 @@ Cache::updateUserKeys(const std::string &sync_token, const mtx::responses::Query
 
     txn.commit();
 
+    for (const auto &[user_id, update] : updates) {
+        (void)update;
+        invalidateKeyRecipients(user_id);
+    }
+
     std::map<std::string, VerificationStatus> tmp;
     const auto local_user = utils::localUser().toStdString();
 
@@ -5312,9 +5794,6 @@ Cache::markUserKeysOutOfDate(lmdb::txn &txn,
                              const std::vector<std::string> &user_ids,
                              const std::string &sync_token)
 {
-    mtx::requests::QueryKeys query;
-    query.token = sync_token;
-
     for (const auto &user : user_ids) {
         if (user.size() > 255) {
             nhlog::db()->debug("Skipping device key query for user with invalid mxid: {}", user);
@@ -5338,39 +5817,29 @@ Cache::markUserKeysOutOfDate(lmdb::txn &txn,
         cacheEntry.last_changed = sync_token;
 
         db_.put(txn, user, nlohmann::json(cacheEntry).dump());
+    }
 
-        query.device_keys[user] = {};
-
-        if (query.device_keys.size() >= 32) {
-            http::client()->query_keys(
-              query,
-              [this, sync_token](const mtx::responses::QueryKeys &keys, mtx::http::RequestErr err) {
-                  if (err) {
-                      nhlog::net()->warn("failed to query device keys: {} {}",
-                                         err->matrix_error.error,
-                                         static_cast<int>(err->status_code));
-                      return;
-                  }
+    // Even if a query for these users is already running, it was made for an older token, so
+    // its result would be discarded. Always queue a new one.
+    std::unique_lock<std::mutex> lock(key_queries.mtx);
+    for (const auto &user : user_ids) {
+        if (user.size() > 255)
+            continue;
 
-                  emit userKeysUpdate(sync_token, keys);
-              });
-            query.device_keys.clear();
+        std::vector<KeyQueryQueue::Callback> waiting;
+        for (auto &[token, users] : key_queries.pending) {
+            (void)token;
+            if (auto it = users.find(user); it != users.end()) {
+                waiting = std::move(it->second);
+                users.erase(it);
+                break;
+            }
         }
-    }
-
-    if (!query.device_keys.empty())
-        http::client()->query_keys(
-          query,
-          [this, sync_token](const mtx::responses::QueryKeys &keys, mtx::http::RequestErr err) {
-              if (err) {
-                  nhlog::net()->warn("failed to query device keys: {} {}",
-                                     err->matrix_error.error,
-                                     static_cast<int>(err->status_code));
-                  return;
-              }
 
-              emit userKeysUpdate(sync_token, keys);
-          });
+        auto &callbacks = key_queries.pending[sync_token][user];
+        std::move(waiting.begin(), waiting.end(), std::back_inserter(callbacks));
+    }
+    scheduleKeyQueries();
 }
 
 void
@@ -5386,7 +5855,6 @@ Cache::query_keys(const std::string &user_id,
         return;
     }
 
-    mtx::requests::QueryKeys req;
     std::string last_changed;
     {
         auto txn    = ro_txn(db->env_);
@@ -5404,46 +5872,170 @@ Cache::query_keys(const std::string &user_id,
         } else
             nhlog::db()->info("No keys found for {}", user_id);
 
-        req.device_keys[user_id] = {};
-
         if (cache_)
             last_changed = cache_->last_changed;
-        req.token = last_changed;
     }
 
-    // use context object so that we can disconnect again
-    QObject *context{new QObject(this)};
-    QObject::connect(
-      this,
-      &Cache::userKeysUpdateFinalize,
-      context,
-      [cb, user_id, context_ = context, this](std::string updated_user) mutable {
-          if (user_id == updated_user) {
-              context_->deleteLater();
-              auto txn  = ro_txn(db->env_);
-              auto keys = this->userKeys_(user_id, txn);
-              cb(keys.value_or(UserKeyCache{}), {});
-          }
-      },
-      Qt::QueuedConnection);
+    std::unique_lock<std::mutex> lock(key_queries.mtx);
+
+    // Attach to a running query for the same user only, if it was made for the token the keys
+    // changed at. Otherwise its result is discarded, so query again once it finished.
+    if (auto it = key_queries.inflight.find(user_id); it != key_queries.inflight.end()) {
+        if (it->second.token == last_changed) {
+            it->second.callbacks.push_back(std::move(cb));
+        } else {
+            auto &next = key_queries.queued[user_id];
+            next.token = last_changed;
+            next.callbacks.push_back(std::move(cb));
+        }
+        return;
+    }
+    if (auto it = key_queries.queued.find(user_id); it != key_queries.queued.end()) {
+        it->second.token = last_changed;
+        it->second.callbacks.push_back(std::move(cb));
+        return;
+    }
+    // Queries not sent yet are moved to the newest token by markUserKeysOutOfDate.
+    for (auto &[token, users] : key_queries.pending) {
+        (void)token;
+        if (auto it = users.find(user_id); it != users.end()) {
+            it->second.push_back(std::move(cb));
+            return;
+        }
+    }
+
+    key_queries.pending[last_changed][user_id].push_back(std::move(cb));
+    scheduleKeyQueries();
+}
+
+void
+Cache::scheduleKeyQueries()
+{
+    if (key_queries.flushScheduled)
+        return;
+
+    key_queries.flushScheduled = true;
+    QTimer::singleShot(KEY_QUERY_COALESCE_MS, this, &Cache::flushKeyQueries);
+}
+
+void
+Cache::flushKeyQueries()
+{
+    std::map<std::string, std::map<std::string, std::vector<KeyQueryQueue::Callback>>> batches;
+    {
+        std::unique_lock<std::mutex> lock(key_queries.mtx);
+        key_queries.flushScheduled = false;
+        std::swap(batches, key_queries.pending);
+
+        for (auto &[token, users] : batches) {
+            for (auto it = users.begin(); it != users.end();) {
+                auto &[user, callbacks] = *it;
+
+                // Only one query per user may run, finishKeyQuery resolves all its callbacks.
+                if (auto running = key_queries.inflight.find(user);
+                    running != key_queries.inflight.end()) {
+                    auto &next = running->second.token == token ? running->second
+                                                                : key_queries.queued[user];
+                    next.token = token;
+                    std::move(
+                      callbacks.begin(), callbacks.end(), std::back_inserter(next.callbacks));
+                    it = users.erase(it);
+                    continue;
+                }
+
+                auto &query = key_queries.inflight[user];
+                query.token = token;
+                std::move(
+                  callbacks.begin(), callbacks.end(), std::back_inserter(query.callbacks));
+                ++it;
+            }
+        }
+    }
+
+    for (const auto &[token, users] : batches) {
+        if (users.empty())
+            continue;
+
+        mtx::requests::QueryKeys req;
+        req.token = token;
+
+        std::vector<std::string> batchUsers;
+        for (const auto &[user, callbacks] : users) {
+            (void)callbacks;
+            req.device_keys[user] = {};
+            batchUsers.push_back(user);
+
+            if (batchUsers.size() >= MAX_KEY_QUERY_USERS) {
+                sendKeyQuery(req, std::move(batchUsers));
+                req.device_keys.clear();
+                batchUsers.clear();
+            }
+        }
+
+        if (!batchUsers.empty())
+            sendKeyQuery(req, std::move(batchUsers));
+    }
+}
+
+void
+Cache::sendKeyQuery(const mtx::requests::QueryKeys &req, std::vector<std::string> users)
+{
+    nhlog::net()->debug("querying device keys of {} users", users.size());
 
     http::client()->query_keys(
       req,
-      [cb, user_id, last_changed, this](const mtx::responses::QueryKeys &res,
-                                        mtx::http::RequestErr err) {
+      [this, token = req.token, users = std::move(users)](const mtx::responses::QueryKeys &res,
+                                                          mtx::http::RequestErr err) {
           if (err) {
               nhlog::net()->warn("failed to query device keys: {},{}",
                                  mtx::errors::to_string(err->matrix_error.errcode),
                                  static_cast<int>(err->status_code));
-              cb({}, err);
+              finishKeyQuery(users, err);
               return;
           }
 
-          emit userKeysUpdate(last_changed, res);
-          emit userKeysUpdateFinalize(user_id);
+          emit userKeysUpdate(token, res);
+          // queued after the update above, so the callbacks see the new keys
+          QTimer::singleShot(0, this, [this, users] { finishKeyQuery(users, std::nullopt); });
       });
 }
 
+void
+Cache::finishKeyQuery(const std::vector<std::string> &users,
+                      const std::optional<mtx::http::ClientError> &err)
+{
+    std::map<std::string, std::vector<KeyQueryQueue::Callback>> finished;
+    {
+        std::unique_lock<std::mutex> lock(key_queries.mtx);
+        for (const auto &user : users) {
+            if (auto it = key_queries.inflight.find(user); it != key_queries.inflight.end()) {
+                finished[user] = std::move(it->second.callbacks);
+                key_queries.inflight.erase(it);
+            }
+
+            if (auto it = key_queries.queued.find(user); it != key_queries.queued.end()) {
+                auto &callbacks = key_queries.pending[it->second.token][user];
+                std::move(it->second.callbacks.begin(),
+                          it->second.callbacks.end(),
+                          std::back_inserter(callbacks));
+                key_queries.queued.erase(it);
+                scheduleKeyQueries();
+            }
+        }
+    }
+
+    for (const auto &[user, callbacks] : finished) {
+        UserKeyCache keys{};
+        if (!err) {
+            auto txn = ro_txn(db->env_);
+            keys     = userKeys_(user, txn).value_or(UserKeyCache{});
+        }
+
+        for (const auto &cb : callbacks)
+            cb(keys, err);
+    }
+}
+
 void
 to_json(nlohmann::json &j, const VerificationCache &info)
 {
@@ -5520,6 +6112,8 @@ Cache::markDeviceVerified(const std::string &user_id, const std::string &key)
         }
     }
 
+    invalidateKeyRecipients(user_id);
+
     const auto local_user = utils::localUser().toStdString();
     std::map<std::string, VerificationStatus> tmp;
     {
@@ -5563,6 +6157,8 @@ Cache::markDeviceUnverified(const std::string &user_id, const std::string &key)
     } catch (std::exception &) {
     }
 
+    invalidateKeyRecipients(user_id);
+
     const auto local_user = utils::localUser().toStdString();
     std::map<std::string, VerificationStatus> tmp;
     {
@@ -5914,6 +6510,23 @@ from_json(const nlohmann::json &obj, StoredOlmSession &msg)
     msg.pickled_session = obj.at("s").get<std::string>();
 }
 
+void
+to_json(nlohmann::json &obj, const OlmSessionMeta &msg)
+{
+    obj["c"]  = msg.created_ts;
+    obj["u"]  = msg.last_used_ts;
+    obj["tx"] = msg.messages_sent;
+    obj["rx"] = msg.messages_received;
+}
+void
+from_json(const nlohmann::json &obj, OlmSessionMeta &msg)
+{
+    msg.created_ts        = obj.value("c", uint64_t{0});
+    msg.last_used_ts      = obj.value("u", uint64_t{0});
+    msg.messages_sent     = obj.value("tx", uint32_t{0});
+    msg.messages_received = obj.value("rx", uint32_t{0});
+}
+
 namespace cache {
 void
 setNeedsCompactFlag()
@@ -6292,10 +6905,12 @@ importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys)
 {
     instance_->importSessionKeys(keys);
 }
-mtx::crypto::ExportedSessionKeys
-exportSessionKeys()
+std::size_t
+exportSessionKeys(
+  const std::function<bool(const mtx::crypto::ExportedSession &, std::size_t, std::size_t)>
+    &callback)
 {
-    return instance_->exportSessionKeys();
+    return instance_->exportSessionKeys(callback);
 }
 
 //
@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <functional>
+
 #include <QDateTime>
 #include <QString>
 
@@ -215,8 +217,13 @@ dropOutboundMegolmSession(const std::string &room_id);
 
 void
 importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys);
-mtx::crypto::ExportedSessionKeys
-exportSessionKeys();
+//! Walk all inbound megolm sessions and hand them to callback one by one. The callback receives
+//! the number of sessions visited so far and the total and can return false to stop early.
+//! Returns the number of sessions exported.
+std::size_t
+exportSessionKeys(
+  const std::function<bool(const mtx::crypto::ExportedSession &, std::size_t, std::size_t)>
+    &callback);
 
 //
 // Inbound Megolm Sessions
@@ -7,7 +7,9 @@
 #include <QObject>
 #include <QQmlEngine>
 
+#include <cstdint>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <set>
 
@@ -122,6 +124,20 @@ to_json(nlohmann::json &obj, const StoredOlmSession &msg);
 void
 from_json(const nlohmann::json &obj, StoredOlmSession &msg);
 
+//! Small summary of an olm session, stored next to the pickle, so that sessions can be ranked
+//! without loading them. Timestamps are in milliseconds.
+struct OlmSessionMeta
+{
+    std::uint64_t created_ts        = 0;
+    std::uint64_t last_used_ts      = 0;
+    std::uint32_t messages_sent     = 0;
+    std::uint32_t messages_received = 0;
+};
+void
+to_json(nlohmann::json &obj, const OlmSessionMeta &msg);
+void
+from_json(const nlohmann::json &obj, OlmSessionMeta &msg);
+
 //! Verification status of a single user
 struct VerificationStatus
 {
@@ -145,6 +161,27 @@ struct VerificationStorage
     std::mutex verification_storage_mtx;
 };
 
+//! Devices a room key has to be shared with, user id -> device ids.
+using KeyRecipients = std::map<std::string, std::set<std::string>>;
+
+//! In memory cache of the devices each encrypted room shares its megolm sessions with.
+struct KeyRecipientsStorage
+{
+    struct Room
+    {
+        std::shared_ptr<const KeyRecipients> recipients;
+        bool verified_only = false;
+        //! users whose membership or keys changed, mapped to the id of the lmdb write
+        //! transaction that changed them (0 if it is already committed)
+        std::map<std::string, std::uint64_t> dirty;
+    };
+
+    std::map<std::string, Room> rooms;
+    //! id of the newest write transaction that changed any room membership
+    std::uint64_t last_member_change = 0;
+    std::mutex mtx;
+};
+
 //! In memory cache of verification status
 struct SecretsStorage
 {
@@ -4,12 +4,14 @@
 
 #pragma once
 
+#include <functional>
 #include <optional>
 
 #include <QDateTime>
 #include <QString>
 
 #include <mtx/events/collections.hpp>
+#include <mtx/requests.hpp>
 #include <mtx/responses/notifications.hpp>
 #include <mtx/responses/sync.hpp>
 #include <mtxclient/crypto/types.hpp>
@@ -46,8 +48,10 @@ public:
     mtx::events::presence::Presence presence(const std::string &user_id);
 
     // user cache stores user keys
-    std::map<std::string, std::optional<UserKeyCache>>
-    getMembersWithKeys(const std::string &room_id, bool verified_only);
+    //! Members and their devices, that room keys should be shared with. Kept up to date
+    //! incrementally on membership and device list changes, so repeated calls are cheap.
+    std::shared_ptr<const KeyRecipients>
+    roomKeyRecipients(const std::string &room_id, bool verified_only);
     void updateUserKeys(const std::string &sync_token, const mtx::responses::QueryKeys &keyQuery);
     void markUserKeysOutOfDate(const std::vector<std::string> &user_ids);
     void markUserKeysOutOfDate(lmdb::txn &txn,
@@ -117,6 +121,16 @@ public:
     std::vector<RoomMember> getMembersFromInvite(const std::string &room_id,
                                                  std::size_t startIndex = 0,
                                                  std::size_t len        = 30);
+    //! Members, whose display name, a word of it or their user id starts with prefix. The prefix
+    //! is matched case insensitively.
+    std::vector<RoomMember>
+    searchMembers(const std::string &room_id, const QString &prefix, std::size_t limit = 30);
+    //! Senders of the last messages in a room, who are still members. Most recent first and
+    //! without duplicates.
+    std::vector<RoomMember> recentSenders(const std::string &room_id, std::size_t messages = 100);
+    //! The case folded terms a member is found by in searchMembers.
+    static std::vector<std::string> memberSearchTerms(std::string_view user_id,
+                                                      const std::string &display_name);
     size_t memberCount(const std::string &room_id);
 
     void updateState(const std::string &room,
@@ -254,7 +268,9 @@ public:
     void dropOutboundMegolmSession(const std::string &room_id);
 
     void importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys);
-    mtx::crypto::ExportedSessionKeys exportSessionKeys();
+    std::size_t exportSessionKeys(
+      const std::function<bool(const mtx::crypto::ExportedSession &, std::size_t, std::size_t)>
+        &callback);
 
     //
     // Inbound Megolm Sessions
@@ -278,6 +294,8 @@ public:
     std::optional<mtx::crypto::OlmSessionPtr>
     getOlmSession(const std::string &curve25519, const std::string &session_id);
     std::optional<mtx::crypto::OlmSessionPtr> getLatestOlmSession(const std::string &curve25519);
+    //! Delete old olm sessions, that are unlikely to ever be used again.
+    void pruneOlmSessions();
 
     void saveOlmAccount(const std::string &pickled);
     std::string restoreOlmAccount();
@@ -301,7 +319,6 @@ signals:
     void newReadReceipts(const QString &room_id, const std::vector<QString> &event_ids);
     void roomReadStatus(const std::map<QString, bool> &status);
     void userKeysUpdate(const std::string &sync_token, const mtx::responses::QueryKeys &keyQuery);
-    void userKeysUpdateFinalize(const std::string &user_id);
     void verificationStatusChanged(const std::string &userid);
     void selfVerificationStatusChanged();
     void secretChanged(const std::string name);
@@ -352,6 +369,13 @@ private:
                          const std::string &room_id,
                          const std::vector<T> &events);
 
+    //! Writes or, without info, removes a member and updates its terms in member_search.
+    void updateMember(lmdb::txn &txn,
+                      lmdb::dbi &membersdb,
+                      const std::string &room_id,
+                      const std::string &user_id,
+                      const std::optional<MemberInfo> &info);
+
     template<class T>
     void saveStateEvent(lmdb::txn &txn,
                         lmdb::dbi &statesdb,
@@ -413,6 +437,9 @@ private:
 
     lmdb::dbi getMembersDb(lmdb::txn &txn, const std::string &room_id);
 
+    //! Maps the search terms of the members of a room to their user ids.
+    lmdb::dbi getMemberSearchDb(lmdb::txn &txn, const std::string &room_id);
+
     lmdb::dbi getUserKeysDb(lmdb::txn &txn);
 
     lmdb::dbi getVerificationDb(lmdb::txn &txn);
@@ -421,6 +448,36 @@ private:
 
     std::optional<VerificationCache> verificationCache(const std::string &user_id, lmdb::txn &txn);
     VerificationStatus verificationStatus_(const std::string &user_id, lmdb::txn &txn);
+    bool memberKeysForSharing_(lmdb::txn &txn,
+                               lmdb::dbi &keysDb,
+                               const std::string &user_id,
+                               bool verified_only,
+                               std::optional<UserKeyCache> &keys);
+    void addKeyRecipient_(lmdb::txn &txn,
+                          lmdb::dbi &keysDb,
+                          KeyRecipients &recipients,
+                          const std::string &user_id,
+                          bool verified_only);
+    void markKeyRecipientChanged(const std::string &room_id,
+                                 const std::string &user_id,
+                                 std::uint64_t txn_id);
+    void invalidateKeyRecipients(const std::string &user_id);
+
+    void putOlmSession(lmdb::txn &txn,
+                       const std::string &curve25519,
+                       mtx::crypto::OlmSessionPtr &session,
+                       uint64_t timestamp,
+                       bool received);
+    //! Session ids of curve25519, most recently used first.
+    std::vector<std::pair<std::string, OlmSessionMeta>>
+    olmSessionsByLastUse(lmdb::txn &txn, const std::string &curve25519);
+
+    //! Must be called with key_queries.mtx held.
+    void scheduleKeyQueries();
+    void flushKeyQueries();
+    void sendKeyQuery(const mtx::requests::QueryKeys &req, std::vector<std::string> users);
+    void finishKeyQuery(const std::vector<std::string> &users,
+                        const std::optional<mtx::http::ClientError> &err);
     std::optional<UserKeyCache> userKeys_(const std::string &user_id, lmdb::txn &txn);
 
     void setNextBatchToken(lmdb::txn &txn, const std::string &token);
@@ -431,6 +488,29 @@ private:
     std::string pickle_secret_;
 
     VerificationStorage verification_storage;
+    KeyRecipientsStorage key_recipients;
+
+    //! /keys/query requests, that wait to be batched or for the server to respond.
+    struct KeyQueryQueue
+    {
+        using Callback =
+          std::function<void(const UserKeyCache &, const std::optional<mtx::http::ClientError> &)>;
+
+        //! sync token -> user id -> callbacks, not sent yet
+        std::map<std::string, std::map<std::string, std::vector<Callback>>> pending;
+        struct Query
+        {
+            std::string token;
+            std::vector<Callback> callbacks;
+        };
+        //! user id -> query, waiting for a response
+        std::map<std::string, Query> inflight;
+        //! user id -> query for a newer token, sent once the inflight one finished
+        std::map<std::string, Query> queued;
+        bool flushScheduled = false;
+        std::mutex mtx;
+    };
+    KeyQueryQueue key_queries;
 
     bool databaseReady_ = false;
 
@@ -210,8 +210,7 @@ ChatPage::ChatPage(QSharedPointer<UserSettings> userSettings, QObject *parent)
             const auto local_user = utils::localUser().toStdString();
 
             // Desktop notifications to be sent
-            std::vector<std::tuple<QSharedPointer<TimelineModel>,
-                                   mtx::events::collections::TimelineEvents,
+            std::vector<std::tuple<mtx::events::collections::TimelineEvents,
                                    std::string,
                                    std::vector<mtx::pushrules::actions::Action>>>
               notifications;
@@ -258,17 +257,17 @@ ChatPage::ChatPage(QSharedPointer<UserSettings> userSettings, QObject *parent)
                 if (!room.timeline.events.empty() &&
                     (room.unread_notifications.notification_count ||
                      room.unread_notifications.highlight_count)) {
+                    // Rooms, which aren't loaded, are evaluated from the cache, so that
+                    // notifications don't load their timeline.
                     auto roomModel =
-                      view_manager_->rooms()->getRoomById(QString::fromStdString(room_id));
-
-                    if (!roomModel) {
-                        continue;
-                    }
+                      view_manager_->rooms()->loadedRoomById(QString::fromStdString(room_id));
 
                     auto currentReadMarker =
                       cache::getEventIndex(room_id, cache::client()->getFullyReadEventId(room_id));
 
-                    auto ctx = roomModel->pushrulesRoomContext();
+                    auto ctx = roomModel
+                                 ? roomModel->pushrulesRoomContext()
+                                 : TimelineModel::pushrulesRoomContext(room_id);
                     std::vector<
                       std::pair<mtx::common::Relation, mtx::events::collections::TimelineEvents>>
                       relatedEvents;
@@ -330,11 +329,11 @@ ChatPage::ChatPage(QSharedPointer<UserSettings> userSettings, QObject *parent)
                                 cache::markSentNotification(event_id);
 
                                 // Don't send a notification when the current room is opened.
-                                if (isRoomActive(roomModel->roomId()))
+                                if (isRoomActive(QString::fromStdString(room_id)))
                                     continue;
 
                                 if (userSettings_->hasDesktopNotifications()) {
-                                    notifications.emplace_back(roomModel, te, room_id, actions);
+                                    notifications.emplace_back(te, room_id, actions);
                                 }
                             }
                         }
@@ -342,9 +341,9 @@ ChatPage::ChatPage(QSharedPointer<UserSettings> userSettings, QObject *parent)
                 }
             }
             if (notifications.size() <= 5) {
-                for (const auto &[roomModel, te, room_id, actions] : notifications) {
+                for (const auto &[te, room_id, actions] : notifications) {
                     AvatarProvider::resolve(
-                      roomModel->roomAvatarUrl(),
+                      QString::fromStdString(cache::singleRoomInfo(room_id).avatar_url),
                       96,
                       this,
                       [this, te_ = te, room_id_ = room_id, actions_ = actions](QPixmap image) {
@@ -361,14 +360,14 @@ ChatPage::ChatPage(QSharedPointer<UserSettings> userSettings, QObject *parent)
                       });
                 }
             } else if (!notifications.empty()) {
-                std::map<QSharedPointer<TimelineModel>, std::size_t> missedEvents;
-                for (const auto &[roomModel, te, room_id, actions] : notifications) {
-                    missedEvents[roomModel]++;
+                std::map<std::string, std::size_t> missedEvents;
+                for (const auto &[te, room_id, actions] : notifications) {
+                    missedEvents[room_id]++;
                 }
                 QString body;
-                for (const auto &[roomModel, nbNotifs] : missedEvents) {
+                for (const auto &[room_id, nbNotifs] : missedEvents) {
                     body += tr("%n unread message(s) in room %1\n", nullptr, nbNotifs)
-                              .arg(roomModel->roomName());
+                              .arg(QString::fromStdString(cache::singleRoomInfo(room_id).name));
                 }
                 emit notificationsManager->systemPostNotificationCb(
                   "", "", "New messages while away", body, QImage());
@@ -512,7 +511,7 @@ ChatPage::bootstrap(QString userid, QString homeserver, QString token)
 
     http::client()->set_server(homeserver.toStdString());
     http::client()->set_access_token(token.toStdString());
-    http::client()->verify_certificates(!UserSettings::instance()->disableCertificateValidation());
+    http::verifyCertificates(!UserSettings::instance()->disableCertificateValidation());
 
     // The Olm client needs the user_id & device_id that will be included
     // in the generated payloads & keys.
@@ -863,7 +862,7 @@ ChatPage::handleSyncResponse(const mtx::responses::Sync &res, const std::string
 
                 for (const auto &room : roomsToReload) {
                     if (auto model =
-                          view_manager_->rooms()->getRoomById(QString::fromStdString(room)))
+                          view_manager_->rooms()->loadedRoomById(QString::fromStdString(room)))
                         model->clearTimeline();
                 }
             }
@@ -20,45 +20,9 @@ CompletionProxyModel::CompletionProxyModel(QAbstractItemModel *model,
 {
     setSourceModel(model);
 
-    auto insertParts = [this](const QString &str, int id) {
-        QTextBoundaryFinder finder(QTextBoundaryFinder::BoundaryType::Word, str);
-        finder.toStart();
-        do {
-            auto start = finder.position();
-            finder.toNextBoundary();
-            auto end = finder.position();
-
-            auto ref = QStringView(str).mid(start, end - start).trimmed();
-            if (!ref.isEmpty())
-                trie_.insert<ElementRank::second>(ref.toUcs4(), id);
-        } while (finder.position() < str.size());
-    };
-
     const auto start_at = std::chrono::steady_clock::now();
 
-    // insert full texts and partial matches
-    for (int i = 0; i < sourceModel()->rowCount(); i++) {
-        // full texts are ranked first and partial matches second
-        // that way when searching full texts will be first in result list
-
-        auto string1 = sourceModel()
-                         ->data(sourceModel()->index(i, 0), CompletionModel::SearchRole)
-                         .toString()
-                         .toCaseFolded();
-        if (!string1.isEmpty()) {
-            trie_.insert<ElementRank::first>(string1.toUcs4(), i);
-            insertParts(string1, i);
-        }
-
-        auto string2 = sourceModel()
-                         ->data(sourceModel()->index(i, 0), CompletionModel::SearchRole2)
-                         .toString()
-                         .toCaseFolded();
-        if (!string2.isEmpty()) {
-            trie_.insert<ElementRank::first>(string2.toUcs4(), i);
-            insertParts(string2, i);
-        }
-    }
+    insertEntries(0, sourceModel()->rowCount() - 1);
 
     const auto end_at     = std::chrono::steady_clock::now();
     const auto build_time = std::chrono::duration<double, std::milli>(end_at - start_at);
@@ -68,6 +32,39 @@ CompletionProxyModel::CompletionProxyModel(QAbstractItemModel *model,
     mapping.resize(std::min(max_completions_, static_cast<size_t>(model->rowCount())));
     std::iota(mapping.begin(), mapping.end(), 0);
 
+    // Only index the rows, that actually changed.
+    connect(model,
+            &QAbstractItemModel::rowsInserted,
+            this,
+            [this](const QModelIndex &, int first, int last) {
+                insertEntries(first, last);
+                invalidate();
+            });
+    connect(model,
+            &QAbstractItemModel::rowsRemoved,
+            this,
+            [this](const QModelIndex &, int first, int last) {
+                removeEntries(first, last);
+                invalidate();
+            });
+    connect(model,
+            &QAbstractItemModel::dataChanged,
+            this,
+            [this](const QModelIndex &topLeft,
+                   const QModelIndex &bottomRight,
+                   const QList<int> &roles) {
+                if (!roles.isEmpty() && !roles.contains(CompletionModel::SearchRole) &&
+                    !roles.contains(CompletionModel::SearchRole2))
+                    return;
+
+                updateEntries(topLeft.row(), bottomRight.row());
+                invalidate();
+            });
+    connect(model, &QAbstractItemModel::modelReset, this, [this]() {
+        rebuild();
+        invalidate();
+    });
+
     connect(
       this,
       &CompletionProxyModel::newSearchString,
@@ -79,13 +76,122 @@ CompletionProxyModel::CompletionProxyModel(QAbstractItemModel *model,
       Qt::QueuedConnection);
 }
 
+int
+CompletionProxyModel::addEntry(int row)
+{
+    auto id = static_cast<int>(entryRows.size());
+    entryRows.push_back(row);
+
+    auto insertParts = [this, id](const QString &str) {
+        QTextBoundaryFinder finder(QTextBoundaryFinder::BoundaryType::Word, str);
+        finder.toStart();
+        do {
+            auto start = finder.position();
+            finder.toNextBoundary();
+            auto end = finder.position();
+
+            auto ref = QStringView(str).mid(start, end - start).trimmed();
+            if (!ref.isEmpty())
+                trie_.insert<ElementRank::second>(ref.toUcs4(), id);
+        } while (finder.position() < str.size());
+    };
+
+    // full texts are ranked first and partial matches second
+    // that way when searching full texts will be first in result list
+    auto string1 = sourceModel()
+                     ->data(sourceModel()->index(row, 0), CompletionModel::SearchRole)
+                     .toString()
+                     .toCaseFolded();
+    if (!string1.isEmpty()) {
+        trie_.insert<ElementRank::first>(string1.toUcs4(), id);
+        insertParts(string1);
+    }
+
+    auto string2 = sourceModel()
+                     ->data(sourceModel()->index(row, 0), CompletionModel::SearchRole2)
+                     .toString()
+                     .toCaseFolded();
+    if (!string2.isEmpty()) {
+        trie_.insert<ElementRank::first>(string2.toUcs4(), id);
+        insertParts(string2);
+    }
+
+    return id;
+}
+
+void
+CompletionProxyModel::insertEntries(int first, int last)
+{
+    if (last < first)
+        return;
+
+    std::vector<int> ids;
+    ids.reserve(last - first + 1);
+    for (int row = first; row <= last; row++)
+        ids.push_back(addEntry(row));
+    rowEntries.insert(rowEntries.begin() + first, ids.begin(), ids.end());
+
+    for (int row = last + 1; row < (int)rowEntries.size(); row++)
+        entryRows[rowEntries[row]] = row;
+}
+
+void
+CompletionProxyModel::removeEntries(int first, int last)
+{
+    for (int row = first; row <= last; row++)
+        entryRows[rowEntries[row]] = -1;
+    removedEntries += last - first + 1;
+    rowEntries.erase(rowEntries.begin() + first, rowEntries.begin() + last + 1);
+
+    for (int row = first; row < (int)rowEntries.size(); row++)
+        entryRows[rowEntries[row]] = row;
+
+    // The trie can't remove values, so start over once most of it is garbage.
+    if (removedEntries > rowEntries.size())
+        rebuild();
+}
+
+void
+CompletionProxyModel::updateEntries(int first, int last)
+{
+    for (int row = std::max(first, 0); row <= last && row < (int)rowEntries.size(); row++) {
+        entryRows[rowEntries[row]] = -1;
+        removedEntries += 1;
+        rowEntries[row] = addEntry(row);
+    }
+
+    if (removedEntries > rowEntries.size())
+        rebuild();
+}
+
+void
+CompletionProxyModel::rebuild()
+{
+    trie_ = {};
+    rowEntries.clear();
+    entryRows.clear();
+    removedEntries = 0;
+    insertEntries(0, sourceModel()->rowCount() - 1);
+}
+
 void
 CompletionProxyModel::invalidate()
 {
     auto key = searchString_.toUcs4();
     beginResetModel();
-    if (!key.empty()) // return default model data, if no search string
-        mapping = trie_.search(key, max_completions_, maxMistakes_);
+    if (!key.empty()) { // return default model data, if no search string
+        // Entries of removed rows still take up space in the results.
+        auto entries = trie_.search(
+          key, max_completions_ + std::min(removedEntries, max_completions_ * 4), maxMistakes_);
+
+        mapping.clear();
+        for (auto entry : entries) {
+            if (mapping.size() >= max_completions_)
+                break;
+            if (auto row = entryRows[entry]; row != -1)
+                mapping.push_back(row);
+        }
+    }
     endResetModel();
 }
 
@@ -9,7 +9,10 @@
 #include <QAbstractProxyModel>
 
 #include <algorithm>
+#include <cstdint>
+#include <limits>
 #include <span>
+#include <vector>
 
 enum class ElementRank
 {
@@ -17,27 +20,37 @@ enum class ElementRank
     second
 };
 
+//! A prefix tree, that finds values by keys with a limited number of mistakes.
+//!
+//! Nodes and values are stored in two arrays and linked by index, so that building the tree does
+//! not allocate per node. Siblings are sorted by key.
 template<typename Key, typename Value>
-struct trie
+class trie
 {
-    std::vector<std::pair<ElementRank, Value>> values;
-    std::map<Key, trie> next;
-
+public:
     template<ElementRank r>
     void insert(const QVector<Key> &keys, const Value &v)
     {
-        auto t = this;
-        for (const auto k : keys) {
-            t = &t->next[k];
+        std::uint32_t t = 0;
+        for (const auto k : keys)
+            t = child(t, k);
+
+        auto idx = static_cast<std::uint32_t>(values.size());
+        values.push_back(ValueEntry{r, v, npos});
+
+        // values ranked first go before all values ranked second
+        std::uint32_t prev = npos;
+        std::uint32_t cur  = nodes[t].firstValue;
+        while (cur != npos && (r == ElementRank::second || values[cur].rank == r)) {
+            prev = cur;
+            cur  = values[cur].next;
         }
 
-        if constexpr (r == ElementRank::first) {
-            auto it =
-              std::ranges::upper_bound(t->values, r, {}, &std::pair<ElementRank, Value>::first);
-            t->values.emplace(it, r, v);
-        } else if constexpr (r == ElementRank::second) {
-            t->values.emplace_back(r, v);
-        }
+        values[idx].next = cur;
+        if (prev == npos)
+            nodes[t].firstValue = idx;
+        else
+            values[prev].next = idx;
     }
 
     std::vector<Value> valuesAndSubvalues(size_t limit = -1) const
@@ -46,118 +59,174 @@ struct trie
         if (limit < 200)
             ret.reserve(limit);
 
-        for (const auto &v : values) {
-            if (ret.size() >= limit)
-                return ret;
-            else
-                ret.push_back(v.second);
-        }
-
-        for (const auto &[k, t] : next) {
-            (void)k;
-            if (ret.size() >= limit)
-                return ret;
-            else {
-                auto temp = t.valuesAndSubvalues(limit - ret.size());
-                for (auto &&v : temp) {
-                    if (ret.size() >= limit)
-                        return ret;
-
-                    if (std::find(ret.begin(), ret.end(), v) == ret.end()) {
-                        ret.push_back(std::move(v));
-                    }
-                }
-            }
-        }
-
+        appendSubtree(0, ret, limit);
         return ret;
     }
 
+    //! Finds the values of all keys starting with something within max_edit_distance edits of
+    //! keys. Values with fewer edits come first.
+    //!
+    //! This uses the bit-parallel edit distance of Myers (with the global alignment changes by
+    //! Hyyrö), so only the first 64 keys are considered.
     std::vector<Value> search(const std::span<Key> &keys,
                               size_t result_count_limit,
                               size_t max_edit_distance_ = 2) const
     {
-        std::vector<Value> ret;
         if (!result_count_limit)
-            return ret;
+            return {};
 
         if (keys.empty())
             return valuesAndSubvalues(result_count_limit);
 
-        auto append = [&ret, result_count_limit](std::vector<Value> &&in) {
-            for (auto &&v : in) {
-                if (ret.size() >= result_count_limit)
-                    return;
-
-                if (std::find(ret.begin(), ret.end(), v) == ret.end()) {
-                    ret.push_back(std::move(v));
-                }
-            }
-        };
-
-        auto limit = [&ret, result_count_limit] {
-            return std::min(result_count_limit, (result_count_limit - ret.size()) * 2);
-        };
-
-        // Try first exact matches, then with maximum errors
-        for (size_t max_edit_distance = 0;
-             max_edit_distance <= max_edit_distance_ && ret.size() < result_count_limit;
-             max_edit_distance += 1) {
-            if (max_edit_distance && ret.size() < result_count_limit) {
-                max_edit_distance -= 1;
-
-                // swap chars case
-                if (keys.size() >= 2) {
-                    auto t = this;
-                    for (int i = 1; i >= 0; i--) {
-                        if (auto e = t->next.find(keys[i]); e != t->next.end()) {
-                            t = &e->second;
-                        } else {
-                            t = nullptr;
-                            break;
-                        }
-                    }
-
-                    if (t) {
-                        append(t->search(keys.subspan(2), limit(), max_edit_distance));
-                    }
-                }
-
-                // insert case
-                for (const auto &[k, t] : this->next) {
-                    if (k == keys[0])
-                        continue;
-                    if (ret.size() >= limit())
-                        break;
-
-                    // insert
-                    append(t.search(keys, limit(), max_edit_distance));
-                }
-
-                // delete character case
-                append(this->search(keys.subspan(1), limit(), max_edit_distance));
-
-                // substitute case
-                for (const auto &[k, t] : this->next) {
-                    if (k == keys[0])
-                        continue;
-                    if (ret.size() >= limit())
-                        break;
-
-                    // substitute
-                    append(t.search(keys.subspan(1), limit(), max_edit_distance));
-                }
-
-                max_edit_distance += 1;
-            }
-
-            if (auto e = this->next.find(keys[0]); e != this->next.end()) {
-                append(e->second.search(keys.subspan(1), limit(), max_edit_distance));
-            }
+        Pattern p;
+        p.length  = std::min<size_t>(keys.size(), 64);
+        p.mask    = p.length == 64 ? ~std::uint64_t{0} : (std::uint64_t{1} << p.length) - 1;
+        p.maxEdit = max_edit_distance_;
+        for (size_t i = 0; i < p.length; i++) {
+            auto e = std::ranges::find(p.peq, keys[i], &std::pair<Key, std::uint64_t>::first);
+            if (e == p.peq.end())
+                p.peq.emplace_back(keys[i], std::uint64_t{1} << i);
+            else
+                e->second |= std::uint64_t{1} << i;
+        }
+
+        std::vector<std::pair<size_t, std::uint32_t>> matches;
+        collectMatches(p, 0, p.mask, 0, p.length, 0, matches);
+        std::ranges::stable_sort(matches, {}, &std::pair<size_t, std::uint32_t>::first);
+
+        std::vector<Value> ret;
+        if (result_count_limit < 200)
+            ret.reserve(result_count_limit);
+        for (const auto &[distance, node] : matches) {
+            (void)distance;
+            if (ret.size() >= result_count_limit)
+                break;
+            appendSubtree(node, ret, result_count_limit);
         }
 
         return ret;
     }
+
+private:
+    static constexpr std::uint32_t npos = std::numeric_limits<std::uint32_t>::max();
+
+    struct Node
+    {
+        Key key{};
+        std::uint32_t firstChild  = npos;
+        std::uint32_t nextSibling = npos;
+        std::uint32_t firstValue  = npos;
+    };
+
+    struct ValueEntry
+    {
+        ElementRank rank;
+        Value value;
+        std::uint32_t next;
+    };
+
+    struct Pattern
+    {
+        //! Bitmask of the positions of each key in the pattern.
+        std::vector<std::pair<Key, std::uint64_t>> peq;
+        size_t length;
+        std::uint64_t mask;
+        size_t maxEdit;
+
+        std::uint64_t eq(Key k) const
+        {
+            for (const auto &[key, bits] : peq)
+                if (key == k)
+                    return bits;
+            return 0;
+        }
+    };
+
+    std::uint32_t child(std::uint32_t parent, Key k)
+    {
+        std::uint32_t prev = npos;
+        std::uint32_t cur  = nodes[parent].firstChild;
+        while (cur != npos && nodes[cur].key < k) {
+            prev = cur;
+            cur  = nodes[cur].nextSibling;
+        }
+        if (cur != npos && nodes[cur].key == k)
+            return cur;
+
+        auto idx = static_cast<std::uint32_t>(nodes.size());
+        nodes.push_back(Node{k, npos, cur, npos});
+        if (prev == npos)
+            nodes[parent].firstChild = idx;
+        else
+            nodes[prev].nextSibling = idx;
+        return idx;
+    }
+
+    //! pv and mv are the vertical deltas of the edit distance column of the path to node, score
+    //! is the edit distance between the whole pattern and that path.
+    void collectMatches(const Pattern &p,
+                        std::uint32_t node,
+                        std::uint64_t pv,
+                        std::uint64_t mv,
+                        size_t score,
+                        size_t depth,
+                        std::vector<std::pair<size_t, std::uint32_t>> &matches) const
+    {
+        if (score <= p.maxEdit)
+            matches.emplace_back(score, node);
+
+        // Stop, if no prefix of the pattern is close enough to continue from.
+        size_t minimum = depth;
+        for (size_t i = 0, d = depth; i < p.length && minimum > p.maxEdit; i++) {
+            d       = d + ((pv >> i) & 1) - ((mv >> i) & 1);
+            minimum = std::min(minimum, d);
+        }
+        if (minimum > p.maxEdit)
+            return;
+
+        const std::uint64_t high = std::uint64_t{1} << (p.length - 1);
+        for (auto c = nodes[node].firstChild; c != npos; c = nodes[c].nextSibling) {
+            auto eq = p.eq(nodes[c].key);
+            auto xv = eq | mv;
+            auto xh = (((eq & pv) + pv) ^ pv) | eq;
+            auto ph = mv | ~(xh | pv);
+            auto mh = pv & xh;
+
+            auto nextScore = score;
+            if (ph & high)
+                nextScore++;
+            else if (mh & high)
+                nextScore--;
+
+            // the first row of a global alignment increases by one per key
+            ph = (ph << 1) | 1;
+            mh <<= 1;
+            collectMatches(p,
+                           c,
+                           (mh | ~(xv | ph)) & p.mask,
+                           (ph & xv) & p.mask,
+                           nextScore,
+                           depth + 1,
+                           matches);
+        }
+    }
+
+    void appendSubtree(std::uint32_t node, std::vector<Value> &ret, size_t limit) const
+    {
+        for (auto v = nodes[node].firstValue; v != npos; v = values[v].next) {
+            if (ret.size() >= limit)
+                return;
+            if (std::ranges::find(ret, values[v].value) == ret.end())
+                ret.push_back(values[v].value);
+        }
+
+        for (auto c = nodes[node].firstChild; c != npos && ret.size() < limit;
+             c = nodes[c].nextSibling)
+            appendSubtree(c, ret, limit);
+    }
+
+    std::vector<Node> nodes{Node{}};
+    std::vector<ValueEntry> values;
 };
 
 class CompletionProxyModel final : public QAbstractProxyModel
@@ -193,8 +262,22 @@ signals:
     void newSearchString(QString);
 
 private:
+    //! Indexes the search strings of a source row and returns the id of its entry.
+    int addEntry(int row);
+    void insertEntries(int first, int last);
+    void removeEntries(int first, int last);
+    void updateEntries(int first, int last);
+    void rebuild();
+
     QString searchString_;
+    //! Maps search strings to entry ids, so that rows can be moved without touching the trie.
     trie<uint, int> trie_;
+    //! The entry id of each source row.
+    std::vector<int> rowEntries;
+    //! The source row of each entry id, -1 for entries of removed or changed rows.
+    std::vector<int> entryRows;
+    //! Entries still in the trie, which don't belong to a row anymore.
+    size_t removedEntries = 0;
     std::vector<int> mapping;
     int maxMistakes_;
     size_t max_completions_;
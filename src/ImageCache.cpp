@@ -0,0 +1,74 @@
+// SPDX-FileCopyrightText: Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "ImageCache.h"
+
+#include <QCache>
+
+#include <mutex>
+
+namespace {
+constexpr qsizetype MAX_BYTES = 128 * 1024 * 1024;
+
+struct Entry
+{
+    QImage image;
+    QString path;
+    QByteArray data;
+};
+
+std::mutex mtx;
+QCache<QString, Entry> entries{MAX_BYTES};
+}
+
+namespace ImageCache {
+QString
+key(const QString &mxcId, const QSize &size, bool crop, double radius)
+{
+    return QStringLiteral("%1_%2x%3_%4_radius%5")
+      .arg(mxcId)
+      .arg(size.width())
+      .arg(size.height())
+      .arg(crop ? "crop" : "scale")
+      .arg(radius);
+}
+
+std::optional<Image>
+find(const QString &key)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    if (auto entry = entries.object(key); entry && !entry->image.isNull())
+        return Image{entry->image, entry->path};
+    return std::nullopt;
+}
+
+void
+insert(const QString &key, const QImage &image, const QString &path)
+{
+    if (image.isNull())
+        return;
+
+    std::unique_lock<std::mutex> lock(mtx);
+    entries.insert(key, new Entry{image, path, {}}, image.sizeInBytes());
+}
+
+std::optional<QByteArray>
+findData(const QString &mxcUrl)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    if (auto entry = entries.object(QStringLiteral("data:") + mxcUrl))
+        return entry->data;
+    return std::nullopt;
+}
+
+void
+insertData(const QString &mxcUrl, const QByteArray &data)
+{
+    if (data.isEmpty())
+        return;
+
+    std::unique_lock<std::mutex> lock(mtx);
+    entries.insert(QStringLiteral("data:") + mxcUrl, new Entry{{}, {}, data}, data.size());
+}
+}
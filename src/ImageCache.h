@@ -0,0 +1,39 @@
+// SPDX-FileCopyrightText: Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <QByteArray>
+#include <QImage>
+#include <QSize>
+#include <QString>
+
+#include <optional>
+
+//! Decoded media in memory, shared by the image providers, so that an image shown twice or
+//! reloaded after its delegate was recycled is not read from disk and decoded again. Entries are
+//! evicted least recently used first, once they exceed a budget in bytes. Thread safe.
+namespace ImageCache {
+struct Image
+{
+    QImage image;
+    //! The file in the media cache the image was loaded from.
+    QString path;
+};
+
+//! Key of an image scaled to size, cropped or scaled to fit and with rounded corners.
+QString
+key(const QString &mxcId, const QSize &size, bool crop, double radius);
+
+std::optional<Image>
+find(const QString &key);
+void
+insert(const QString &key, const QImage &image, const QString &path);
+
+//! The decrypted data of animated images, which are decoded frame by frame while playing.
+std::optional<QByteArray>
+findData(const QString &mxcUrl);
+void
+insertData(const QString &mxcUrl, const QByteArray &data);
+}
@@ -94,8 +94,7 @@ LoginPage::onMatrixIdEntered()
         emit lookingUpHsChanged();
 
         http::client()->set_server(user.hostname());
-        http::client()->verify_certificates(
-          !UserSettings::instance()->disableCertificateValidation());
+        http::verifyCertificates(!UserSettings::instance()->disableCertificateValidation());
         homeserver_ = QString::fromStdString(user.hostname());
         emit homeserverChanged();
 
@@ -4,12 +4,21 @@
 
 #include "MatrixClient.h"
 
+#include <atomic>
 #include <memory>
 
+#include <QCoreApplication>
 #include <QMetaType>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QNetworkRequest>
 #include <QObject>
+#include <QSslConfiguration>
+#include <QSslSocket>
 #include <QStandardPaths>
 #include <QString>
+#include <QUrl>
+#include <QUrlQuery>
 
 #include <mtx/responses.hpp>
 
@@ -17,6 +26,7 @@
 #include "UserSettingsPage.h"
 
 namespace http {
+static std::atomic<bool> verifyCertificates_ = true;
 
 mtx::http::Client *
 client()
@@ -43,6 +53,43 @@ is_logged_in()
     return !client()->access_token().empty();
 }
 
+void
+verifyCertificates(bool verify)
+{
+    verifyCertificates_ = verify;
+    client()->verify_certificates(verify);
+}
+
+QNetworkReply *
+uploadMedia(QIODevice *data, const QString &contentType, const QString &filename)
+{
+    static auto manager = new QNetworkAccessManager(QCoreApplication::instance());
+
+    QUrl url(QString::fromStdString(client()->server_url()) +
+             QStringLiteral("/_matrix/media/v3/upload"));
+    if (!filename.isEmpty()) {
+        QUrlQuery query;
+        query.addQueryItem(QStringLiteral("filename"), filename);
+        url.setQuery(query);
+    }
+
+    QNetworkRequest request(url);
+    request.setRawHeader("Authorization",
+                         "Bearer " + QByteArray::fromStdString(client()->access_token()));
+    request.setHeader(QNetworkRequest::ContentTypeHeader, contentType);
+    // Servers usually reject uploads without a length, so send one instead of using chunked
+    // encoding. The body is still read and sent in chunks.
+    request.setHeader(QNetworkRequest::ContentLengthHeader, data->size());
+    request.setAttribute(QNetworkRequest::DoNotBufferUploadDataAttribute, true);
+    if (!verifyCertificates_) {
+        auto ssl = request.sslConfiguration();
+        ssl.setPeerVerifyMode(QSslSocket::VerifyNone);
+        request.setSslConfiguration(ssl);
+    }
+
+    return manager->post(request, data);
+}
+
 void
 init()
 {
@@ -6,6 +6,10 @@
 
 #include <mtxclient/http/client.hpp>
 
+class QIODevice;
+class QNetworkReply;
+class QString;
+
 namespace http {
 mtx::http::Client *
 client();
@@ -13,6 +17,16 @@ client();
 bool
 is_logged_in();
 
+//! Sets if TLS certificates are verified, for the client and for requests made without it.
+void
+verifyCertificates(bool verify);
+
+//! Uploads media to the content repository while reading it from data, which has to stay valid
+//! until the reply finished. mtx::http::Client::upload needs all of the data in memory. The caller
+//! owns the reply.
+QNetworkReply *
+uploadMedia(QIODevice *data, const QString &contentType, const QString &filename);
+
 //! Initialize the http module
 void
 init();
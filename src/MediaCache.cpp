@@ -0,0 +1,349 @@
+// SPDX-FileCopyrightText: Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "MediaCache.h"
+
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QThreadPool>
+
+#include <nlohmann/json.hpp>
+
+#include "Logging.h"
+
+namespace {
+//! Files unused for longer than this are deleted, even if the cache is below its quota.
+constexpr qint64 MAX_AGE = 14 * 24 * 60 * 60;
+//! Evicting stops at this fraction of the quota, so that not every download evicts a file.
+constexpr double LOW_WATERMARK = 0.9;
+constexpr int INDEX_VERSION    = 1;
+
+qint64
+currentTime()
+{
+    return QDateTime::currentSecsSinceEpoch();
+}
+}
+
+MediaCache &
+MediaCache::instance()
+{
+    static MediaCache cache;
+    return cache;
+}
+
+MediaCache::MediaCache()
+  : dir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/media_cache")
+  , indexPath(dir + "/index.json")
+{
+    QDir().mkpath(dir);
+    load();
+}
+
+MediaCache::~MediaCache()
+{
+    save();
+}
+
+QString
+MediaCache::key(const QString &path) const
+{
+    return QDir(dir).relativeFilePath(path);
+}
+
+void
+MediaCache::touch(const QString &key, Entry &entry, qint64 now)
+{
+    lru.erase({entry.lastAccess, key});
+    entry.lastAccess = now;
+    lru.emplace(now, key);
+    dirty = true;
+}
+
+bool
+MediaCache::contains(const QString &path)
+{
+    QFileInfo info(path);
+    auto k = key(path);
+
+    std::unique_lock<std::mutex> lock(mtx);
+    auto it = entries.find(k);
+    if (!info.exists()) {
+        if (it != entries.end()) {
+            lru.erase({it->lastAccess, k});
+            totalBytes -= it->size;
+            entries.erase(it);
+            dirty = true;
+        }
+
+        stats_.misses++;
+        return false;
+    }
+
+    // Files written by an older version or not saved to the index before a crash.
+    if (it == entries.end()) {
+        it = entries.insert(k, Entry{info.size(), 0, {}, false});
+        lru.emplace(0, k);
+        totalBytes += info.size();
+    }
+
+    touch(k, *it, currentTime());
+    stats_.hits++;
+    return true;
+}
+
+void
+MediaCache::insert(const QString &path, std::string variant, bool encrypted)
+{
+    QFileInfo info(path);
+    if (!info.exists())
+        return;
+
+    auto k = key(path);
+
+    QStringList evicted;
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        auto it = entries.find(k);
+        if (it != entries.end()) {
+            lru.erase({it->lastAccess, k});
+            totalBytes -= it->size;
+        } else {
+            it = entries.insert(k, Entry{});
+        }
+
+        it->size       = info.size();
+        it->lastAccess = currentTime();
+        it->variant    = std::move(variant);
+        it->encrypted  = encrypted;
+        lru.emplace(it->lastAccess, k);
+        totalBytes += it->size;
+        dirty = true;
+
+        evicted = evict(k);
+    }
+
+    removeFiles(evicted);
+}
+
+void
+MediaCache::setQuota(qint64 bytes)
+{
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        quota = bytes;
+    }
+
+    QThreadPool::globalInstance()->start([this] {
+        QStringList evicted;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            evicted = evict();
+        }
+        removeFiles(evicted);
+    });
+}
+
+QStringList
+MediaCache::evict(const QString &keep)
+{
+    QStringList files;
+    if (quota <= 0 || totalBytes <= quota)
+        return files;
+
+    const auto target = static_cast<qint64>(static_cast<double>(quota) * LOW_WATERMARK);
+    for (auto it = lru.begin(); it != lru.end() && totalBytes > target;) {
+        if (it->second == keep) {
+            ++it;
+            continue;
+        }
+
+        auto entry = entries.find(it->second);
+        if (entry != entries.end()) {
+            totalBytes -= entry->size;
+            entries.erase(entry);
+        }
+        files.push_back(dir + '/' + it->second);
+        it = lru.erase(it);
+        stats_.evicted++;
+    }
+
+    dirty = true;
+    return files;
+}
+
+void
+MediaCache::removeFiles(const QStringList &files)
+{
+    if (files.isEmpty())
+        return;
+
+    for (const auto &file : files) {
+        if (!QFile::remove(file) && QFile::exists(file))
+            nhlog::net()->warn("Failed to delete cached media '{}'", file.toStdString());
+    }
+
+    nhlog::net()->debug("Deleted {} files from the media cache", files.size());
+}
+
+void
+MediaCache::maintenance()
+{
+    QStringList evicted;
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+
+        const auto cutoff = currentTime() - MAX_AGE;
+        while (!lru.empty() && lru.begin()->first < cutoff) {
+            auto entry = entries.find(lru.begin()->second);
+            if (entry != entries.end()) {
+                totalBytes -= entry->size;
+                entries.erase(entry);
+            }
+            evicted.push_back(dir + '/' + lru.begin()->second);
+            lru.erase(lru.begin());
+            stats_.evicted++;
+            dirty = true;
+        }
+
+        evicted += evict();
+    }
+
+    removeFiles(evicted);
+    save();
+
+    auto s = stats();
+    nhlog::net()->debug("Media cache: {} files, {} bytes, {} hits, {} misses, {} evicted",
+                        s.files,
+                        s.bytes,
+                        s.hits,
+                        s.misses,
+                        s.evicted);
+}
+
+MediaCache::Stats
+MediaCache::stats() const
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    auto s  = stats_;
+    s.bytes = totalBytes;
+    s.files = entries.size();
+    return s;
+}
+
+void
+MediaCache::load()
+{
+    QFile f(indexPath);
+    if (f.open(QIODevice::ReadOnly)) {
+        try {
+            auto data = f.readAll();
+            auto j    = nlohmann::json::parse(data.constData(), data.constData() + data.size());
+
+            if (j.value("version", 0) == INDEX_VERSION) {
+                std::unique_lock<std::mutex> lock(mtx);
+                for (const auto &file : j.at("files")) {
+                    auto k = QString::fromStdString(file.at(0).get<std::string>());
+                    Entry entry{
+                      file.at(1).get<qint64>(),
+                      file.at(2).get<qint64>(),
+                      file.at(3).get<std::string>(),
+                      file.at(4).get<bool>(),
+                    };
+
+                    lru.emplace(entry.lastAccess, k);
+                    totalBytes += entry.size;
+                    entries.insert(k, std::move(entry));
+                }
+
+                nhlog::net()->debug("Loaded media cache index with {} files", entries.size());
+                return;
+            }
+        } catch (const nlohmann::json::exception &e) {
+            nhlog::net()->warn("Failed to parse media cache index: {}", e.what());
+
+            std::unique_lock<std::mutex> lock(mtx);
+            entries.clear();
+            lru.clear();
+            totalBytes = 0;
+        }
+    }
+
+    nhlog::net()->info("No media cache index found, indexing cached media");
+    QThreadPool::globalInstance()->start([this] { scan(); });
+}
+
+void
+MediaCache::scan()
+{
+    QDirIterator it(dir, QDir::Files | QDir::NoDotAndDotDot, QDirIterator::Subdirectories);
+
+    std::size_t count = 0;
+    while (it.hasNext()) {
+        it.next();
+        auto info = it.fileInfo();
+        if (info.absoluteFilePath() == indexPath)
+            continue;
+
+        auto k = key(info.absoluteFilePath());
+
+        std::unique_lock<std::mutex> lock(mtx);
+        if (entries.contains(k))
+            continue;
+
+        Entry entry{
+          info.size(),
+          info.fileTime(QFile::FileTime::FileAccessTime).toSecsSinceEpoch(),
+          {},
+          false,
+        };
+        lru.emplace(entry.lastAccess, k);
+        totalBytes += entry.size;
+        entries.insert(k, std::move(entry));
+        dirty = true;
+        count++;
+    }
+
+    nhlog::net()->info("Indexed {} cached media files", count);
+}
+
+void
+MediaCache::save()
+{
+    std::unique_lock<std::mutex> saveLock(saveMtx);
+
+    QHash<QString, Entry> snapshot;
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!dirty)
+            return;
+
+        // implicitly shared, so this doesn't copy while holding the lock
+        snapshot = entries;
+        dirty    = false;
+    }
+
+    auto files = nlohmann::json::array();
+    for (auto it = snapshot.cbegin(); it != snapshot.cend(); ++it)
+        files.push_back(nlohmann::json::array(
+          {it.key().toStdString(), it->size, it->lastAccess, it->variant, it->encrypted}));
+
+    auto data = nlohmann::json{{"version", INDEX_VERSION}, {"files", std::move(files)}}.dump();
+
+    QSaveFile f(indexPath);
+    if (!f.open(QIODevice::WriteOnly) ||
+        f.write(data.data(), static_cast<qint64>(data.size())) !=
+          static_cast<qint64>(data.size()) ||
+        !f.commit()) {
+        nhlog::net()->warn("Failed to write media cache index: {}", f.errorString().toStdString());
+
+        std::unique_lock<std::mutex> lock(mtx);
+        dirty = true;
+    }
+}
@@ -0,0 +1,96 @@
+// SPDX-FileCopyrightText: Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <QHash>
+#include <QString>
+#include <QStringList>
+
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+
+//! Index of the files in the media_cache directory. It remembers the size and the last use of
+//! every file, so that the cache can be kept below a quota by deleting the least recently used
+//! files, without ever listing the directory. The index is stored next to the files and written
+//! periodically by maintenance(). All functions are thread safe.
+class MediaCache
+{
+public:
+    struct Entry
+    {
+        qint64 size = 0;
+        //! Seconds since epoch.
+        qint64 lastAccess = 0;
+        //! Which version of the media this is, for example "original" or "96x96_crop".
+        std::string variant;
+        //! If the file is stored encrypted.
+        bool encrypted = false;
+    };
+
+    struct Stats
+    {
+        uint64_t hits    = 0;
+        uint64_t misses  = 0;
+        uint64_t evicted = 0;
+        qint64 bytes     = 0;
+        qsizetype files  = 0;
+    };
+
+    static MediaCache &instance();
+
+    //! The directory media is cached in.
+    QString directory() const { return dir; }
+
+    //! Checks if a file is cached and marks it as used. Files, which exist but are missing from
+    //! the index, are added to it.
+    bool contains(const QString &path);
+    //! Adds a file after it was written to the cache. Evicts the least recently used files, if
+    //! the cache is now larger than the quota.
+    void insert(const QString &path, std::string variant, bool encrypted);
+
+    //! The maximum size of the cache in bytes. 0 means unlimited.
+    void setQuota(qint64 bytes);
+    //! Deletes files unused for too long and writes the index, if it changed.
+    void maintenance();
+
+    Stats stats() const;
+
+    MediaCache(const MediaCache &)            = delete;
+    MediaCache &operator=(const MediaCache &) = delete;
+
+private:
+    MediaCache();
+    ~MediaCache();
+
+    QString key(const QString &path) const;
+    void touch(const QString &key, Entry &entry, qint64 now);
+    //! Removes entries other than keep from the index, until the cache is below the low
+    //! watermark of the quota. Returns the files to delete, so that they can be deleted without
+    //! holding the lock.
+    QStringList evict(const QString &keep = {});
+    void removeFiles(const QStringList &files);
+
+    void load();
+    //! Builds the index from the files on disk. Only needed once, when no index exists yet.
+    void scan();
+    void save();
+
+    QString dir;
+    QString indexPath;
+
+    mutable std::mutex mtx;
+    //! Serializes writing the index file.
+    std::mutex saveMtx;
+    QHash<QString, Entry> entries;
+    //! (lastAccess, key) of all entries, least recently used first.
+    std::set<std::pair<qint64, QString>> lru;
+    qint64 totalBytes = 0;
+    qint64 quota      = 0;
+    bool dirty        = false;
+    Stats stats_;
+};
@@ -4,74 +4,65 @@
 
 #include "MxcImageProvider.h"
 
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <mutex>
 #include <optional>
+#include <vector>
 
 #include <mtx/common.hpp>
 #include <mtxclient/crypto/client.hpp>
 
+#include <QBuffer>
 #include <QByteArray>
 #include <QCache>
-#include <QDir>
+#include <QCoreApplication>
+#include <QFile>
 #include <QFileInfo>
+#include <QImageIOHandler>
+#include <QImageReader>
 #include <QPainter>
 #include <QPainterPath>
-#include <QStandardPaths>
 #include <QThreadPool>
 #include <QTimer>
 
+#include "EncryptedFileDevice.h"
+#include "ImageCache.h"
 #include "Logging.h"
 #include "MatrixClient.h"
+#include "MediaCache.h"
+#include "UserSettingsPage.h"
 #include "Utils.h"
 
 QHash<QString, mtx::crypto::EncryptedFile> infos;
 
+using DownloadCallback = std::function<void(QString, QSize, QImage, QString)>;
+
+static std::mutex pendingDownloadsMtx;
+//! Callers waiting for a download, which is already in progress, by their ImageCache key.
+static QHash<QString, std::vector<DownloadCallback>> pendingDownloads;
+static std::atomic<uint64_t> deduplicatedDownloads = 0;
+
 MxcImageProvider::MxcImageProvider()
   : QQuickAsyncImageProvider()
 {
+    auto settings = UserSettings::instance();
+    MediaCache::instance().setQuota(qint64{settings->mediaCacheSize()} * 1024 * 1024);
+    connect(settings.get(), &UserSettings::mediaCacheSizeChanged, this, [](int size) {
+        MediaCache::instance().setQuota(qint64{size} * 1024 * 1024);
+    });
+
     auto timer = new QTimer(this);
-    timer->setInterval(std::chrono::hours(1));
+    timer->setInterval(std::chrono::minutes(10));
     connect(timer, &QTimer::timeout, this, [] {
-        QThreadPool::globalInstance()->start([] {
-            nhlog::net()->debug("Running media purge");
-            QDir dir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) +
-                       "/media_cache",
-                     "",
-                     QDir::SortFlags(QDir::Name | QDir::IgnoreCase),
-                     QDir::Filter::Writable | QDir::Filter::NoDotAndDotDot | QDir::Filter::Files |
-                       QDir::Filter::Dirs);
-
-            auto handleFile = [](const QFileInfo &fileInfo) {
-                if (fileInfo.fileTime(QFile::FileTime::FileAccessTime)
-                      .daysTo(QDateTime::currentDateTime()) > 14) {
-                    if (QFile::remove(fileInfo.absoluteFilePath()))
-                        nhlog::net()->debug("Deleted stale media '{}'",
-                                            fileInfo.absoluteFilePath().toStdString());
-                    else
-                        nhlog::net()->warn("Failed to delete stale media '{}'",
-                                           fileInfo.absoluteFilePath().toStdString());
-                }
-            };
-
-            auto files = dir.entryInfoList();
-            for (const auto &fileInfo : std::as_const(files)) {
-                if (fileInfo.isDir()) {
-                    // handle one level of legacy directories
-                    auto nestedDir = QDir(fileInfo.absoluteFilePath(),
-                                          "",
-                                          QDir::SortFlags(QDir::Name | QDir::IgnoreCase),
-                                          QDir::Filter::Writable | QDir::Filter::NoDotAndDotDot |
-                                            QDir::Filter::Files)
-                                       .entryInfoList();
-                    for (const auto &nestedFile : std::as_const(nestedDir)) {
-                        handleFile(nestedFile);
-                    }
-                } else {
-                    handleFile(fileInfo);
-                }
-            }
-        });
+        QThreadPool::globalInstance()->start([] { MediaCache::instance().maintenance(); });
     });
     timer->start();
+
+    connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit, this, [] {
+        MediaCache::instance().maintenance();
+    });
 }
 
 QQuickImageResponse *
@@ -148,22 +139,202 @@ clipRadius(QImage img, double radius)
     return out;
 }
 
+namespace {
+struct ThumbnailVariant
+{
+    int width;
+    int height;
+    bool crop;
+};
+
+//! The thumbnail sizes servers should pregenerate, smallest first.
+constexpr ThumbnailVariant thumbnailVariants[] = {
+  {32, 32, true},
+  {96, 96, true},
+  {320, 240, false},
+  {640, 480, false},
+  {800, 600, false},
+};
+
+//! A thumbnail of encrypted media. Servers can't generate those, so it is made from the original
+//! and stored encrypted next to it, with the key of the original.
+struct LocalThumbnail
+{
+    QString path;
+    ThumbnailVariant variant;
+    std::string variantName;
+    mtx::crypto::EncryptedFile info;
+};
+}
+
+static QString
+thumbnailName(const ThumbnailVariant &variant)
+{
+    return QStringLiteral("%1x%2_%3")
+      .arg(variant.width)
+      .arg(variant.height)
+      .arg(variant.crop ? "crop" : "scale");
+}
+
+//! The smallest stored variant, which can be scaled down to size.
+static ThumbnailVariant
+thumbnailVariant(const QSize &size, bool crop)
+{
+    // Larger crops are cropped locally from a scaled variant.
+    const bool cropped = crop && size.width() <= 96 && size.height() <= 96;
+    for (const auto &variant : thumbnailVariants) {
+        if (variant.crop == cropped && variant.width >= size.width() &&
+            variant.height >= size.height())
+            return variant;
+    }
+    return thumbnailVariants[std::size(thumbnailVariants) - 1];
+}
+
+//! Decodes an image, so that it covers size or fits into it, if crop is false. The size is passed
+//! to the decoder, which lets JPEG decode a reduced resolution directly, instead of decoding the
+//! whole image and scaling it afterwards. Images are never scaled up here.
+static QImage
+readImageScaled(QIODevice *device, const QSize &size, bool crop)
+{
+    QImageReader reader(device);
+    reader.setAutoTransform(true);
+
+    // The scaled size and clip rect apply to the image before it is rotated.
+    const bool rotated = reader.transformation() & QImageIOHandler::TransformationRotate90;
+    QSize original     = reader.size();
+    if (rotated)
+        original.transpose();
+
+    if (original.isEmpty() || size.height() <= 0)
+        return reader.read();
+
+    QSize scaled;
+    if (size.width() <= 0)
+        scaled = QSize(
+          std::max(1, int(qint64{original.width()} * size.height() / original.height())),
+          size.height());
+    else
+        scaled =
+          original.scaled(size, crop ? Qt::KeepAspectRatioByExpanding : Qt::KeepAspectRatio);
+    if (scaled.width() >= original.width() || scaled.height() >= original.height())
+        return reader.read();
+
+    QRect clip;
+    if (crop && size.width() > 0)
+        clip = QRect((scaled.width() - size.width()) / 2,
+                     (scaled.height() - size.height()) / 2,
+                     size.width(),
+                     size.height());
+
+    if (rotated) {
+        scaled.transpose();
+        clip = QRect(clip.y(), clip.x(), clip.height(), clip.width());
+    }
+    reader.setScaledSize(scaled);
+    if (clip.isValid())
+        reader.setScaledClipRect(clip);
+    return reader.read();
+}
+
+//! Decodes an image from the media cache at the resolution needed for size. Encrypted images are
+//! decrypted while decoding, without keeping all of the plaintext in memory. Local thumbnails never
+//! left this device and have no hash.
+static QImage
+readCachedImage(const QString &path,
+                const std::optional<mtx::crypto::EncryptedFile> &info,
+                const QSize &size,
+                bool crop,
+                bool localThumbnail = false)
+{
+    if (!info) {
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly))
+            return {};
+        return readImageScaled(&file, size, crop);
+    }
+
+    olm::EncryptedFileDevice device(path, *info, !localThumbnail);
+    if (!device.open(QIODevice::ReadOnly))
+        return {};
+
+    QImage image = readImageScaled(&device, size, crop);
+    // decoders don't necessarily read up to the end, where the hash is checked
+    if (!device.verify())
+        return {};
+    return image;
+}
+
 static void
-possiblyUpdateAccessTime(const QFileInfo &fileInfo)
+writeLocalThumbnail(const LocalThumbnail &thumbnail, const QImage &image)
 {
-    if (fileInfo.fileTime(QFile::FileTime::FileAccessTime).daysTo(QDateTime::currentDateTime()) >
-        7) {
-        nhlog::net()->debug("Updating file time for '{}'",
-                            fileInfo.absoluteFilePath().toStdString());
+    QByteArray data;
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::WriteOnly);
+    if (!(image.hasAlphaChannel() ? image.save(&buffer, "PNG") : image.save(&buffer, "JPG", 90)) ||
+        !olm::EncryptedFileDevice::writeFile(thumbnail.path, data, thumbnail.info)) {
+        nhlog::ui()->debug("Failed to write: {}", thumbnail.path.toStdString());
+        return;
+    }
 
-        QFile f(fileInfo.absoluteFilePath());
+    MediaCache::instance().insert(thumbnail.path, thumbnail.variantName, true);
+    nhlog::ui()->debug("Wrote: {}", thumbnail.path.toStdString());
+}
 
-        if (!f.open(QIODevice::ReadWrite) ||
-            !f.setFileTime(QDateTime::currentDateTime(), QFile::FileTime::FileAccessTime)) {
-            nhlog::net()->warn("Failed to update filetime for '{}'",
-                               fileInfo.absoluteFilePath().toStdString());
+static QImage
+scaleThumbnail(QImage image, const QSize &requestedSize, bool crop, double radius)
+{
+    if (requestedSize.width() <= 0) {
+        image = image.scaledToHeight(requestedSize.height(), Qt::SmoothTransformation);
+    } else {
+        image = image.scaled(requestedSize,
+                             crop ? Qt::KeepAspectRatioByExpanding : Qt::KeepAspectRatio,
+                             Qt::SmoothTransformation);
+        if (crop) {
+            image = image.copy((image.width() - requestedSize.width()) / 2,
+                               (image.height() - requestedSize.height()) / 2,
+                               requestedSize.width(),
+                               requestedSize.height());
         }
     }
+
+    if (radius != 0) {
+        image = clipRadius(std::move(image), radius);
+    }
+    return image;
+}
+
+//! Decodes the original from the media cache for requestedSize. Unlike thumbnails, originals are
+//! not scaled up. If a local thumbnail is needed, it is made and stored first.
+static QImage
+readOriginal(const QString &path,
+             const std::optional<mtx::crypto::EncryptedFile> &info,
+             const std::optional<LocalThumbnail> &thumbnail,
+             const QSize &requestedSize,
+             bool crop,
+             double radius)
+{
+    if (thumbnail) {
+        const auto &variant = thumbnail->variant;
+        QImage image =
+          readCachedImage(path, info, QSize(variant.width, variant.height), variant.crop);
+        if (image.isNull())
+            return {};
+
+        writeLocalThumbnail(*thumbnail, image);
+        return scaleThumbnail(std::move(image), requestedSize, crop, radius);
+    }
+
+    QImage image = readCachedImage(path, info, requestedSize, crop);
+    if (image.isNull())
+        return {};
+
+    if (requestedSize.height() > 0 &&
+        (image.height() > requestedSize.height() ||
+         (requestedSize.width() > 0 && image.width() > requestedSize.width())))
+        return scaleThumbnail(std::move(image), requestedSize, crop, radius);
+    if (radius != 0)
+        image = clipRadius(std::move(image), radius);
+    return image;
 }
 
 void
@@ -179,12 +350,42 @@ MxcImageProvider::download(const QString &id,
         return;
     }
 
-    bool cropLocally = false;
-    if (crop && requestedSize.width() > 96) {
-        crop        = false;
-        cropLocally = true;
+    const auto cacheKey = ImageCache::key(id, requestedSize, crop, radius);
+    if (auto cached = ImageCache::find(cacheKey);
+        cached && MediaCache::instance().contains(cached->path)) {
+        then(id, requestedSize, cached->image, cached->path);
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(pendingDownloadsMtx);
+        if (auto pending = pendingDownloads.find(cacheKey); pending != pendingDownloads.end()) {
+            pending->push_back(std::move(then));
+            nhlog::net()->debug("Joined pending download of {} ({} requests deduplicated)",
+                                cacheKey.toStdString(),
+                                ++deduplicatedDownloads);
+            return;
+        }
+        pendingDownloads.insert(cacheKey, {});
     }
 
+    // Every path below calls this exactly once, which also answers the callers, that joined in the
+    // meantime.
+    then = [then = std::move(then), cacheKey](QString id, QSize size, QImage image, QString path) {
+        if (!path.isEmpty())
+            ImageCache::insert(cacheKey, image, path);
+
+        std::vector<DownloadCallback> waiting;
+        {
+            std::unique_lock<std::mutex> lock(pendingDownloadsMtx);
+            waiting = pendingDownloads.take(cacheKey);
+        }
+
+        then(id, size, image, path);
+        for (const auto &callback : waiting)
+            callback(id, size, image, path);
+    };
+
     std::optional<mtx::crypto::EncryptedFile> encryptionInfo;
     auto temp = infos.find("mxc://" + id);
     if (temp != infos.end())
@@ -195,41 +396,21 @@ MxcImageProvider::download(const QString &id,
         // Protect against synapse not following the spec:
         // https://github.com/matrix-org/synapse/issues/5302
         && requestedSize.height() <= 600 && requestedSize.width() <= 800) {
-        QString fileName = QStringLiteral("%1_%2x%3_%4_radius%5")
-                             .arg(QString::fromUtf8(id.toUtf8().toBase64(
-                               QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals)))
-                             .arg(requestedSize.width())
-                             .arg(requestedSize.height())
-                             .arg(crop ? "crop" : "scale")
-                             .arg(radius);
-        QFileInfo fileInfo(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) +
-                             "/media_cache",
-                           fileName);
-        QDir().mkpath(fileInfo.absolutePath());
-
-        if (fileInfo.exists()) {
+        // Only a few variants per image are stored, other sizes and the radius are derived from
+        // them.
+        const auto variant     = thumbnailVariant(requestedSize, crop);
+        const auto variantName = thumbnailName(variant);
+        QString fileName       = QStringLiteral("%1_%2").arg(
+          QString::fromUtf8(id.toUtf8().toBase64(QByteArray::Base64UrlEncoding |
+                                                 QByteArray::OmitTrailingEquals)),
+          variantName);
+        QFileInfo fileInfo(MediaCache::instance().directory(), fileName);
+
+        if (MediaCache::instance().contains(fileInfo.absoluteFilePath())) {
             QImage image = utils::readImageFromFile(fileInfo.absoluteFilePath());
             if (!image.isNull()) {
-                possiblyUpdateAccessTime(fileInfo);
-
-                if (requestedSize.width() <= 0) {
-                    image = image.scaledToHeight(requestedSize.height(), Qt::SmoothTransformation);
-                } else {
-                    image = image.scaled(requestedSize,
-                                         cropLocally ? Qt::KeepAspectRatioByExpanding
-                                                     : Qt::KeepAspectRatio,
-                                         Qt::SmoothTransformation);
-                    if (cropLocally) {
-                        image = image.copy((image.width() - requestedSize.width()) / 2,
-                                           (image.height() - requestedSize.height()) / 2,
-                                           requestedSize.width(),
-                                           requestedSize.height());
-                    }
-                }
-
-                if (radius != 0) {
-                    image = clipRadius(std::move(image), radius);
-                }
+                image = scaleThumbnail(std::move(image), requestedSize, crop, radius);
+                image.setText(QStringLiteral("mxc url"), "mxc://" + id);
 
                 if (!image.isNull()) {
                     then(id, requestedSize, image, fileInfo.absoluteFilePath());
@@ -240,103 +421,96 @@ MxcImageProvider::download(const QString &id,
 
         mtx::http::ThumbOpts opts;
         opts.mxc_url = "mxc://" + id.toStdString();
-        opts.width = static_cast<uint16_t>(requestedSize.width() > 0 ? requestedSize.width() : -1);
-        opts.height =
-          static_cast<uint16_t>(requestedSize.height() > 0 ? requestedSize.height() : -1);
-        opts.method = crop ? "crop" : "scale";
+        opts.width   = static_cast<uint16_t>(variant.width);
+        opts.height  = static_cast<uint16_t>(variant.height);
+        opts.method  = variant.crop ? "crop" : "scale";
         http::client()->get_thumbnail(
           opts,
-          [fileInfo, requestedSize, radius, then, id, crop, cropLocally](
+          [fileInfo, variantName, requestedSize, radius, then, id, crop](
             const std::string &res, mtx::http::RequestErr err) {
               if (err || res.empty()) {
                   download(id, QSize(), then, crop, radius);
                   return;
               }
 
-              auto data    = QByteArray(res.data(), (int)res.size());
-              QImage image = utils::readImage(data);
-              if (!image.isNull()) {
-                  possiblyUpdateAccessTime(fileInfo);
-
-                  if (requestedSize.width() <= 0) {
-                      image =
-                        image.scaledToHeight(requestedSize.height(), Qt::SmoothTransformation);
-                  } else {
-                      image = image.scaled(requestedSize,
-                                           cropLocally ? Qt::KeepAspectRatioByExpanding
-                                                       : Qt::KeepAspectRatio,
-                                           Qt::SmoothTransformation);
-                      if (cropLocally) {
-                          image = image.copy((image.width() - requestedSize.width()) / 2,
-                                             (image.height() - requestedSize.height()) / 2,
-                                             requestedSize.width(),
-                                             requestedSize.height());
-                      }
-                  }
-
-                  if (radius != 0) {
-                      image = clipRadius(std::move(image), radius);
-                  }
-              }
-              image.setText(QStringLiteral("mxc url"), "mxc://" + id);
-              if (image.save(fileInfo.absoluteFilePath(), "png")) {
+              // Store the thumbnail as the server encoded it, that is usually smaller than
+              // encoding it again and saves the time to do so.
+              QFile f(fileInfo.absoluteFilePath());
+              if (f.open(QIODevice::Truncate | QIODevice::WriteOnly)) {
+                  f.write(res.data(), static_cast<qint64>(res.size()));
+                  f.close();
                   utils::markFileAsFromWeb(fileInfo.absoluteFilePath());
+                  MediaCache::instance().insert(
+                    fileInfo.absoluteFilePath(), variantName.toStdString(), false);
                   nhlog::ui()->debug("Wrote: {}", fileInfo.absoluteFilePath().toStdString());
-              } else
+              } else {
                   nhlog::ui()->debug("Failed to write: {}",
                                      fileInfo.absoluteFilePath().toStdString());
+              }
+
+              auto data    = QByteArray(res.data(), (int)res.size());
+              QImage image = utils::readImage(data);
+              if (!image.isNull())
+                  image = scaleThumbnail(std::move(image), requestedSize, crop, radius);
+              image.setText(QStringLiteral("mxc url"), "mxc://" + id);
 
               then(id, requestedSize, image, fileInfo.absoluteFilePath());
           });
     } else {
         try {
-            QString fileName = QStringLiteral("%1_radius%2")
-                                 .arg(QString::fromUtf8(id.toUtf8().toBase64(
-                                   QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals)))
-                                 .arg(radius);
-
-            QFileInfo fileInfo(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) +
-                                 "/media_cache",
-                               fileName);
-            QDir().mkpath(fileInfo.absolutePath());
-
-            if (fileInfo.exists()) {
-                if (encryptionInfo) {
-                    QFile f(fileInfo.absoluteFilePath());
-                    f.open(QIODevice::ReadOnly);
-
-                    QByteArray fileData = f.readAll();
-                    auto tempData       = mtx::crypto::to_string(
-                      mtx::crypto::decrypt_file(fileData.toStdString(), encryptionInfo.value()));
-                    auto data    = QByteArray(tempData.data(), (int)tempData.size());
-                    QImage image = utils::readImage(data);
-                    image.setText(QStringLiteral("mxc url"), "mxc://" + id);
+            const auto mediaId = QString::fromUtf8(
+              id.toUtf8().toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals));
+            // The radius is applied in memory, so all radii share one file.
+            QFileInfo fileInfo(MediaCache::instance().directory(),
+                               QStringLiteral("%1_original").arg(mediaId));
+
+            // Encrypted media is only decoded from the original once for each thumbnail size,
+            // later views read the local thumbnail.
+            std::optional<LocalThumbnail> thumbnail;
+            if (encryptionInfo && requestedSize.height() > 0 && requestedSize.height() <= 600 &&
+                requestedSize.width() <= 800) {
+                const auto variant     = thumbnailVariant(requestedSize, crop);
+                const auto variantName = thumbnailName(variant);
+                thumbnail              = LocalThumbnail{
+                  QFileInfo(MediaCache::instance().directory(),
+                            QStringLiteral("%1_%2").arg(mediaId, variantName))
+                    .absoluteFilePath(),
+                  variant,
+                  variantName.toStdString(),
+                  olm::EncryptedFileDevice::localFile(*encryptionInfo, variantName),
+                };
+
+                if (MediaCache::instance().contains(thumbnail->path)) {
+                    QImage image =
+                      readCachedImage(thumbnail->path, thumbnail->info, QSize(), false, true);
                     if (!image.isNull()) {
-                        possiblyUpdateAccessTime(fileInfo);
-                        if (radius != 0) {
-                            image = clipRadius(std::move(image), radius);
-                        }
+                        image = scaleThumbnail(std::move(image), requestedSize, crop, radius);
+                        image.setText(QStringLiteral("mxc url"), "mxc://" + id);
 
-                        then(id, requestedSize, image, fileInfo.absoluteFilePath());
+                        then(id, requestedSize, image, thumbnail->path);
                         return;
                     }
-                } else {
-                    QImage image = utils::readImageFromFile(fileInfo.absoluteFilePath());
-                    if (!image.isNull()) {
-                        possiblyUpdateAccessTime(fileInfo);
-                        if (radius != 0) {
-                            image = clipRadius(std::move(image), radius);
-                        }
+                }
+            }
 
-                        then(id, requestedSize, image, fileInfo.absoluteFilePath());
-                        return;
-                    }
+            if (MediaCache::instance().contains(fileInfo.absoluteFilePath())) {
+                QImage image = readOriginal(fileInfo.absoluteFilePath(),
+                                            encryptionInfo,
+                                            thumbnail,
+                                            requestedSize,
+                                            crop,
+                                            radius);
+                if (!image.isNull()) {
+                    image.setText(QStringLiteral("mxc url"), "mxc://" + id);
+
+                    then(id, requestedSize, image, fileInfo.absoluteFilePath());
+                    return;
                 }
             }
 
             http::client()->download(
               "mxc://" + id.toStdString(),
-              [fileInfo, requestedSize, then, id, radius, encryptionInfo](
+              [fileInfo, requestedSize, then, id, crop, radius, encryptionInfo, thumbnail](
                 const std::string &res,
                 const std::string &,
                 const std::string &originalFilename,
@@ -347,7 +521,6 @@ MxcImageProvider::download(const QString &id,
                       return;
                   }
 
-                  auto tempData = res;
                   QFile f(fileInfo.absoluteFilePath());
                   if (!f.open(QIODevice::Truncate | QIODevice::WriteOnly)) {
                       nhlog::net()->error(
@@ -355,32 +528,24 @@ MxcImageProvider::download(const QString &id,
                       then(id, QSize(), {}, QLatin1String(""));
                       return;
                   }
-                  f.write(tempData.data(), tempData.size());
+                  f.write(res.data(), static_cast<qint64>(res.size()));
                   f.close();
                   utils::markFileAsFromWeb(fileInfo.absoluteFilePath());
-
-                  if (encryptionInfo) {
-                      tempData = mtx::crypto::to_string(
-                        mtx::crypto::decrypt_file(tempData, encryptionInfo.value()));
-                      auto data    = QByteArray(tempData.data(), (int)tempData.size());
-                      QImage image = utils::readImage(data);
-                      if (radius != 0) {
-                          image = clipRadius(std::move(image), radius);
-                      }
-
-                      image.setText(QStringLiteral("original filename"),
-                                    QString::fromStdString(originalFilename));
-                      image.setText(QStringLiteral("mxc url"), "mxc://" + id);
-
-                      then(id, requestedSize, image, fileInfo.absoluteFilePath());
+                  MediaCache::instance().insert(
+                    fileInfo.absoluteFilePath(), "original", encryptionInfo.has_value());
+
+                  QImage image = readOriginal(fileInfo.absoluteFilePath(),
+                                              encryptionInfo,
+                                              thumbnail,
+                                              requestedSize,
+                                              crop,
+                                              radius);
+                  if (image.isNull()) {
+                      nhlog::net()->error("Failed to decode {}", id.toStdString());
+                      then(id, QSize(), {}, QLatin1String(""));
                       return;
                   }
 
-                  QImage image = utils::readImageFromFile(fileInfo.absoluteFilePath());
-                  if (radius != 0) {
-                      image = clipRadius(std::move(image), radius);
-                  }
-
                   image.setText(QStringLiteral("original filename"),
                                 QString::fromStdString(originalFilename));
                   image.setText(QStringLiteral("mxc url"), "mxc://" + id);
@@ -389,6 +554,7 @@ MxcImageProvider::download(const QString &id,
               });
         } catch (std::exception &e) {
             nhlog::net()->error("Exception while downloading media: {}", e.what());
+            then(id, QSize(), {}, QLatin1String(""));
         }
     }
 }
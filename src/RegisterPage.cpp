@@ -57,7 +57,7 @@ RegisterPage::setServer(const QString &server)
     lastServer = server;
 
     http::client()->set_server(server.toStdString());
-    http::client()->verify_certificates(!UserSettings::instance()->disableCertificateValidation());
+    http::verifyCertificates(!UserSettings::instance()->disableCertificateValidation());
 
     hsError_.clear();
     emit hsErrorChanged();
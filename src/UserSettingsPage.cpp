@@ -8,9 +8,9 @@
 #include <QFontDatabase>
 #include <QInputDialog>
 #include <QMessageBox>
+#include <QProgressDialog>
 #include <QStandardPaths>
 #include <QString>
-#include <QTextStream>
 #include <mtx/secret_storage.hpp>
 
 #include "Cache.h"
@@ -20,6 +20,7 @@
 #include "UserSettingsPage.h"
 #include "Utils.h"
 #include "encryption/Olm.h"
+#include "encryption/SessionKeyExport.h"
 #include "ui/Theme.h"
 #include "voip/CallDevices.h"
 
@@ -67,6 +68,7 @@ UserSettings::load(std::optional<QString> profile)
     scrollbarsInRoomlist_    = settings.value("user/scrollbars_in_roomlist", false).toBool();
     buttonsInTimeline_       = settings.value("user/timeline/buttons", true).toBool();
     timelineMaxWidth_        = settings.value("user/timeline/max_width", 0).toInt();
+    mediaCacheSize_          = settings.value("user/media_cache_size", 2048).toInt();
     messageHoverHighlight_ =
       settings.value("user/timeline/message_hover_highlight", false).toBool();
     enlargeEmojiOnlyMessages_ =
@@ -439,6 +441,16 @@ UserSettings::setTimelineMaxWidth(int state)
     emit timelineMaxWidthChanged(state);
     save();
 }
+
+void
+UserSettings::setMediaCacheSize(int state)
+{
+    if (state == mediaCacheSize_)
+        return;
+    mediaCacheSize_ = state;
+    emit mediaCacheSizeChanged(state);
+    save();
+}
 void
 UserSettings::setCommunityListWidth(int state)
 {
@@ -854,7 +866,7 @@ UserSettings::setDisableCertificateValidation(bool disabled)
     if (disabled == disableCertificateValidation_)
         return;
     disableCertificateValidation_ = disabled;
-    http::client()->verify_certificates(!disabled);
+    http::verifyCertificates(!disabled);
     emit disableCertificateValidationChanged(disabled);
 }
 
@@ -925,6 +937,7 @@ UserSettings::save()
     settings.setValue("reduced_motion", reducedMotion_);
     settings.setValue("privacy_screen", privacyScreen_);
     settings.setValue("privacy_screen_timeout", privacyScreenTimeout_);
+    settings.setValue("media_cache_size", mediaCacheSize_);
     settings.setValue("mobile_mode", mobileMode_);
     settings.setValue("disable_swipe", disableSwipe_);
     settings.setValue("font_size", baseFontSize_);
@@ -1070,6 +1083,8 @@ UserSettingsModel::data(const QModelIndex &index, int role) const
             return tr("Show buttons in timeline");
         case TimelineMaxWidth:
             return tr("Limit width of timeline");
+        case MediaCacheSize:
+            return tr("Media cache size (in MiB)");
         case ReadReceipts:
             return tr("Read receipts");
         case HiddenTimelineEvents:
@@ -1225,6 +1240,8 @@ UserSettingsModel::data(const QModelIndex &index, int role) const
             return i->buttonsInTimeline();
         case TimelineMaxWidth:
             return i->timelineMaxWidth();
+        case MediaCacheSize:
+            return i->mediaCacheSize();
         case ReadReceipts:
             return i->readReceipts();
         case DesktopNotifications:
@@ -1347,6 +1364,9 @@ UserSettingsModel::data(const QModelIndex &index, int role) const
         case TimelineMaxWidth:
             return tr("Set the max width of messages in the timeline (in pixels). This can help "
                       "readability on wide screen when Nheko is maximized");
+        case MediaCacheSize:
+            return tr("Limit the disk space used to cache images, videos and other files. When "
+                      "the cache is full, the files used least recently are deleted.");
         case PrivacyScreenTimeout:
             return tr(
               "Set timeout (in seconds) for how long after window loses\nfocus before the screen"
@@ -1545,6 +1565,7 @@ UserSettingsModel::data(const QModelIndex &index, int role) const
             return Options;
         case TimelineMaxWidth:
         case PrivacyScreenTimeout:
+        case MediaCacheSize:
             return Integer;
         case FontSize:
         case ScaleFactor:
@@ -1627,6 +1648,8 @@ UserSettingsModel::data(const QModelIndex &index, int role) const
             return 0;
         case PrivacyScreenTimeout:
             return 0;
+        case MediaCacheSize:
+            return 128;
         case FontSize:
             return 8.0;
         case ScaleFactor:
@@ -1638,6 +1661,8 @@ UserSettingsModel::data(const QModelIndex &index, int role) const
             return 20000;
         case PrivacyScreenTimeout:
             return 3600;
+        case MediaCacheSize:
+            return 1024 * 1024;
         case FontSize:
             return 24.0;
         case ScaleFactor:
@@ -1649,6 +1674,8 @@ UserSettingsModel::data(const QModelIndex &index, int role) const
             return 20;
         case PrivacyScreenTimeout:
             return 10;
+        case MediaCacheSize:
+            return 128;
         case FontSize:
             return 0.5;
         case ScaleFactor:
@@ -1879,6 +1906,13 @@ UserSettingsModel::setData(const QModelIndex &index, const QVariant &value, int
             } else
                 return false;
         }
+        case MediaCacheSize: {
+            if (value.canConvert(QMetaType::fromType<int>())) {
+                i->setMediaCacheSize(value.toInt());
+                return true;
+            } else
+                return false;
+        }
         case ReadReceipts: {
             if (value.userType() == QMetaType::Bool) {
                 i->setReadReceipts(value.toBool());
@@ -2208,20 +2242,38 @@ UserSettingsModel::exportSessionKeys()
         return;
     }
 
+    QProgressDialog progress(tr("Exporting session keys..."), tr("Cancel"), 0, 0);
+    progress.setWindowModality(Qt::ApplicationModal);
+    progress.setMinimumDuration(500);
+
     // Export sessions & save to file.
     try {
-        auto encrypted_blob = mtx::crypto::encrypt_exported_sessions(cache::exportSessionKeys(),
-                                                                     password.toStdString());
+        olm::SessionKeyExportWriter writer(&file, password.toStdString());
+
+        bool canceled = false;
+        cache::exportSessionKeys([&writer, &progress, &canceled](
+                                   const mtx::crypto::ExportedSession &session,
+                                   std::size_t current,
+                                   std::size_t total) {
+            writer.addSession(session);
+
+            if (current % 64 == 0 || current == total) {
+                progress.setMaximum(static_cast<int>(total));
+                progress.setValue(static_cast<int>(current));
+                canceled = progress.wasCanceled();
+            }
+            return !canceled;
+        });
 
-        QString b64 = QString::fromStdString(mtx::crypto::bin2base64(encrypted_blob));
+        if (canceled) {
+            file.remove();
+            return;
+        }
 
-        QString prefix(QStringLiteral("-----BEGIN MEGOLM SESSION DATA-----"));
-        QString suffix(QStringLiteral("-----END MEGOLM SESSION DATA-----"));
-        QString newline(QStringLiteral("\n"));
-        QTextStream out(&file);
-        out << prefix << newline << b64 << newline << suffix << newline;
+        writer.finish();
         file.close();
     } catch (const std::exception &e) {
+        file.remove();
         QMessageBox::warning(nullptr, tr("Error"), e.what());
     }
 }
@@ -2282,6 +2334,9 @@ UserSettingsModel::UserSettingsModel(QObject *p)
     connect(s.get(), &UserSettings::timelineMaxWidthChanged, this, [this]() {
         emit dataChanged(index(TimelineMaxWidth), index(TimelineMaxWidth), {Value});
     });
+    connect(s.get(), &UserSettings::mediaCacheSizeChanged, this, [this]() {
+        emit dataChanged(index(MediaCacheSize), index(MediaCacheSize), {Value});
+    });
     connect(s.get(), &UserSettings::messageHoverHighlightChanged, this, [this]() {
         emit dataChanged(index(MessageHoverHighlight), index(MessageHoverHighlight), {Value});
     });
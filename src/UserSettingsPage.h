@@ -65,6 +65,8 @@ class UserSettings final : public QObject
                  NOTIFY privacyScreenTimeoutChanged)
     Q_PROPERTY(int timelineMaxWidth READ timelineMaxWidth WRITE setTimelineMaxWidth NOTIFY
                  timelineMaxWidthChanged)
+    Q_PROPERTY(
+      int mediaCacheSize READ mediaCacheSize WRITE setMediaCacheSize NOTIFY mediaCacheSizeChanged)
     Q_PROPERTY(
       int roomListWidth READ roomListWidth WRITE setRoomListWidth NOTIFY roomListWidthChanged)
     Q_PROPERTY(int communityListWidth READ communityListWidth WRITE setCommunityListWidth NOTIFY
@@ -192,6 +194,7 @@ public:
     void setSortByAlphabet(bool state);
     void setButtonsInTimeline(bool state);
     void setTimelineMaxWidth(int state);
+    void setMediaCacheSize(int state);
     void setCommunityListWidth(int state);
     void setRoomListWidth(int state);
     void setDesktopNotifications(bool state);
@@ -270,6 +273,8 @@ public:
     bool hasAlertOnNotification() const { return hasAlertOnNotification_; }
     bool hasNotifications() const { return hasDesktopNotifications() || hasAlertOnNotification(); }
     int timelineMaxWidth() const { return timelineMaxWidth_; }
+    //! In MiB.
+    int mediaCacheSize() const { return mediaCacheSize_; }
     int communityListWidth() const { return communityListWidth_; }
     int roomListWidth() const { return roomListWidth_; }
     double fontSize() const { return baseFontSize_; }
@@ -346,6 +351,7 @@ signals:
     void privacyScreenChanged(bool state);
     void privacyScreenTimeoutChanged(int state);
     void timelineMaxWidthChanged(int state);
+    void mediaCacheSizeChanged(int state);
     void roomListWidthChanged(int state);
     void communityListWidthChanged(int state);
     void mobileModeChanged(bool mode);
@@ -424,6 +430,7 @@ private:
     bool mobileMode_;
     bool disableSwipe_;
     int timelineMaxWidth_;
+    int mediaCacheSize_;
     int roomListWidth_;
     int communityListWidth_;
     double baseFontSize_;
@@ -506,6 +513,7 @@ class UserSettingsModel : public QAbstractListModel
         ShowImage,
         OpenImageExternal,
         OpenVideoExternal,
+        MediaCacheSize,
         ButtonsInTimeline,
         TypingNotifications,
         ReadReceipts,
@@ -4,12 +4,13 @@
 
 #include "UsersModel.h"
 
+#include <algorithm>
+
 #include <QUrl>
 
 #include "Cache.h"
 #include "Cache_p.h"
 #include "CompletionModelRoles.h"
-#include "Logging.h"
 #include "UserSettingsPage.h"
 #include "Utils.h"
 
@@ -28,25 +29,67 @@ UsersModel::UsersModel(const std::string &roomId, QObject *parent)
                     if (roomIds.empty())
                         continue;
 
-                    displayNames.push_back(
-                      QString::fromStdString(cache::displayName(roomIds.at(0), userId)));
-                    userids.push_back(QString::fromStdString(userId));
-                    avatarUrls.push_back(cache::avatarUrl(QString::fromStdString(roomIds.at(0)),
-                                                          QString::fromStdString(userId)));
+                    members.push_back(RoomMember{
+                      QString::fromStdString(userId),
+                      QString::fromStdString(cache::displayName(roomIds.at(0), userId)),
+                      cache::avatarUrl(QString::fromStdString(roomIds.at(0)),
+                                       QString::fromStdString(userId)),
+                    });
                 }
             }
         }
     } else {
-        const auto start_at = std::chrono::steady_clock::now();
-        for (const auto &m : cache::getMembers(roomId, 0, -1)) {
-            displayNames.push_back(m.display_name);
-            userids.push_back(m.user_id);
-            avatarUrls.push_back(m.avatar_url);
+        recentSenders = cache::client()->recentSenders(roomId);
+
+        connect(
+          this,
+          &UsersModel::newSearchString,
+          this,
+          [this](const QString &s) {
+              searchString_ = s;
+              search();
+          },
+          Qt::QueuedConnection);
+
+        search();
+    }
+}
+
+void
+UsersModel::search()
+{
+    auto prefix = QStringView(searchString_).trimmed().toString().toCaseFolded().toStdString();
+    if (prefix.starts_with('@'))
+        prefix.erase(0, 1);
+
+    beginResetModel();
+    members.clear();
+
+    for (const auto &m : recentSenders) {
+        if (members.size() >= max_completions_)
+            break;
+
+        auto terms =
+          Cache::memberSearchTerms(m.user_id.toStdString(), m.display_name.toStdString());
+        if (std::ranges::any_of(terms, [&prefix](const auto &t) { return t.starts_with(prefix); }))
+            members.push_back(m);
+    }
+
+    if (members.size() < max_completions_) {
+        auto found =
+          cache::client()->searchMembers(room_id, searchString_, max_completions_ + members.size());
+        for (auto &m : found) {
+            if (members.size() >= max_completions_)
+                break;
+
+            if (std::ranges::none_of(members, [&m](const RoomMember &r) {
+                    return r.user_id == m.user_id;
+                }))
+                members.push_back(std::move(m));
         }
-        const auto end_at     = std::chrono::steady_clock::now();
-        const auto build_time = std::chrono::duration<double, std::milli>(end_at - start_at);
-        nhlog::ui()->debug("UsersModel: build data: {} ms", build_time.count());
     }
+
+    endResetModel();
 }
 
 QHash<int, QByteArray>
@@ -70,22 +113,39 @@ UsersModel::data(const QModelIndex &index, int role) const
         case CompletionModel::CompletionRole:
             if (UserSettings::instance()->markdown())
                 return QStringLiteral("[%1](https://matrix.to/#/%2)")
-                  .arg(utils::escapeMentionMarkdown(QString(displayNames[index.row()])),
-                       QString(QUrl::toPercentEncoding(userids[index.row()])));
+                  .arg(utils::escapeMentionMarkdown(members[index.row()].display_name),
+                       QString(QUrl::toPercentEncoding(members[index.row()].user_id)));
             else
-                return displayNames[index.row()];
+                return members[index.row()].display_name;
         case CompletionModel::SearchRole:
-            return displayNames[index.row()];
+            return members[index.row()].display_name;
         case Qt::DisplayRole:
         case Roles::DisplayName:
-            return displayNames[index.row()].toHtmlEscaped();
+            return members[index.row()].display_name.toHtmlEscaped();
         case CompletionModel::SearchRole2:
-            return userids[index.row()];
+            return members[index.row()].user_id;
         case Roles::AvatarUrl:
-            return avatarUrls[index.row()];
+            return members[index.row()].avatar_url;
         case Roles::UserID:
-            return userids[index.row()].toHtmlEscaped();
+            return members[index.row()].user_id.toHtmlEscaped();
         }
     }
     return {};
 }
+
+QVariant
+UsersModel::completionAt(int i) const
+{
+    if (i >= 0 && i < rowCount())
+        return data(index(i, 0), CompletionModel::CompletionRole);
+    else
+        return {};
+}
+
+void
+UsersModel::setSearchString(const QString &s)
+{
+    emit newSearchString(s);
+}
+
+#include "moc_UsersModel.cpp"
@@ -6,8 +6,16 @@
 
 #include <QAbstractListModel>
 
+#include "CacheStructs.h"
+
+//! Completes users. For a room it searches the members in the cache on every change of the search
+//! string, so that large member lists are never loaded. For "friends" it lists all users with a
+//! direct chat, which is meant to be used through a CompletionProxyModel.
 class UsersModel final : public QAbstractListModel
 {
+    Q_OBJECT
+    Q_PROPERTY(QString searchString READ searchString WRITE setSearchString NOTIFY newSearchString)
+
 public:
     enum Roles
     {
@@ -21,13 +29,26 @@ public:
     int rowCount(const QModelIndex &parent = QModelIndex()) const override
     {
         (void)parent;
-        return (int)userids.size();
+        return (int)members.size();
     }
     QVariant data(const QModelIndex &index, int role) const override;
 
+public slots:
+    QVariant completionAt(int i) const;
+
+    void setSearchString(const QString &s);
+    QString searchString() const { return searchString_; }
+
+signals:
+    void newSearchString(QString);
+
 private:
+    void search();
+
     std::string room_id;
-    std::vector<QString> avatarUrls;
-    std::vector<QString> displayNames;
-    std::vector<QString> userids;
+    QString searchString_;
+    std::vector<RoomMember> members;
+    //! The last senders in the room, ranked before other matching members.
+    std::vector<RoomMember> recentSenders;
+    size_t max_completions_ = 30;
 };
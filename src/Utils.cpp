@@ -4,10 +4,13 @@
 
 #include "Utils.h"
 
+#include <algorithm>
 #include <array>
 #include <cmath>
+#include <string_view>
 #include <unordered_set>
 #include <variant>
+#include <vector>
 
 #include <QApplication>
 #include <QBuffer>
@@ -42,6 +45,7 @@
 #include "Logging.h"
 #include "MatrixClient.h"
 #include "UserSettingsPage.h"
+#include "emoji/Scanner.h"
 
 static QString
 getQuoteBody(const RelatedInfo &related);
@@ -288,17 +292,6 @@ utils::localUser()
     return QString::fromStdString(http::client()->user_id().to_string());
 }
 
-bool
-utils::codepointIsEmoji(uint code)
-{
-    // TODO: Be more precise here.
-    return (code >= 0x2600 && code <= 0x27bf) || (code >= 0x2b00 && code <= 0x2bff) ||
-           (code >= 0x1f000 && code <= 0x1faff) || code == 0x200d || code == 0xfe0f ||
-           code == 0x231a || code == 0x231b || (code >= 0x23e9 && code <= 0x23ff) ||
-           code == 0x25aa || code == 0x25ab || code == 0x25b6 || code == 0x25c0 ||
-           (code >= 0x25fb && code <= 0x25fe) || (code >= 0x2460 && code <= 0x24ff);
-}
-
 QString
 utils::replaceEmoji(const QString &body)
 {
@@ -308,17 +301,19 @@ utils::replaceEmoji(const QString &body)
         QString fmtBody;
         fmtBody.reserve(body.size());
 
-        QVector<uint> utf32_string = body.toUcs4();
-
         bool insideFontBlock = false;
         bool insideTag       = false;
-        for (auto &code : utf32_string) {
-            if (code == U'<')
+        for (qsizetype pos = 0; pos < body.size();) {
+            if (body[pos] == u'<')
                 insideTag = true;
-            else if (code == U'>')
+            else if (body[pos] == u'>')
                 insideTag = false;
 
-            if (!insideTag && utils::codepointIsEmoji(code)) {
+            const auto cluster = emoji::clusterAt(body, pos);
+            const auto units   = QStringView(body).sliced(pos, cluster.length);
+            pos += cluster.length;
+
+            if (!insideTag && cluster.isEmoji) {
                 if (!insideFontBlock) {
                     fmtBody += QStringLiteral("<font face=\"") %
                                UserSettings::instance()->emojiFont() %
@@ -326,25 +321,21 @@ utils::replaceEmoji(const QString &body)
                                   ? QStringLiteral("\" size=\"4\">")
                                   : QStringLiteral("\">"));
                     insideFontBlock = true;
-                } else if (code == 0xfe0f) {
+                }
+                for (QChar unit : units) {
                     // BUG(Nico):
                     // Workaround https://bugreports.qt.io/browse/QTBUG-97401
                     // See also https://github.com/matrix-org/matrix-react-sdk/pull/1458/files
                     // Nheko bug: https://github.com/Nheko-Reborn/nheko/issues/439
-                    continue;
+                    if (unit != QChar(0xfe0f))
+                        fmtBody.append(unit);
                 }
             } else {
                 if (insideFontBlock) {
                     fmtBody += QStringLiteral("</font>");
                     insideFontBlock = false;
                 }
-            }
-            if (QChar::requiresSurrogates(code)) {
-                QChar emoji[] = {static_cast<ushort>(QChar::highSurrogate(code)),
-                                 static_cast<ushort>(QChar::lowSurrogate(code))};
-                fmtBody.append(emoji, 2);
-            } else {
-                fmtBody.append(QChar(static_cast<ushort>(code)));
+                fmtBody.append(units);
             }
         }
         if (insideFontBlock) {
@@ -619,169 +610,258 @@ utils::escapeMentionMarkdown(QString input)
     return input;
 }
 
+namespace {
+constexpr std::array<std::string_view, 38> allowedHtmlTags = {
+  "font",       "del", "h1",    "h2",     "h3",      "h4",      "h5",   "h6",
+  "blockquote", "p",   "a",     "ul",     "ol",      "sup",     "sub",  "li",
+  "b",          "i",   "u",     "strong", "em",      "strike",  "code", "hr",
+  "br",         "div", "table", "thead",  "tbody",   "tr",      "th",   "td",
+  "caption",    "pre", "span",  "img",    "details", "summary"};
+
+// Length, first and last character are enough to tell the allowed tags apart, which makes this a
+// perfect hash for them. The static_assert below catches collisions when adding tags.
+constexpr std::size_t
+htmlTagHash(std::string_view tag)
+{
+    return (tag.size() + 11 * static_cast<unsigned char>(tag.front()) +
+            13 * static_cast<unsigned char>(tag.back())) %
+           128;
+}
+
+constexpr auto allowedHtmlTagTable = [] {
+    std::array<std::string_view, 128> table{};
+    for (auto tag : allowedHtmlTags)
+        table[htmlTagHash(tag)] = tag;
+    return table;
+}();
+
+static_assert(std::count_if(allowedHtmlTagTable.begin(),
+                            allowedHtmlTagTable.end(),
+                            [](const auto &tag) { return !tag.empty(); }) ==
+                allowedHtmlTags.size(),
+              "Allowed html tags collide in the tag table, adjust htmlTagHash");
+
+//! Returns the lowercase allowed tag for a tag name like "P", "/p" or "br/" or an empty view.
+std::string_view
+allowedHtmlTag(QStringView name)
+{
+    const bool closing = name.startsWith(u'/');
+    if (closing)
+        name = name.sliced(1);
+    const bool selfClosing = !closing && name.endsWith(u'/');
+    if (selfClosing)
+        name.chop(1);
+
+    std::array<char, 10> lower;
+    if (name.isEmpty() || static_cast<std::size_t>(name.size()) > lower.size())
+        return {};
+    for (qsizetype i = 0; i < name.size(); i++) {
+        char16_t c = name[i].unicode();
+        if (c >= u'A' && c <= u'Z')
+            c += u'a' - u'A';
+        else if (c > 0x7f)
+            return {};
+        lower[i] = static_cast<char>(c);
+    }
+
+    const auto lowerName = std::string_view(lower.data(), name.size());
+    const auto tag       = allowedHtmlTagTable[htmlTagHash(lowerName)];
+    if (tag != lowerName || (selfClosing && tag != "hr" && tag != "br"))
+        return {};
+    return tag;
+}
+
+void
+appendLowerAscii(QString &buffer, QStringView str)
+{
+    for (QChar c : str)
+        buffer.append(c.unicode() < 0x80 ? c.toLower() : c);
+}
+
+int
+leadingNumber(QStringView str)
+{
+    int n = 0;
+    for (QChar c : str) {
+        if (!c.isDigit() || n > 100000)
+            break;
+        n = n * 10 + c.digitValue();
+    }
+    return n;
+}
+}
+
 QString
-utils::escapeBlacklistedHtml(const QString &rawStr)
+utils::escapeBlacklistedHtml(const QString &rawStr, const HtmlSanitizeOptions &options)
 {
-    static const std::set<QByteArray> allowedTags = {
-      "font",       "/font",       "del",     "/del",    "h1",    "/h1",    "h2",     "/h2",
-      "h3",         "/h3",         "h4",      "/h4",     "h5",    "/h5",    "h6",     "/h6",
-      "blockquote", "/blockquote", "p",       "/p",      "a",     "/a",     "ul",     "/ul",
-      "ol",         "/ol",         "sup",     "/sup",    "sub",   "/sub",   "li",     "/li",
-      "b",          "/b",          "i",       "/i",      "u",     "/u",     "strong", "/strong",
-      "em",         "/em",         "strike",  "/strike", "code",  "/code",  "hr",     "hr/",
-      "br",         "br/",         "div",     "/div",    "table", "/table", "thead",  "/thead",
-      "tbody",      "/tbody",      "tr",      "/tr",     "th",    "/th",    "td",     "/td",
-      "caption",    "/caption",    "pre",     "/pre",    "span",  "/span",  "img",    "/img",
-      "details",    "/details",    "summary", "/summary"};
-    constexpr static const std::array tagNameEnds   = {' ', '>'};
-    constexpr static const std::array attrNameEnds  = {' ', '>', '=', '\t', '\r', '\n', '/', '\f'};
-    constexpr static const std::array attrValueEnds = {' ', '\t', '\r', '\n', '\f', '>'};
-    constexpr static const std::array spaceChars    = {' ', '\t', '\r', '\n', '\f'};
-
-    QByteArray data = rawStr.toUtf8();
-    QByteArray buffer;
-    const int length = data.size();
-    buffer.reserve(length);
-    const auto end = data.cend();
-    for (auto pos = data.cbegin(); pos < end;) {
-        auto tagStart = std::find(pos, end, '<');
-        buffer.append(pos, static_cast<int>(tagStart - pos));
+    constexpr static std::u16string_view tagNameEnds   = u" >";
+    constexpr static std::u16string_view attrNameEnds  = u" >=\t\r\n/\f";
+    constexpr static std::u16string_view attrValueEnds = u" \t\r\n\f>";
+    constexpr static std::u16string_view spaceChars    = u" \t\r\n\f";
+    constexpr static std::u16string_view replyEnd      = u"</mx-reply>";
+
+    struct Attribute
+    {
+        QStringView name;
+        QStringView value;
+        //! 0 for attributes without a value
+        char16_t quote = 0;
+    };
+    std::vector<Attribute> attributes;
+
+    const auto data = QStringView(rawStr);
+    const auto end  = data.utf16() + data.size();
+
+    QString buffer;
+    buffer.reserve(data.size());
+
+    for (auto pos = data.utf16(); pos < end;) {
+        auto tagStart = std::find(pos, end, u'<');
+        buffer.append(QStringView(pos, tagStart));
         if (tagStart == end)
             break;
 
         const auto tagNameStart = tagStart + 1;
         const auto tagNameEnd =
           std::find_first_of(tagNameStart, end, tagNameEnds.begin(), tagNameEnds.end());
+        const auto rawTagName = QStringView(tagNameStart, tagNameEnd);
+
+        // Drops everything from the first <mx-reply> to the last </mx-reply>
+        if (options.stripReplyFallback && tagNameEnd != end && *tagNameEnd == u'>' &&
+            rawTagName == u"mx-reply") {
+            auto fallbackEnd = std::find_end(tagNameEnd, end, replyEnd.begin(), replyEnd.end());
+            if (fallbackEnd != end) {
+                pos = fallbackEnd + replyEnd.size();
+                continue;
+            }
+        }
 
-        const auto tagName =
-          QByteArray(tagNameStart, static_cast<int>(tagNameEnd - tagNameStart)).toLower();
-
-        if (allowedTags.find(tagName) == allowedTags.end()) {
+        const auto tagName = allowedHtmlTag(rawTagName);
+        if (tagName.empty()) {
             // not allowed -> escape
-            buffer.append("&lt;");
+            buffer.append(QLatin1String("&lt;"));
             pos = tagNameStart;
             continue;
-        } else {
-            buffer.append(tagStart, static_cast<int>(tagNameEnd - tagStart));
-
-            pos = tagNameEnd;
-
-            if (tagNameEnd != end) {
-                auto attrStart = tagNameEnd;
-                auto attrsEnd  = std::find(attrStart, end, '>');
-                // we don't want to consume the slash of self closing tags as part of an attribute.
-                // However, obviously we don't want to move backwards, if there are no attributes.
-                if (*(attrsEnd - 1) == '/' && attrStart < attrsEnd)
-                    attrsEnd -= 1;
-
-                pos = attrsEnd;
+        }
 
-                auto consumeSpaces = [attrsEnd](auto p) {
-                    while (p < attrsEnd &&
-                           std::find(spaceChars.begin(), spaceChars.end(), *p) != spaceChars.end())
-                        p++;
-                    return p;
-                };
+        buffer.append(QStringView(tagStart, tagNameEnd));
+        pos = tagNameEnd;
+        if (tagNameEnd == end)
+            continue;
 
-                attrStart = consumeSpaces(attrStart);
+        auto attrStart = tagNameEnd;
+        auto attrsEnd  = std::find(attrStart, end, u'>');
+        // we don't want to consume the slash of self closing tags as part of an attribute.
+        // However, obviously we don't want to move backwards, if there are no attributes.
+        if (attrStart < attrsEnd && *(attrsEnd - 1) == u'/')
+            attrsEnd -= 1;
+
+        pos = attrsEnd;
+
+        auto consumeSpaces = [attrsEnd](auto p) {
+            while (p < attrsEnd && spaceChars.find(*p) != std::u16string_view::npos)
+                p++;
+            return p;
+        };
+
+        // We don't really want attributes on del tags and they make replacement in the frontend
+        // more expensive
+        const bool isDel = tagName == "del";
+
+        attributes.clear();
+        attrStart = consumeSpaces(attrStart);
+        while (attrStart < attrsEnd) {
+            auto attrEnd =
+              std::find_first_of(attrStart, attrsEnd, attrNameEnds.begin(), attrNameEnds.end());
+            auto attrName = QStringView(attrStart, attrEnd);
+            attrStart     = consumeSpaces(attrEnd);
+
+            if (attrName.isEmpty()) {
+                attributes.push_back({.name = {}, .value = QStringView(attrStart, 1)});
+                attrStart++;
+                continue;
+            }
 
-                while (attrStart < attrsEnd) {
-                    auto attrEnd = std::find_first_of(
-                      attrStart, attrsEnd, attrNameEnds.begin(), attrNameEnds.end());
+            Attribute attr{.name = attrName};
+            if (attrStart < attrsEnd && *attrStart == u'=') {
+                attrStart = consumeSpaces(attrStart + 1);
+
+                // we fall through here if the value is empty to transform attr="" into attr,
+                // because otherwise we can't style it
+                if (attrStart < attrsEnd) {
+                    if (*attrStart == u'"' || *attrStart == u'\'') {
+                        attr.quote    = *attrStart;
+                        auto valueEnd = std::find(attrStart + 1, attrsEnd, attr.quote);
+                        if (valueEnd == attrsEnd)
+                            break;
+
+                        attr.value = QStringView(attrStart + 1, valueEnd);
+                        attrStart  = consumeSpaces(valueEnd + 1);
+                    } else {
+                        auto valueEnd = std::find_first_of(
+                          attrStart, attrsEnd, attrValueEnds.begin(), attrValueEnds.end());
+                        attr.value = QStringView(attrStart, valueEnd);
+                        attr.quote = u'"';
+                        attrStart  = consumeSpaces(valueEnd);
+
+                        if (attr.value.contains(u'"'))
+                            continue;
+                    }
+                }
+            }
 
-                    auto attrName =
-                      QByteArray(attrStart, static_cast<int>(attrEnd - attrStart)).toLower();
+            if (isDel)
+                continue;
+            if (attr.quote && attrName.compare(u"src", Qt::CaseInsensitive) == 0 &&
+                !attr.value.startsWith(u"mxc://"))
+                attr.value = {};
+            if (attr.value.isEmpty())
+                attr.quote = 0;
+            attributes.push_back(attr);
+        }
 
-                    auto sanitizeValue = [&attrName, tagName](QByteArray val) {
-                        if (tagName == QByteArrayLiteral("del") ||
-                            (attrName == QByteArrayLiteral("src") && !val.startsWith("mxc://")))
-                            return QByteArray();
-                        else
-                            return val;
-                    };
+        // Point images at the MxcImageProvider and make emoticons scale with the font.
+        const bool rewriteImage = options.rewriteImageSources && tagName == "img";
+        bool isEmoticon         = false;
+        QString imgParams;
+        if (rewriteImage) {
+            for (const auto &attr : attributes)
+                if (attr.name.compare(u"data-mx-emoticon", Qt::CaseInsensitive) == 0)
+                    isEmoticon = options.emoticonHeight > 0;
+            for (const auto &attr : attributes)
+                if (attr.quote && attr.name.compare(u"height", Qt::CaseInsensitive) == 0)
+                    imgParams = QStringLiteral("?scale&height=%1")
+                                  .arg(isEmoticon ? options.emoticonHeight
+                                                  : leadingNumber(attr.value));
+        }
 
-                    attrStart = consumeSpaces(attrEnd);
+        for (const auto &attr : attributes) {
+            if (attr.name.isEmpty()) {
+                buffer.append(QLatin1String(QUrl::toPercentEncoding(attr.value.toString())));
+                continue;
+            }
 
-                    if (attrName.isEmpty()) {
-                        buffer.append(QUrl::toPercentEncoding(QString(QByteArray(attrStart, 1))));
-                        attrStart++;
-                        continue;
-                    } else if (attrStart < attrsEnd) {
-                        if (*attrStart == '=') {
-                            attrStart = consumeSpaces(attrStart + 1);
-
-                            if (attrStart < attrsEnd) {
-                                // we fall through here if the value is empty to transform attr=""
-                                // into attr, because otherwise we can't style it
-                                if (*attrStart == '"') {
-                                    attrStart += 1;
-                                    auto valueEnd = std::find(attrStart, attrsEnd, '"');
-                                    if (valueEnd == attrsEnd)
-                                        break;
-
-                                    auto val  = sanitizeValue(QByteArray(
-                                      attrStart, static_cast<int>(valueEnd - attrStart)));
-                                    attrStart = consumeSpaces(valueEnd + 1);
-                                    if (!val.isEmpty()) {
-                                        buffer.append(' ');
-                                        buffer.append(attrName);
-                                        buffer.append("=\"");
-                                        buffer.append(val);
-                                        buffer.append('"');
-                                        continue;
-                                    }
-                                } else if (*attrStart == '\'') {
-                                    attrStart += 1;
-                                    auto valueEnd = std::find(attrStart, attrsEnd, '\'');
-                                    if (valueEnd == attrsEnd)
-                                        break;
-
-                                    auto val  = sanitizeValue(QByteArray(
-                                      attrStart, static_cast<int>(valueEnd - attrStart)));
-                                    attrStart = consumeSpaces(valueEnd + 1);
-                                    if (!val.isEmpty()) {
-                                        buffer.append(' ');
-                                        buffer.append(attrName);
-                                        buffer.append("=\'");
-                                        buffer.append(val);
-                                        buffer.append('\'');
-                                        continue;
-                                    }
-                                } else {
-                                    auto valueEnd = std::find_first_of(attrStart,
-                                                                       attrsEnd,
-                                                                       attrValueEnds.begin(),
-                                                                       attrValueEnds.end());
-                                    auto val      = sanitizeValue(QByteArray(
-                                      attrStart, static_cast<int>(valueEnd - attrStart)));
-                                    attrStart     = consumeSpaces(valueEnd);
-
-                                    if (val.contains('"'))
-                                        continue;
-
-                                    buffer.append(' ');
-                                    buffer.append(attrName);
-                                    buffer.append("=\"");
-                                    buffer.append(val);
-                                    buffer.append('"');
-                                    continue;
-                                }
-                            }
-                        }
-                    }
+            buffer.append(u' ');
+            appendLowerAscii(buffer, attr.name);
+            if (!attr.quote)
+                continue;
 
-                    // We don't really want tags on del tags and they make replacement in the
-                    // frontend more expansive
-                    if (tagName != QByteArrayLiteral("del")) {
-                        buffer.append(' ');
-                        buffer.append(attrName);
-                    }
-                }
+            buffer.append(u'=');
+            buffer.append(QChar(attr.quote));
+            if (rewriteImage && attr.name.compare(u"src", Qt::CaseInsensitive) == 0) {
+                buffer.append(QLatin1String("image://mxcImage/"));
+                buffer.append(attr.value.sliced(6));
+                buffer.append(imgParams);
+            } else if (isEmoticon && attr.name.compare(u"height", Qt::CaseInsensitive) == 0) {
+                buffer.append(QString::number(options.emoticonHeight));
+            } else {
+                buffer.append(attr.value);
             }
+            buffer.append(QChar(attr.quote));
         }
     }
 
-    return QString::fromUtf8(buffer);
+    return buffer;
 }
 
 static void
@@ -830,7 +910,7 @@ rainbowify(cmark_node *node)
             auto curChar  = QStringView(nodeText).mid(boundaryStart, boundaryEnd - boundaryStart);
             boundaryStart = boundaryEnd;
             // Don't rainbowify whitespaces
-            if (curChar.trimmed().isEmpty() || utils::codepointIsEmoji(curChar.toUcs4().at(0))) {
+            if (curChar.trimmed().isEmpty() || emoji::clusterAt(curChar, 0).isEmoji) {
                 buf.append(curChar);
                 continue;
             }
@@ -1370,6 +1450,13 @@ utils::readImage(const QByteArray &data)
     reader.setAutoTransform(true);
     return reader.read();
 }
+QImage
+utils::readImage(QIODevice *device)
+{
+    QImageReader reader(device);
+    reader.setAutoTransform(true);
+    return reader.read();
+}
 
 bool
 utils::isReply(const mtx::events::collections::TimelineEvents &e)
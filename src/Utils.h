@@ -23,6 +23,7 @@ displayName(const QString &room_id, const QString &user_id);
 }
 
 class QComboBox;
+class QIODevice;
 
 // Contains information about related events for
 // outgoing messages
@@ -50,9 +51,6 @@ stripReplyFallbacks(const mtx::events::collections::TimelineEvents &event,
                     std::string id,
                     QString room_id_);
 
-bool
-codepointIsEmoji(uint code);
-
 QString
 replaceEmoji(const QString &body);
 
@@ -143,9 +141,20 @@ markdownToHtml(const QString &text, bool rainbowify = false, bool noExtensions =
 QString
 escapeMentionMarkdown(QString input);
 
-//! Escape every html tag, that was not whitelisted
+//! Transformations escapeBlacklistedHtml applies in the same pass.
+struct HtmlSanitizeOptions
+{
+    //! Drop the <mx-reply> fallback of replies.
+    bool stripReplyFallback = false;
+    //! Point mxc:// image sources at the MxcImageProvider.
+    bool rewriteImageSources = false;
+    //! Height of custom emoticons when rewriting image sources, 0 keeps the sent height.
+    int emoticonHeight = 0;
+};
+
+//! Escape every html tag, that was not whitelisted, and drop disallowed attribute values.
 QString
-escapeBlacklistedHtml(const QString &data);
+escapeBlacklistedHtml(const QString &data, const HtmlSanitizeOptions &options = {});
 
 //! Retrieve the color of the links based on the current theme.
 QString
@@ -183,6 +192,10 @@ readImageFromFile(const QString &filename);
 QImage
 readImage(const QByteArray &data);
 
+//! Read image respecting exif orientation
+QImage
+readImage(QIODevice *device);
+
 bool
 isReply(const mtx::events::collections::TimelineEvents &e);
 
@@ -37,12 +37,12 @@ NhekoDBusBackend::rooms() const
 {
     nhlog::ui()->debug("Rooms requested over D-Bus.");
 
-    const auto roomListModel = m_parent->models;
+    const auto &joinedRooms = m_parent->joinedRooms;
     QVector<nheko::dbus::RoomInfoItem> model;
 
-    for (const auto &room : roomListModel) {
+    for (auto room = joinedRooms.cbegin(); room != joinedRooms.cend(); ++room) {
         const auto aliases = cache::client()->getStateEvent<mtx::events::state::CanonicalAlias>(
-          room->roomId().toStdString());
+          room.key().toStdString());
         QString alias;
         if (aliases.has_value()) {
             const auto &val = aliases.value().content;
@@ -52,11 +52,11 @@ NhekoDBusBackend::rooms() const
                 alias = QString::fromStdString(val.alt_aliases.front());
         }
 
-        model.push_back(nheko::dbus::RoomInfoItem{room->roomId(),
+        model.push_back(nheko::dbus::RoomInfoItem{room.key(),
                                                   alias,
-                                                  room->plainRoomName(),
-                                                  room->roomAvatarUrl(),
-                                                  room->notificationCount()});
+                                                  room->name,
+                                                  room->avatarUrl,
+                                                  static_cast<int>(room->notificationCount)});
     }
 
     nhlog::ui()->debug("Sending {} rooms over D-Bus...", model.size());
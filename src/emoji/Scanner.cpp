@@ -0,0 +1,91 @@
+// SPDX-FileCopyrightText: Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "Scanner.h"
+
+#include "Properties.h"
+
+namespace {
+struct Codepoint
+{
+    char32_t value;
+    //! Length in UTF-16 code units, 0 at the end of the text.
+    qsizetype length;
+};
+
+Codepoint
+codepointAt(QStringView text, qsizetype pos)
+{
+    if (pos >= text.size())
+        return {0, 0};
+
+    const QChar c = text[pos];
+    if (c.isHighSurrogate() && pos + 1 < text.size() && text[pos + 1].isLowSurrogate())
+        return {QChar::surrogateToUcs4(c, text[pos + 1]), 2};
+    return {c.unicode(), 1};
+}
+}
+
+emoji::Cluster
+emoji::clusterAt(QStringView text, qsizetype pos)
+{
+    const auto base  = codepointAt(text, pos);
+    const auto props = properties(base.value);
+    auto end         = pos + base.length;
+
+    if (props & RegionalIndicator) {
+        // A lone regional indicator still gets rendered as emoji.
+        if (auto next = codepointAt(text, end); properties(next.value) & RegionalIndicator)
+            end += next.length;
+        return {end - pos, true};
+    }
+
+    if (props & KeycapBase) {
+        auto next = codepointAt(text, end);
+        if (next.value == 0xfe0f)
+            next = codepointAt(text, end += next.length);
+        if (next.value == 0x20e3)
+            return {end + next.length - pos, true};
+        return {base.length, false};
+    }
+
+    if (!(props & Emoji))
+        return {base.length, false};
+
+    // Text presentation emoji need a variation selector or a modifier to be shown as emoji.
+    bool isEmoji = props & EmojiPresentation;
+    for (auto next = codepointAt(text, end); next.length; next = codepointAt(text, end)) {
+        const auto nextProps = properties(next.value);
+        if (next.value == 0xfe0e) {
+            isEmoji = false;
+        } else if (next.value == 0xfe0f || (nextProps & Modifier)) {
+            isEmoji = true;
+        } else if (nextProps & Joiner) {
+            const auto joined = codepointAt(text, end + next.length);
+            if (!(properties(joined.value) & Emoji))
+                break;
+            end += next.length;
+            next    = joined;
+            isEmoji = true;
+        } else if (!(nextProps & Extend)) {
+            break;
+        }
+        end += next.length;
+    }
+
+    return {end - pos, isEmoji};
+}
+
+int
+emoji::onlyEmojiCount(QStringView text)
+{
+    int count = 0;
+    for (qsizetype pos = 0; pos < text.size(); count++) {
+        const auto cluster = clusterAt(text, pos);
+        if (!cluster.isEmoji)
+            return 0;
+        pos += cluster.length;
+    }
+    return count;
+}
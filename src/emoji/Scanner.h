@@ -0,0 +1,25 @@
+// SPDX-FileCopyrightText: Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <QStringView>
+
+namespace emoji {
+//! A grapheme cluster, as far as emoji are concerned. Everything else is one code point.
+struct Cluster
+{
+    //! Length in UTF-16 code units.
+    qsizetype length;
+    bool isEmoji;
+};
+
+//! Returns the cluster starting at pos, which needs to be inside of text.
+Cluster
+clusterAt(QStringView text, qsizetype pos);
+
+//! Number of emoji in text, if it consists of nothing but emoji, otherwise 0.
+int
+onlyEmojiCount(QStringView text);
+}
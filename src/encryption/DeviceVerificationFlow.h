@@ -5,6 +5,7 @@
 #pragma once
 
 #include <QObject>
+#include <QPointer>
 #include <QQmlEngine>
 
 #include <mtxclient/crypto/client.hpp>
@@ -217,7 +218,8 @@ private:
 
     std::vector<int> sasList;
     UserKeyCache their_keys;
-    TimelineModel *model_;
+    //! Rooms can be unloaded while a verification is in progress.
+    QPointer<TimelineModel> model_;
     mtx::common::Relation relation;
 
     State state_ = PromptStartVerification;
@@ -0,0 +1,491 @@
+// SPDX-FileCopyrightText: Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "EncryptedFileDevice.h"
+
+#include <QSaveFile>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include <algorithm>
+#include <limits>
+
+#include "Logging.h"
+
+namespace {
+constexpr qint64 HASH_CHUNK = 64 * 1024;
+constexpr qint64 BLOCK_SIZE = 16;
+
+//! Decodes the key and IV of an attachment.
+bool
+parseKey(const mtx::crypto::EncryptedFile &info,
+         std::array<unsigned char, 32> &key,
+         std::array<unsigned char, 16> &iv)
+{
+    auto k =
+      QByteArray::fromBase64(QByteArray::fromStdString(info.key.k), QByteArray::Base64UrlEncoding);
+    auto i = QByteArray::fromBase64(QByteArray::fromStdString(info.iv));
+    bool ok = k.size() == static_cast<qsizetype>(key.size()) &&
+              i.size() == static_cast<qsizetype>(iv.size());
+    if (ok) {
+        std::copy(k.begin(), k.end(), key.begin());
+        std::copy(i.begin(), i.end(), iv.begin());
+    }
+    OPENSSL_cleanse(k.data(), k.size());
+    return ok;
+}
+
+//! Initializes ctx to encrypt or decrypt starting at pos. In CTR mode both are the same.
+bool
+initCipher(EVP_CIPHER_CTX *ctx,
+           const std::array<unsigned char, 32> &key,
+           const std::array<unsigned char, 16> &iv,
+           qint64 pos)
+{
+    // The counter block is the IV plus the index of the block as a big endian 128 bit integer.
+    auto counter   = iv;
+    quint64 block  = static_cast<quint64>(pos / BLOCK_SIZE);
+    unsigned carry = 0;
+    for (int i = static_cast<int>(counter.size()) - 1; i >= 0; i--) {
+        unsigned sum = counter[i] + static_cast<unsigned>(block & 0xff) + carry;
+        counter[i]   = static_cast<unsigned char>(sum & 0xff);
+        carry        = sum >> 8;
+        block >>= 8;
+    }
+
+    if (EVP_CipherInit_ex(ctx, EVP_aes_256_ctr(), nullptr, key.data(), counter.data(), 0) != 1)
+        return false;
+
+    // Discard the key stream before pos in its block.
+    unsigned char skip[BLOCK_SIZE] = {};
+    int outLen                     = 0;
+    return pos % BLOCK_SIZE == 0 ||
+           EVP_CipherUpdate(ctx, skip, &outLen, skip, static_cast<int>(pos % BLOCK_SIZE)) == 1;
+}
+}
+
+namespace olm {
+EncryptedFileDevice::EncryptedFileDevice(const QString &path,
+                                         const mtx::crypto::EncryptedFile &info,
+                                         bool verifyHash,
+                                         QObject *parent)
+  : QIODevice(parent)
+  , file_(path)
+  , info_(info)
+  , hash_(QCryptographicHash::Sha256)
+  , verifyHash_(verifyHash)
+{
+}
+
+EncryptedFileDevice::~EncryptedFileDevice()
+{
+    close();
+}
+
+mtx::crypto::EncryptedFile
+EncryptedFileDevice::localFile(const mtx::crypto::EncryptedFile &info, const QString &name)
+{
+    // Like for attachments, the first half of the IV is a nonce and the second the counter.
+    QCryptographicHash nonce(QCryptographicHash::Sha256);
+    nonce.addData(QByteArray::fromStdString(info.iv));
+    nonce.addData(name.toUtf8());
+    auto iv = nonce.result().left(8) + QByteArray(8, '\0');
+
+    mtx::crypto::EncryptedFile local;
+    local.v   = info.v;
+    local.key = info.key;
+    local.iv  = iv.toBase64(QByteArray::OmitTrailingEquals).toStdString();
+    return local;
+}
+
+bool
+EncryptedFileDevice::writeFile(const QString &path,
+                               const QByteArray &data,
+                               const mtx::crypto::EncryptedFile &info)
+{
+    std::array<unsigned char, 32> key{};
+    std::array<unsigned char, 16> iv{};
+    if (!parseKey(info, key, iv))
+        return false;
+
+    auto ctx = EVP_CIPHER_CTX_new();
+    if (!ctx)
+        return false;
+
+    QByteArray encrypted(data.size(), Qt::Uninitialized);
+    int outLen = 0;
+    bool ok    = initCipher(ctx, key, iv, 0) &&
+              EVP_CipherUpdate(ctx,
+                               reinterpret_cast<unsigned char *>(encrypted.data()),
+                               &outLen,
+                               reinterpret_cast<const unsigned char *>(data.constData()),
+                               static_cast<int>(data.size())) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    OPENSSL_cleanse(key.data(), key.size());
+    if (!ok)
+        return false;
+
+    QSaveFile file(path);
+    return file.open(QIODevice::WriteOnly) && file.write(encrypted) == encrypted.size() &&
+           file.commit();
+}
+
+bool
+EncryptedFileDevice::open(OpenMode mode)
+{
+    if (mode & QIODevice::WriteOnly) {
+        setErrorString(QStringLiteral("Encrypted files can only be read"));
+        return false;
+    }
+
+    auto hash = info_.hashes.find("sha256");
+    if (!parseKey(info_, key_, iv_) || (verifyHash_ && hash == info_.hashes.end())) {
+        setErrorString(QStringLiteral("Invalid encryption info"));
+        return false;
+    }
+    if (verifyHash_)
+        expectedHash_ = QByteArray::fromBase64(QByteArray::fromStdString(hash->second));
+
+    if (!file_.open(QIODevice::ReadOnly)) {
+        setErrorString(file_.errorString());
+        return false;
+    }
+
+    ctx_ = EVP_CIPHER_CTX_new();
+    if (!ctx_) {
+        file_.close();
+        setErrorString(QStringLiteral("Failed to create cipher context"));
+        return false;
+    }
+
+    hash_.reset();
+    hashedUpTo_ = 0;
+    cipherPos_  = -1;
+    failed_     = false;
+
+    // Unbuffered, so that pos() in readData is where the caller wants to read.
+    return QIODevice::open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+}
+
+void
+EncryptedFileDevice::close()
+{
+    if (ctx_) {
+        EVP_CIPHER_CTX_free(ctx_);
+        ctx_ = nullptr;
+    }
+    OPENSSL_cleanse(key_.data(), key_.size());
+    file_.close();
+
+    if (isOpen())
+        QIODevice::close();
+}
+
+qint64
+EncryptedFileDevice::readData(char *data, qint64 maxSize)
+{
+    if (failed_)
+        return -1;
+
+    const auto pos = this->pos();
+    if (pos >= file_.size())
+        return 0;
+
+    if ((verifyHash_ && !hashUpTo(pos)) || !seekCipher(pos))
+        return -1;
+
+    const auto read = file_.read(
+      data, std::min({maxSize, file_.size() - pos, qint64{std::numeric_limits<int>::max()}}));
+    if (read < 0) {
+        fail(file_.errorString());
+        return -1;
+    }
+
+    // Hash what wasn't hashed yet before decrypting in place, so that a mismatch at the end is
+    // detected before the last bytes are returned.
+    if (verifyHash_ && pos + read > hashedUpTo_) {
+        addToHash(data + (hashedUpTo_ - pos), pos + read - hashedUpTo_);
+        if (failed_)
+            return -1;
+    }
+
+    int outLen = 0;
+    if (EVP_CipherUpdate(ctx_,
+                          reinterpret_cast<unsigned char *>(data),
+                          &outLen,
+                          reinterpret_cast<const unsigned char *>(data),
+                          static_cast<int>(read)) != 1) {
+        fail(QStringLiteral("Failed to decrypt file"));
+        return -1;
+    }
+
+    cipherPos_ = pos + read;
+    return read;
+}
+
+bool
+EncryptedFileDevice::verify()
+{
+    if (!verifyHash_)
+        return !failed_ && isOpen();
+    if (failed_ || !isOpen() || !hashUpTo(file_.size()))
+        return false;
+    return hash_.result() == expectedHash_;
+}
+
+bool
+EncryptedFileDevice::seekCipher(qint64 pos)
+{
+    if (cipherPos_ == pos)
+        return true;
+
+    if (!file_.seek(pos)) {
+        fail(file_.errorString());
+        return false;
+    }
+
+    if (!initCipher(ctx_, key_, iv_, pos)) {
+        fail(QStringLiteral("Failed to initialize cipher"));
+        return false;
+    }
+
+    cipherPos_ = pos;
+    return true;
+}
+
+bool
+EncryptedFileDevice::hashUpTo(qint64 pos)
+{
+    if (hashedUpTo_ >= pos)
+        return true;
+
+    cipherPos_ = -1;
+    if (!file_.seek(hashedUpTo_)) {
+        fail(file_.errorString());
+        return false;
+    }
+
+    QByteArray buf(HASH_CHUNK, Qt::Uninitialized);
+    while (hashedUpTo_ < pos) {
+        const auto read = file_.read(buf.data(), std::min(HASH_CHUNK, pos - hashedUpTo_));
+        if (read <= 0) {
+            fail(file_.errorString());
+            return false;
+        }
+
+        addToHash(buf.constData(), read);
+        if (failed_)
+            return false;
+    }
+
+    return true;
+}
+
+void
+EncryptedFileDevice::addToHash(const char *data, qint64 size)
+{
+    hash_.addData(QByteArrayView(data, size));
+    hashedUpTo_ += size;
+
+    if (hashedUpTo_ == file_.size() && hash_.result() != expectedHash_)
+        fail(QStringLiteral("Hash of the encrypted file doesn't match"));
+}
+
+void
+EncryptedFileDevice::fail(const QString &error)
+{
+    nhlog::crypto()->warn("Failed to read {}: {}",
+                          file_.fileName().toStdString(),
+                          error.toStdString());
+    failed_ = true;
+    setErrorString(error);
+}
+
+EncryptingDevice::EncryptingDevice(QIODevice *source, QObject *parent)
+  : QIODevice(parent)
+  , source_(source)
+  , hash_(QCryptographicHash::Sha256)
+{
+    // The second half of the IV is the counter and starts at 0, as the spec requires.
+    if (RAND_bytes(key_.data(), static_cast<int>(key_.size())) != 1 ||
+        RAND_bytes(iv_.data(), static_cast<int>(iv_.size() / 2)) != 1)
+        fail(QStringLiteral("Failed to generate key"));
+}
+
+EncryptingDevice::~EncryptingDevice()
+{
+    close();
+    OPENSSL_cleanse(key_.data(), key_.size());
+}
+
+bool
+EncryptingDevice::open(OpenMode mode)
+{
+    if (mode & QIODevice::WriteOnly) {
+        setErrorString(QStringLiteral("Encrypted uploads can only be read"));
+        return false;
+    }
+
+    if (failed_)
+        return false;
+
+    if (!source_->isOpen() && !source_->open(QIODevice::ReadOnly)) {
+        setErrorString(source_->errorString());
+        return false;
+    }
+
+    ctx_ = EVP_CIPHER_CTX_new();
+    if (!ctx_) {
+        setErrorString(QStringLiteral("Failed to create cipher context"));
+        return false;
+    }
+
+    cipherPos_ = -1;
+    return QIODevice::open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+}
+
+void
+EncryptingDevice::close()
+{
+    if (ctx_) {
+        EVP_CIPHER_CTX_free(ctx_);
+        ctx_ = nullptr;
+    }
+
+    if (isOpen())
+        QIODevice::close();
+}
+
+std::optional<mtx::crypto::EncryptedFile>
+EncryptingDevice::encryptedFile() const
+{
+    if (failed_ || hashResult_.isEmpty())
+        return std::nullopt;
+
+    auto key = QByteArray::fromRawData(reinterpret_cast<const char *>(key_.data()), key_.size());
+    auto iv  = QByteArray::fromRawData(reinterpret_cast<const char *>(iv_.data()), iv_.size());
+
+    mtx::crypto::EncryptedFile file;
+    file.v           = "v2";
+    file.key.kty     = "oct";
+    file.key.key_ops = {"encrypt", "decrypt"};
+    file.key.alg     = "A256CTR";
+    file.key.k =
+      key.toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals).toStdString();
+    file.key.ext          = true;
+    file.iv               = iv.toBase64(QByteArray::OmitTrailingEquals).toStdString();
+    file.hashes["sha256"] = hashResult_.toBase64(QByteArray::OmitTrailingEquals).toStdString();
+    return file;
+}
+
+qint64
+EncryptingDevice::readData(char *data, qint64 maxSize)
+{
+    if (failed_)
+        return -1;
+
+    const auto pos = this->pos();
+    if (pos >= size())
+        return 0;
+
+    if (!hashUpTo(pos) || !seekCipher(pos))
+        return -1;
+
+    const auto read = source_->read(
+      data, std::min({maxSize, size() - pos, qint64{std::numeric_limits<int>::max()}}));
+    if (read <= 0) {
+        fail(read < 0 ? source_->errorString() : QStringLiteral("File was truncated"));
+        return -1;
+    }
+
+    int outLen = 0;
+    if (EVP_CipherUpdate(ctx_,
+                         reinterpret_cast<unsigned char *>(data),
+                         &outLen,
+                         reinterpret_cast<const unsigned char *>(data),
+                         static_cast<int>(read)) != 1) {
+        fail(QStringLiteral("Failed to encrypt file"));
+        return -1;
+    }
+
+    cipherPos_ = pos + read;
+    if (pos + read > hashedUpTo_)
+        addToHash(data + (hashedUpTo_ - pos), pos + read - hashedUpTo_);
+    return read;
+}
+
+bool
+EncryptingDevice::seekCipher(qint64 pos)
+{
+    if (cipherPos_ == pos)
+        return true;
+
+    if (!source_->seek(pos)) {
+        fail(source_->errorString());
+        return false;
+    }
+
+    if (!initCipher(ctx_, key_, iv_, pos)) {
+        fail(QStringLiteral("Failed to initialize cipher"));
+        return false;
+    }
+
+    cipherPos_ = pos;
+    return true;
+}
+
+bool
+EncryptingDevice::hashUpTo(qint64 pos)
+{
+    if (hashedUpTo_ >= pos)
+        return true;
+
+    if (!seekCipher(hashedUpTo_))
+        return false;
+
+    QByteArray buf(HASH_CHUNK, Qt::Uninitialized);
+    while (hashedUpTo_ < pos) {
+        const auto read = source_->read(buf.data(), std::min(HASH_CHUNK, pos - hashedUpTo_));
+        if (read <= 0) {
+            fail(read < 0 ? source_->errorString() : QStringLiteral("File was truncated"));
+            return false;
+        }
+
+        int outLen = 0;
+        if (EVP_CipherUpdate(ctx_,
+                             reinterpret_cast<unsigned char *>(buf.data()),
+                             &outLen,
+                             reinterpret_cast<const unsigned char *>(buf.constData()),
+                             static_cast<int>(read)) != 1) {
+            fail(QStringLiteral("Failed to encrypt file"));
+            return false;
+        }
+
+        cipherPos_ = hashedUpTo_ + read;
+        addToHash(buf.constData(), read);
+    }
+
+    return true;
+}
+
+void
+EncryptingDevice::addToHash(const char *data, qint64 size)
+{
+    hash_.addData(QByteArrayView(data, size));
+    hashedUpTo_ += size;
+
+    if (hashedUpTo_ == this->size())
+        hashResult_ = hash_.result();
+}
+
+void
+EncryptingDevice::fail(const QString &error)
+{
+    nhlog::crypto()->warn("Failed to encrypt upload: {}", error.toStdString());
+    failed_ = true;
+    setErrorString(error);
+}
+}
@@ -0,0 +1,123 @@
+// SPDX-FileCopyrightText: Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <QCryptographicHash>
+#include <QFile>
+#include <QIODevice>
+
+#include <mtx/common.hpp>
+
+#include <array>
+#include <optional>
+
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+
+namespace olm {
+//! Decrypts an encrypted attachment while it is read from a file.
+//!
+//! AES-256-CTR can start decrypting at any block, so the device is seekable and only buffers one
+//! chunk at a time, regardless of the size of the file. The SHA-256 of the ciphertext is computed
+//! incrementally, seeking forward hashes the skipped part. Once the end of the file was hashed, a
+//! mismatch makes every further read fail. Data read before that is not verified yet, so readers,
+//! that need the whole file anyway, like image decoders, should call verify() afterwards.
+class EncryptedFileDevice final : public QIODevice
+{
+public:
+    //! verifyHash can only be disabled for files, which never left this device, see localFile().
+    EncryptedFileDevice(const QString &path,
+                        const mtx::crypto::EncryptedFile &info,
+                        bool verifyHash = true,
+                        QObject *parent = nullptr);
+    ~EncryptedFileDevice() override;
+
+    //! Encryption info for a file derived locally from the attachment described by info, like a
+    //! thumbnail. It uses the same key and an IV derived from the original one and name, so that
+    //! nothing has to be stored to decrypt it again. It has no hash.
+    static mtx::crypto::EncryptedFile
+    localFile(const mtx::crypto::EncryptedFile &info, const QString &name);
+    //! Encrypts data with info and writes it to path.
+    static bool
+    writeFile(const QString &path, const QByteArray &data, const mtx::crypto::EncryptedFile &info);
+
+    bool open(OpenMode mode) override;
+    void close() override;
+    bool isSequential() const override { return false; }
+    qint64 size() const override { return file_.size(); }
+
+    //! Hashes the rest of the file. Returns false, if it doesn't match the hash from the event.
+    bool verify();
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *, qint64) override { return -1; }
+
+private:
+    //! Positions the cipher at pos.
+    bool seekCipher(qint64 pos);
+    //! Hashes the ciphertext up to pos, which wasn't hashed yet.
+    bool hashUpTo(qint64 pos);
+    void addToHash(const char *data, qint64 size);
+    void fail(const QString &error);
+
+    QFile file_;
+    mtx::crypto::EncryptedFile info_;
+    std::array<unsigned char, 32> key_{};
+    std::array<unsigned char, 16> iv_{};
+    QByteArray expectedHash_;
+
+    EVP_CIPHER_CTX *ctx_ = nullptr;
+    QCryptographicHash hash_;
+    //! The position of the file and the cipher or -1, if they have to be seeked.
+    qint64 cipherPos_ = -1;
+    //! The ciphertext before this was hashed.
+    qint64 hashedUpTo_ = 0;
+    bool verifyHash_   = true;
+    bool failed_       = false;
+};
+
+//! Encrypts an attachment while it is read for uploading, so that only one chunk of it is in memory
+//! at a time. A new key and IV are generated for every device. The ciphertext has the same size as
+//! the plaintext and the device is seekable, so it can be sent with a known length and rewound, if
+//! the request has to be repeated. The SHA-256 of the ciphertext is computed while reading.
+class EncryptingDevice final : public QIODevice
+{
+public:
+    //! source has to stay valid while this device is used.
+    explicit EncryptingDevice(QIODevice *source, QObject *parent = nullptr);
+    ~EncryptingDevice() override;
+
+    bool open(OpenMode mode) override;
+    void close() override;
+    bool isSequential() const override { return false; }
+    qint64 size() const override { return source_->size(); }
+
+    //! The key, IV and hash for the event. Only available after all of the data was read.
+    std::optional<mtx::crypto::EncryptedFile> encryptedFile() const;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *, qint64) override { return -1; }
+
+private:
+    //! Positions the source and the cipher at pos.
+    bool seekCipher(qint64 pos);
+    //! Encrypts and hashes the data up to pos, which wasn't read yet.
+    bool hashUpTo(qint64 pos);
+    void addToHash(const char *data, qint64 size);
+    void fail(const QString &error);
+
+    QIODevice *source_;
+    std::array<unsigned char, 32> key_{};
+    std::array<unsigned char, 16> iv_{};
+
+    EVP_CIPHER_CTX *ctx_ = nullptr;
+    QCryptographicHash hash_;
+    QByteArray hashResult_;
+    qint64 cipherPos_  = -1;
+    qint64 hashedUpTo_ = 0;
+    bool failed_       = false;
+};
+}
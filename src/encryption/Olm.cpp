@@ -11,7 +11,9 @@
 #include <fmt/ranges.h>
 #include <nlohmann/json.hpp>
 
+#include <atomic>
 #include <ranges>
+#include <thread>
 #include <variant>
 
 #include <mtx/responses/common.hpp>
@@ -522,8 +524,9 @@ encrypt_group_message(const std::string &room_id, const std::string &device_id,
 
     auto own_user_id = http::client()->user_id().to_string();
 
-    auto members = cache::client()->getMembersWithKeys(
+    auto recipients = cache::client()->roomKeyRecipients(
       room_id, UserSettings::instance()->onlyShareKeysWithVerifiedUsers());
+    const auto &members = *recipients;
 
     std::map<std::string, std::vector<std::string>> sendSessionTo;
     mtx::crypto::OutboundGroupSessionPtr session = nullptr;
@@ -555,10 +558,9 @@ encrypt_group_message(const std::string &room_id, const std::string &device_id,
                     while (member_it != members.end()) {
                         sendSessionTo[member_it->first] = {};
 
-                        if (member_it->second)
-                            for (const auto &dev : member_it->second->device_keys)
-                                if (member_it->first != own_user_id || dev.first != device_id)
-                                    sendSessionTo[member_it->first].push_back(dev.first);
+                        for (const auto &dev : member_it->second)
+                            if (member_it->first != own_user_id || dev != device_id)
+                                sendSessionTo[member_it->first].push_back(dev);
 
                         ++member_it;
                     }
@@ -575,19 +577,16 @@ encrypt_group_message(const std::string &room_id, const std::string &device_id,
                     // new member, send them the session at this index
                     sendSessionTo[member_it->first] = {};
 
-                    if (member_it->second) {
-                        for (const auto &dev : member_it->second->device_keys)
-                            if (member_it->first != own_user_id || dev.first != device_id)
-                                sendSessionTo[member_it->first].push_back(dev.first);
-                    }
+                    for (const auto &dev : member_it->second)
+                        if (member_it->first != own_user_id || dev != device_id)
+                            sendSessionTo[member_it->first].push_back(dev);
 
                     ++member_it;
                 } else {
                     // compare devices
                     bool device_removed = false;
                     for (const auto &dev : session_member_it->second.deviceids) {
-                        if (!member_it->second ||
-                            !member_it->second->device_keys.count(dev.first)) {
+                        if (!member_it->second.count(dev.first)) {
                             device_removed = true;
                             break;
                         }
@@ -602,11 +601,10 @@ encrypt_group_message(const std::string &room_id, const std::string &device_id,
                     }
 
                     // check for new devices to share with
-                    if (member_it->second)
-                        for (const auto &dev : member_it->second->device_keys)
-                            if (!session_member_it->second.deviceids.count(dev.first) &&
-                                (member_it->first != own_user_id || dev.first != device_id))
-                                sendSessionTo[member_it->first].push_back(dev.first);
+                    for (const auto &dev : member_it->second)
+                        if (!session_member_it->second.deviceids.count(dev) &&
+                            (member_it->first != own_user_id || dev != device_id))
+                            sendSessionTo[member_it->first].push_back(dev);
 
                     ++member_it;
                     ++session_member_it;
@@ -642,13 +640,10 @@ encrypt_group_message(const std::string &room_id, const std::string &device_id,
         for (const auto &[user, devices] : members) {
             sendSessionTo[user]               = {};
             session_data.currently.keys[user] = {};
-            if (devices) {
-                for (const auto &[device_id_, key] : devices->device_keys) {
-                    (void)key;
-                    if (device_id != device_id_ || user != own_user_id) {
-                        sendSessionTo[user].push_back(device_id_);
-                        session_data.currently.keys[user].deviceids[device_id_] = 0;
-                    }
+            for (const auto &device_id_ : devices) {
+                if (device_id != device_id_ || user != own_user_id) {
+                    sendSessionTo[user].push_back(device_id_);
+                    session_data.currently.keys[user].deviceids[device_id_] = 0;
                 }
             }
         }
@@ -1319,6 +1314,137 @@ calculate_trust(const std::string &user_id,
     return trustlevel;
 }
 
+namespace {
+//! One olm message to one device. Either session is set or a session is created from the one
+//! time key.
+struct OlmEncryptionJob
+{
+    std::string user_id;
+    std::string device_id;
+    std::string ed25519;
+    std::string curve25519;
+    std::string one_time_key;
+    mtx::crypto::OlmSessionPtr session;
+    std::optional<mtx::events::msg::OlmEncrypted> message;
+};
+
+// Keep to-device requests well below the request size limits of common servers.
+constexpr std::size_t MAX_TO_DEVICE_MESSAGES_PER_REQUEST = 100;
+// Below this, the overhead of starting threads is higher than the encryption cost.
+constexpr std::size_t MIN_JOBS_PER_THREAD = 8;
+
+//! Calls fn(i) for every i in [0, count), spread over up to one thread per core.
+template<class Fn>
+void
+parallel_for(std::size_t count, const Fn &fn)
+{
+    const std::size_t threads = std::min<std::size_t>(
+      std::max(1U, std::thread::hardware_concurrency()), count / MIN_JOBS_PER_THREAD);
+
+    if (threads <= 1) {
+        for (std::size_t i = 0; i < count; i++)
+            fn(i);
+        return;
+    }
+
+    std::atomic<std::size_t> next{0};
+    auto work = [&next, &fn, count] {
+        for (std::size_t i = next++; i < count; i = next++)
+            fn(i);
+    };
+
+    std::vector<std::jthread> workers;
+    workers.reserve(threads - 1);
+    for (std::size_t t = 1; t < threads; t++)
+        workers.emplace_back(work);
+    work();
+}
+
+void
+send_olm_messages(const std::map<mtx::identifiers::User,
+                                 std::map<std::string, mtx::events::msg::OlmEncrypted>> &messages)
+{
+    http::client()->send_to_device<mtx::events::msg::OlmEncrypted>(
+      http::client()->generate_txn_id(), messages, [](mtx::http::RequestErr err) {
+          if (err) {
+              nhlog::net()->warn("failed to send "
+                                 "send_to_device "
+                                 "message: {}",
+                                 err->matrix_error.error);
+          }
+      });
+}
+
+//! Encrypt ev_json for every job in parallel, persist all used sessions in one transaction and
+//! send the messages in chunks. This blocks the calling thread, usually the GUI thread, until all
+//! jobs are encrypted. The worker threads only shorten that time, they don't run in the background.
+void
+encrypt_and_send_olm_messages(std::vector<OlmEncryptionJob> jobs, const nlohmann::json &ev_json)
+{
+    if (jobs.empty())
+        return;
+
+    // Every job only touches its own session, the account is only read from.
+    parallel_for(jobs.size(), [&jobs, &ev_json](std::size_t i) {
+        auto &job = jobs[i];
+        try {
+            if (!job.session)
+                job.session =
+                  olm::client()->create_outbound_session(job.curve25519, job.one_time_key);
+
+            job.message = olm::client()
+                            ->create_olm_encrypted_content(job.session.get(),
+                                                           ev_json,
+                                                           UserId(job.user_id),
+                                                           job.ed25519,
+                                                           job.curve25519)
+                            .get<mtx::events::msg::OlmEncrypted>();
+        } catch (const std::exception &e) {
+            nhlog::crypto()->warn(
+              "failed to encrypt olm message for {}:{}: {}", job.user_id, job.device_id, e.what());
+        }
+    });
+
+    auto currentTime = QDateTime::currentMSecsSinceEpoch();
+    std::vector<std::pair<std::string, mtx::crypto::OlmSessionPtr>> sessionsToPersist;
+    std::map<mtx::identifiers::User, std::map<std::string, mtx::events::msg::OlmEncrypted>>
+      messages;
+    std::size_t messagesInRequest = 0;
+    std::vector<decltype(messages)> requests;
+
+    for (auto &job : jobs) {
+        if (!job.message)
+            continue;
+
+        messages[mtx::identifiers::parse<mtx::identifiers::User>(job.user_id)][job.device_id] =
+          std::move(*job.message);
+        sessionsToPersist.emplace_back(job.curve25519, std::move(job.session));
+
+        if (++messagesInRequest >= MAX_TO_DEVICE_MESSAGES_PER_REQUEST) {
+            requests.push_back(std::move(messages));
+            messages.clear();
+            messagesInRequest = 0;
+        }
+    }
+    if (!messages.empty())
+        requests.push_back(std::move(messages));
+
+    if (!sessionsToPersist.empty()) {
+        try {
+            nhlog::crypto()->debug("Updated olm sessions: {}", sessionsToPersist.size());
+            cache::client()->saveOlmSessions(std::move(sessionsToPersist), currentTime);
+        } catch (const lmdb::error &e) {
+            nhlog::db()->critical("failed to save outbound olm session: {}", e.what());
+        } catch (const mtx::crypto::olm_exception &e) {
+            nhlog::crypto()->critical("failed to pickle outbound olm session: {}", e.what());
+        }
+    }
+
+    for (const auto &request : requests)
+        send_olm_messages(request);
+}
+}
+
 //! Send encrypted to device messages, targets is a map from userid to device ids or {} for all
 //! devices
 void
@@ -1332,288 +1458,251 @@ send_encrypted_to_device_messages(const std::map<std::string, std::vector<std::s
 
     std::map<std::string, std::vector<std::string>> keysToQuery;
     mtx::requests::ClaimKeys claims;
-    std::map<mtx::identifiers::User, std::map<std::string, mtx::events::msg::OlmEncrypted>>
-      messages;
     std::map<std::string, std::map<std::string, DevicePublicKeys>> pks;
+    std::vector<OlmEncryptionJob> jobs;
 
-    auto our_curve = olm::client()->identity_keys().curve25519;
+    auto our_curve   = olm::client()->identity_keys().curve25519;
+    auto currentTime = QDateTime::currentSecsSinceEpoch();
 
-    {
-        auto currentTime = QDateTime::currentSecsSinceEpoch();
-        std::vector<std::pair<std::string, mtx::crypto::OlmSessionPtr>> sessionsToPersist;
+    for (const auto &[user, devices] : targets) {
+        auto deviceKeys = cache::client()->userKeys(user);
 
-        for (const auto &[user, devices] : targets) {
-            auto deviceKeys = cache::client()->userKeys(user);
+        // no keys for user, query them
+        if (!deviceKeys) {
+            keysToQuery[user] = devices;
+            continue;
+        }
 
-            // no keys for user, query them
-            if (!deviceKeys) {
-                keysToQuery[user] = devices;
-                continue;
+        auto deviceTargets = devices;
+        if (devices.empty()) {
+            deviceTargets.clear();
+            deviceTargets.reserve(deviceKeys->device_keys.size());
+            for (const auto &[device, keys] : deviceKeys->device_keys) {
+                (void)keys;
+                deviceTargets.push_back(device);
             }
+        }
 
-            auto deviceTargets = devices;
-            if (devices.empty()) {
-                deviceTargets.clear();
-                deviceTargets.reserve(deviceKeys->device_keys.size());
-                for (const auto &[device, keys] : deviceKeys->device_keys) {
-                    (void)keys;
-                    deviceTargets.push_back(device);
-                }
+        for (const auto &device : deviceTargets) {
+            if (!deviceKeys->device_keys.count(device)) {
+                keysToQuery[user] = {};
+                break;
             }
 
-            for (const auto &device : deviceTargets) {
-                if (!deviceKeys->device_keys.count(device)) {
-                    keysToQuery[user] = {};
-                    break;
-                }
+            const auto &d = deviceKeys->device_keys.at(device);
 
-                const auto &d = deviceKeys->device_keys.at(device);
+            if (!d.keys.count("curve25519:" + device) || !d.keys.count("ed25519:" + device)) {
+                nhlog::crypto()->warn("Skipping device {} since it has no keys!", device);
+                continue;
+            }
 
-                if (!d.keys.count("curve25519:" + device) || !d.keys.count("ed25519:" + device)) {
-                    nhlog::crypto()->warn("Skipping device {} since it has no keys!", device);
-                    continue;
-                }
+            auto device_curve = d.keys.at("curve25519:" + device);
+            if (device_curve == our_curve) {
+                nhlog::crypto()->warn("Skipping our own device, since sending "
+                                      "ourselves olm messages makes no sense.");
+                continue;
+            }
 
-                auto device_curve = d.keys.at("curve25519:" + device);
-                if (device_curve == our_curve) {
-                    nhlog::crypto()->warn("Skipping our own device, since sending "
-                                          "ourselves olm messages makes no sense.");
-                    continue;
-                }
+            auto session = cache::getLatestOlmSession(device_curve);
+            if (!session || force_new_session) {
+                if (rateLimit.value(std::pair(user, device)) + 60 * 60 * 10 < currentTime) {
+                    claims.one_time_keys[user][device] = mtx::crypto::SIGNED_CURVE25519;
+                    pks[user][device].ed25519          = d.keys.at("ed25519:" + device);
+                    pks[user][device].curve25519       = device_curve;
 
-                auto session = cache::getLatestOlmSession(device_curve);
-                if (!session || force_new_session) {
-                    if (rateLimit.value(std::pair(user, device)) + 60 * 60 * 10 < currentTime) {
-                        claims.one_time_keys[user][device] = mtx::crypto::SIGNED_CURVE25519;
-                        pks[user][device].ed25519          = d.keys.at("ed25519:" + device);
-                        pks[user][device].curve25519       = d.keys.at("curve25519:" + device);
-
-                        rateLimit.insert(std::pair(user, device), currentTime);
-                    } else {
-                        nhlog::crypto()->warn("Not creating new session with {}:{} "
-                                              "because of rate limit",
-                                              user,
-                                              device);
-                    }
-                    continue;
+                    rateLimit.insert(std::pair(user, device), currentTime);
+                } else {
+                    nhlog::crypto()->warn("Not creating new session with {}:{} "
+                                          "because of rate limit",
+                                          user,
+                                          device);
                 }
-
-                messages[mtx::identifiers::parse<mtx::identifiers::User>(user)][device] =
-                  olm::client()
-                    ->create_olm_encrypted_content(session->get(),
-                                                   ev_json,
-                                                   UserId(user),
-                                                   d.keys.at("ed25519:" + device),
-                                                   device_curve)
-                    .get<mtx::events::msg::OlmEncrypted>();
-                sessionsToPersist.emplace_back(d.keys.at("curve25519:" + device),
-                                               std::move(*session));
+                continue;
             }
-        }
 
-        if (!sessionsToPersist.empty()) {
-            try {
-                nhlog::crypto()->debug("Updated olm sessions: {}", sessionsToPersist.size());
-                cache::client()->saveOlmSessions(std::move(sessionsToPersist), currentTime);
-            } catch (const lmdb::error &e) {
-                nhlog::db()->critical("failed to save outbound olm session: {}", e.what());
-            } catch (const mtx::crypto::olm_exception &e) {
-                nhlog::crypto()->critical("failed to pickle outbound olm session: {}", e.what());
-            }
+            jobs.push_back(OlmEncryptionJob{
+              .user_id    = user,
+              .device_id  = device,
+              .ed25519    = d.keys.at("ed25519:" + device),
+              .curve25519 = device_curve,
+              .session    = std::move(*session),
+            });
         }
     }
 
-    if (!messages.empty())
-        http::client()->send_to_device<mtx::events::msg::OlmEncrypted>(
-          http::client()->generate_txn_id(), messages, [](mtx::http::RequestErr err) {
-              if (err) {
-                  nhlog::net()->warn("failed to send "
-                                     "send_to_device "
-                                     "message: {}",
-                                     err->matrix_error.error);
-              }
-          });
-
-    auto BindPks = [ev_json](decltype(pks) pks_temp) {
-        return [pks = pks_temp, ev_json](const mtx::responses::ClaimKeys &res,
-                                         mtx::http::RequestErr) {
-            std::map<mtx::identifiers::User, std::map<std::string, mtx::events::msg::OlmEncrypted>>
-              messages;
-            auto currentTime = QDateTime::currentSecsSinceEpoch();
-            std::vector<std::pair<std::string, mtx::crypto::OlmSessionPtr>> sessionsToPersist;
-
-            for (const auto &[user_id, retrieved_devices] : res.one_time_keys) {
-                nhlog::net()->debug("claimed keys for {}", user_id);
-                if (retrieved_devices.size() == 0) {
-                    nhlog::net()->debug("no one-time keys found for user_id: {}", user_id);
-                    continue;
-                }
-
-                for (const auto &rd : retrieved_devices) {
-                    const auto device_id = rd.first;
-
-                    nhlog::net()->debug("{} : \n {}", device_id, rd.second.dump(2));
+    encrypt_and_send_olm_messages(std::move(jobs), ev_json);
 
-                    if (rd.second.empty() || !rd.second.begin()->contains("key")) {
-                        nhlog::net()->warn("Skipping device {} as it has no key.", device_id);
-                        continue;
-                    }
+    auto claimAndSend = [ev_json](const mtx::requests::ClaimKeys &claims_,
+                                  std::map<std::string, std::map<std::string, DevicePublicKeys>>
+                                    pks_) {
+        if (claims_.one_time_keys.empty())
+            return;
 
-                    auto otk = rd.second.begin()->at("key").get<std::string>();
+        http::client()->claim_keys(
+          claims_,
+          [ev_json, pks = std::move(pks_)](const mtx::responses::ClaimKeys &res,
+                                           mtx::http::RequestErr err) {
+              if (err) {
+                  nhlog::net()->warn("failed to claim one time keys: {} {}",
+                                     err->matrix_error.error,
+                                     static_cast<int>(err->status_code));
+                  return;
+              }
 
-                    auto sign_key = pks.at(user_id).at(device_id).ed25519;
-                    auto id_key   = pks.at(user_id).at(device_id).curve25519;
+              std::vector<OlmEncryptionJob> claimedJobs;
 
-                    // Verify signature
-                    {
-                        auto signedKey = *rd.second.begin();
-                        std::string signature =
-                          signedKey["signatures"][user_id].value("ed25519:" + device_id, "");
+              for (const auto &[user_id, retrieved_devices] : res.one_time_keys) {
+                  nhlog::net()->debug("claimed keys for {}", user_id);
+                  if (retrieved_devices.size() == 0) {
+                      nhlog::net()->debug("no one-time keys found for user_id: {}", user_id);
+                      continue;
+                  }
 
-                        if (signature.empty() || !mtx::crypto::ed25519_verify_signature(
-                                                   sign_key, signedKey, signature)) {
-                            nhlog::net()->warn("Skipping device {} as its one time key "
-                                               "has an invalid signature.",
-                                               device_id);
-                            continue;
-                        }
-                    }
+                  auto userPks = pks.find(user_id);
+                  if (userPks == pks.end())
+                      continue;
 
-                    auto session = olm::client()->create_outbound_session(id_key, otk);
+                  for (const auto &rd : retrieved_devices) {
+                      const auto device_id = rd.first;
 
-                    messages[mtx::identifiers::parse<mtx::identifiers::User>(user_id)][device_id] =
-                      olm::client()
-                        ->create_olm_encrypted_content(
-                          session.get(), ev_json, UserId(user_id), sign_key, id_key)
-                        .get<mtx::events::msg::OlmEncrypted>();
+                      nhlog::net()->debug("{} : \n {}", device_id, rd.second.dump(2));
 
-                    sessionsToPersist.emplace_back(id_key, std::move(session));
-                }
-                nhlog::net()->info("send_to_device: {}", user_id);
-            }
+                      if (rd.second.empty() || !rd.second.begin()->contains("key")) {
+                          nhlog::net()->warn("Skipping device {} as it has no key.", device_id);
+                          continue;
+                      }
 
-            if (!sessionsToPersist.empty()) {
-                try {
-                    nhlog::crypto()->debug("Updated (new) olm sessions: {}",
-                                           sessionsToPersist.size());
-                    cache::client()->saveOlmSessions(std::move(sessionsToPersist), currentTime);
-                } catch (const lmdb::error &e) {
-                    nhlog::db()->critical("failed to save outbound olm session: {}", e.what());
-                } catch (const mtx::crypto::olm_exception &e) {
-                    nhlog::crypto()->critical("failed to pickle outbound olm session: {}",
-                                              e.what());
-                }
-            }
+                      auto devicePks = userPks->second.find(device_id);
+                      if (devicePks == userPks->second.end())
+                          continue;
 
-            if (!messages.empty())
-                http::client()->send_to_device<mtx::events::msg::OlmEncrypted>(
-                  http::client()->generate_txn_id(), messages, [](mtx::http::RequestErr err) {
-                      if (err) {
-                          nhlog::net()->warn("failed to send "
-                                             "send_to_device "
-                                             "message: {}",
-                                             err->matrix_error.error);
+                      auto otk      = rd.second.begin()->at("key").get<std::string>();
+                      auto sign_key = devicePks->second.ed25519;
+                      auto id_key   = devicePks->second.curve25519;
+
+                      // Verify signature
+                      {
+                          auto signedKey = *rd.second.begin();
+                          std::string signature =
+                            signedKey["signatures"][user_id].value("ed25519:" + device_id, "");
+
+                          if (signature.empty() || !mtx::crypto::ed25519_verify_signature(
+                                                     sign_key, signedKey, signature)) {
+                              nhlog::net()->warn("Skipping device {} as its one time key "
+                                                 "has an invalid signature.",
+                                                 device_id);
+                              continue;
+                          }
                       }
-                  });
-        };
-    };
-
-    if (!claims.one_time_keys.empty())
-        http::client()->claim_keys(claims, BindPks(pks));
 
-    if (!keysToQuery.empty()) {
-        mtx::requests::QueryKeys req;
-        req.device_keys = keysToQuery;
-        http::client()->query_keys(
-          req,
-          [ev_json, BindPks, our_curve](const mtx::responses::QueryKeys &res,
-                                        mtx::http::RequestErr err) {
-              if (err) {
-                  nhlog::net()->warn("failed to query device keys: {} {}",
-                                     err->matrix_error.error,
-                                     static_cast<int>(err->status_code));
-                  return;
+                      claimedJobs.push_back(OlmEncryptionJob{
+                        .user_id      = user_id,
+                        .device_id    = device_id,
+                        .ed25519      = std::move(sign_key),
+                        .curve25519   = std::move(id_key),
+                        .one_time_key = std::move(otk),
+                      });
+                  }
+                  nhlog::net()->info("send_to_device: {}", user_id);
               }
 
-              nhlog::net()->info("queried keys");
+              encrypt_and_send_olm_messages(std::move(claimedJobs), ev_json);
+          });
+    };
 
-              cache::client()->updateUserKeys(cache::nextBatchToken(), res);
+    if (keysToQuery.empty()) {
+        claimAndSend(claims, std::move(pks));
+        return;
+    }
 
-              mtx::requests::ClaimKeys claim_keys;
+    // Query the missing device keys first, so that all one time keys are claimed in one request.
+    mtx::requests::QueryKeys req;
+    req.device_keys = keysToQuery;
+    http::client()->query_keys(
+      req,
+      [claimAndSend, claims, pks, our_curve](const mtx::responses::QueryKeys &res,
+                                             mtx::http::RequestErr err) mutable {
+          if (err) {
+              nhlog::net()->warn("failed to query device keys: {} {}",
+                                 err->matrix_error.error,
+                                 static_cast<int>(err->status_code));
+              claimAndSend(claims, std::move(pks));
+              return;
+          }
 
-              std::map<std::string, std::map<std::string, DevicePublicKeys>> deviceKeys;
+          nhlog::net()->info("queried keys");
 
-              for (const auto &user : res.device_keys) {
-                  for (const auto &dev : user.second) {
-                      const auto user_id   = ::UserId(dev.second.user_id);
-                      const auto device_id = DeviceId(dev.second.device_id);
+          cache::client()->updateUserKeys(cache::nextBatchToken(), res);
 
-                      if (user_id.get() == http::client()->user_id().to_string() &&
-                          device_id.get() == http::client()->device_id())
-                          continue;
+          for (const auto &user : res.device_keys) {
+              for (const auto &dev : user.second) {
+                  const auto user_id   = ::UserId(dev.second.user_id);
+                  const auto device_id = DeviceId(dev.second.device_id);
 
-                      const auto device_keys = dev.second.keys;
-                      const auto curveKey    = "curve25519:" + device_id.get();
-                      const auto edKey       = "ed25519:" + device_id.get();
+                  if (user_id.get() == http::client()->user_id().to_string() &&
+                      device_id.get() == http::client()->device_id())
+                      continue;
 
-                      if ((device_keys.find(curveKey) == device_keys.end()) ||
-                          (device_keys.find(edKey) == device_keys.end())) {
-                          nhlog::net()->debug("ignoring malformed keys for device {}",
-                                              device_id.get());
-                          continue;
-                      }
+                  const auto device_keys = dev.second.keys;
+                  const auto curveKey    = "curve25519:" + device_id.get();
+                  const auto edKey       = "ed25519:" + device_id.get();
 
-                      DevicePublicKeys pks;
-                      pks.ed25519    = device_keys.at(edKey);
-                      pks.curve25519 = device_keys.at(curveKey);
+                  if ((device_keys.find(curveKey) == device_keys.end()) ||
+                      (device_keys.find(edKey) == device_keys.end())) {
+                      nhlog::net()->debug("ignoring malformed keys for device {}",
+                                          device_id.get());
+                      continue;
+                  }
 
-                      if (pks.curve25519 == our_curve) {
-                          nhlog::crypto()->warn("Skipping our own device, since sending "
-                                                "ourselves olm messages makes no sense.");
-                          continue;
-                      }
+                  DevicePublicKeys devicePks;
+                  devicePks.ed25519    = device_keys.at(edKey);
+                  devicePks.curve25519 = device_keys.at(curveKey);
 
-                      try {
-                          if (!mtx::crypto::verify_identity_signature(
-                                dev.second, device_id, user_id)) {
-                              nhlog::crypto()->warn("failed to verify identity keys: {}",
-                                                    nlohmann::json(dev.second).dump(2));
-                              continue;
-                          }
-                      } catch (const nlohmann::json::exception &e) {
-                          nhlog::crypto()->warn("failed to parse device key json: {}", e.what());
-                          continue;
-                      } catch (const mtx::crypto::olm_exception &e) {
-                          nhlog::crypto()->warn("failed to verify device key json: {}", e.what());
-                          continue;
-                      }
+                  if (devicePks.curve25519 == our_curve) {
+                      nhlog::crypto()->warn("Skipping our own device, since sending "
+                                            "ourselves olm messages makes no sense.");
+                      continue;
+                  }
 
-                      auto currentTime = QDateTime::currentSecsSinceEpoch();
-                      if (rateLimit.value(std::pair(user.first, device_id.get())) + 60 * 60 * 10 <
-                          currentTime) {
-                          deviceKeys[user_id].emplace(device_id, pks);
-                          claim_keys.one_time_keys[user.first][device_id] =
-                            mtx::crypto::SIGNED_CURVE25519;
-
-                          rateLimit.insert(std::pair(user.first, device_id.get()), currentTime);
-                      } else {
-                          nhlog::crypto()->warn("Not creating new session with {}:{} "
-                                                "because of rate limit",
-                                                user.first,
-                                                device_id.get());
+                  try {
+                      if (!mtx::crypto::verify_identity_signature(
+                            dev.second, device_id, user_id)) {
+                          nhlog::crypto()->warn("failed to verify identity keys: {}",
+                                                nlohmann::json(dev.second).dump(2));
                           continue;
                       }
+                  } catch (const nlohmann::json::exception &e) {
+                      nhlog::crypto()->warn("failed to parse device key json: {}", e.what());
+                      continue;
+                  } catch (const mtx::crypto::olm_exception &e) {
+                      nhlog::crypto()->warn("failed to verify device key json: {}", e.what());
+                      continue;
+                  }
 
-                      nhlog::net()->info("{}", device_id.get());
-                      nhlog::net()->info("  curve25519 {}", pks.curve25519);
-                      nhlog::net()->info("  ed25519 {}", pks.ed25519);
+                  auto currentTime = QDateTime::currentSecsSinceEpoch();
+                  if (rateLimit.value(std::pair(user.first, device_id.get())) + 60 * 60 * 10 <
+                      currentTime) {
+                      pks[user.first][device_id.get()] = devicePks;
+                      claims.one_time_keys[user.first][device_id.get()] =
+                        mtx::crypto::SIGNED_CURVE25519;
+
+                      rateLimit.insert(std::pair(user.first, device_id.get()), currentTime);
+                  } else {
+                      nhlog::crypto()->warn("Not creating new session with {}:{} "
+                                            "because of rate limit",
+                                            user.first,
+                                            device_id.get());
+                      continue;
                   }
+
+                  nhlog::net()->info("{}", device_id.get());
+                  nhlog::net()->info("  curve25519 {}", devicePks.curve25519);
+                  nhlog::net()->info("  ed25519 {}", devicePks.ed25519);
               }
+          }
 
-              if (!claim_keys.one_time_keys.empty())
-                  http::client()->claim_keys(claim_keys, BindPks(deviceKeys));
-          });
-    }
+          claimAndSend(claims, std::move(pks));
+      });
 }
 
 void
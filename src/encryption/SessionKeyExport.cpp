@@ -0,0 +1,162 @@
+// SPDX-FileCopyrightText: Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "SessionKeyExport.h"
+
+#include <QIODevice>
+
+#include <nlohmann/json.hpp>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+constexpr std::uint8_t EXPORT_VERSION = 1;
+constexpr std::uint32_t PBKDF2_ROUNDS = 500000;
+constexpr std::size_t SALT_SIZE       = 16;
+constexpr std::size_t IV_SIZE         = 16;
+constexpr std::size_t KEY_SIZE        = 32;
+
+// multiple of 3, so that every chunk but the last one encodes without padding
+constexpr qsizetype BASE64_CHUNK = 3 * 4096;
+
+constexpr auto HEADER = "-----BEGIN MEGOLM SESSION DATA-----\n";
+constexpr auto FOOTER = "\n-----END MEGOLM SESSION DATA-----\n";
+}
+
+namespace olm {
+SessionKeyExportWriter::SessionKeyExportWriter(QIODevice *out, const std::string &password)
+  : out_(out)
+  , mac_(QCryptographicHash::Sha256)
+{
+    std::array<unsigned char, SALT_SIZE> salt{};
+    std::array<unsigned char, IV_SIZE> iv{};
+    std::array<unsigned char, 2 * KEY_SIZE> keys{};
+
+    // Before the cipher context is allocated, so that failing doesn't leak it.
+    write(HEADER);
+
+    if (RAND_bytes(salt.data(), salt.size()) != 1 || RAND_bytes(iv.data(), iv.size()) != 1)
+        throw std::runtime_error("Failed to generate random salt for the key export");
+    // Clear bit 63 of the counter block, some AES-CTR implementations can't handle the overflow.
+    iv[8] &= 0x7f;
+
+    if (PKCS5_PBKDF2_HMAC(password.data(),
+                          static_cast<int>(password.size()),
+                          salt.data(),
+                          salt.size(),
+                          PBKDF2_ROUNDS,
+                          EVP_sha512(),
+                          keys.size(),
+                          keys.data()) != 1)
+        throw std::runtime_error("Failed to derive the key export encryption key");
+
+    ctx_ = EVP_CIPHER_CTX_new();
+    if (!ctx_ ||
+        EVP_EncryptInit_ex(ctx_, EVP_aes_256_ctr(), nullptr, keys.data(), iv.data()) != 1)
+        throw std::runtime_error("Failed to initialize the key export cipher");
+
+    mac_.setKey(QByteArray(reinterpret_cast<const char *>(keys.data()) + KEY_SIZE, KEY_SIZE));
+    OPENSSL_cleanse(keys.data(), keys.size());
+
+    const unsigned char rounds[4] = {
+      static_cast<unsigned char>(PBKDF2_ROUNDS >> 24),
+      static_cast<unsigned char>(PBKDF2_ROUNDS >> 16),
+      static_cast<unsigned char>(PBKDF2_ROUNDS >> 8),
+      static_cast<unsigned char>(PBKDF2_ROUNDS),
+    };
+    writeBinary(reinterpret_cast<const char *>(&EXPORT_VERSION), 1);
+    writeBinary(reinterpret_cast<const char *>(salt.data()), salt.size());
+    writeBinary(reinterpret_cast<const char *>(iv.data()), iv.size());
+    writeBinary(reinterpret_cast<const char *>(rounds), sizeof(rounds));
+
+    encrypt("[");
+}
+
+SessionKeyExportWriter::~SessionKeyExportWriter()
+{
+    if (ctx_)
+        EVP_CIPHER_CTX_free(ctx_);
+}
+
+void
+SessionKeyExportWriter::addSession(const mtx::crypto::ExportedSession &session)
+{
+    if (sessionCount_++ > 0)
+        encrypt(",");
+    encrypt(nlohmann::json(session).dump());
+}
+
+void
+SessionKeyExportWriter::finish()
+{
+    if (finished_)
+        return;
+    finished_ = true;
+
+    encrypt("]");
+
+    unsigned char tail[EVP_MAX_BLOCK_LENGTH];
+    int tailLen = 0;
+    if (EVP_EncryptFinal_ex(ctx_, tail, &tailLen) != 1)
+        throw std::runtime_error("Failed to finalize the key export cipher");
+    writeBinary(reinterpret_cast<const char *>(tail), tailLen);
+
+    // The MAC covers everything written so far, but not itself.
+    pending_.append(mac_.result());
+    flushBase64(true);
+
+    write(FOOTER);
+}
+
+void
+SessionKeyExportWriter::encrypt(std::string_view plaintext)
+{
+    unsigned char buf[4096];
+
+    while (!plaintext.empty()) {
+        const auto chunk = std::min(plaintext.size(), sizeof(buf));
+        int outLen       = 0;
+        if (EVP_EncryptUpdate(ctx_,
+                              buf,
+                              &outLen,
+                              reinterpret_cast<const unsigned char *>(plaintext.data()),
+                              static_cast<int>(chunk)) != 1)
+            throw std::runtime_error("Failed to encrypt the key export");
+
+        writeBinary(reinterpret_cast<const char *>(buf), outLen);
+        plaintext.remove_prefix(chunk);
+    }
+}
+
+void
+SessionKeyExportWriter::writeBinary(const char *data, std::size_t size)
+{
+    mac_.addData(data, static_cast<qsizetype>(size));
+    pending_.append(data, static_cast<qsizetype>(size));
+
+    if (pending_.size() >= BASE64_CHUNK)
+        flushBase64(false);
+}
+
+void
+SessionKeyExportWriter::flushBase64(bool final)
+{
+    const qsizetype len = final ? pending_.size() : pending_.size() - pending_.size() % 3;
+    if (len == 0)
+        return;
+
+    write(pending_.left(len).toBase64());
+    pending_.remove(0, len);
+}
+
+void
+SessionKeyExportWriter::write(const QByteArray &data)
+{
+    if (out_->write(data) < 0)
+        throw std::runtime_error(out_->errorString().toStdString());
+}
+}
@@ -0,0 +1,58 @@
+// SPDX-FileCopyrightText: Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <QByteArray>
+#include <QMessageAuthenticationCode>
+
+#include <mtxclient/crypto/types.hpp>
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+class QIODevice;
+
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+
+namespace olm {
+//! Writes a megolm session export file incrementally.
+//!
+//! Produces the same format as mtx::crypto::encrypt_exported_sessions (version byte, salt, IV,
+//! round count, AES-256-CTR encrypted JSON session array, HMAC-SHA-256, base64 inside the usual
+//! armor), but only buffers a few kilobytes at a time, so memory use does not grow with the number
+//! of sessions exported.
+class SessionKeyExportWriter
+{
+public:
+    //! Derives the keys from password and writes the armor header. Throws on OpenSSL and write
+    //! failures, as do the other members.
+    SessionKeyExportWriter(QIODevice *out, const std::string &password);
+    ~SessionKeyExportWriter();
+
+    SessionKeyExportWriter(const SessionKeyExportWriter &)            = delete;
+    SessionKeyExportWriter &operator=(const SessionKeyExportWriter &) = delete;
+
+    void addSession(const mtx::crypto::ExportedSession &session);
+    //! Closes the JSON array, appends the MAC and the armor footer.
+    void finish();
+
+    std::size_t sessionCount() const { return sessionCount_; }
+
+private:
+    void encrypt(std::string_view plaintext);
+    void writeBinary(const char *data, std::size_t size);
+    void flushBase64(bool final);
+    void write(const QByteArray &data);
+
+    QIODevice *out_;
+    EVP_CIPHER_CTX *ctx_ = nullptr;
+    QMessageAuthenticationCode mac_;
+    QByteArray pending_;
+    std::size_t sessionCount_ = 0;
+    bool finished_            = false;
+};
+}
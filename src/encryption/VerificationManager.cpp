@@ -111,33 +111,41 @@ VerificationManager::verifyUser(QString userid)
     auto joined_rooms = cache::joinedRooms();
     auto room_infos   = cache::getRoomInfo(joined_rooms);
 
+    // Prefer a chat, that is already loaded, and only load the timeline of one otherwise.
+    QSharedPointer<TimelineModel> model;
+    QString firstMatch;
     for (const std::string &room_id : joined_rooms) {
         if ((room_infos[QString::fromStdString(room_id)].member_count == 2) &&
             cache::isRoomEncrypted(room_id)) {
             auto room_members = cache::roomMembers(room_id);
             if (std::find(room_members.begin(), room_members.end(), (userid).toStdString()) !=
                 room_members.end()) {
-                if (auto model = rooms_->getRoomById(QString::fromStdString(room_id))) {
-                    auto flow =
-                      DeviceVerificationFlow::InitiateUserVerification(this, model.data(), userid);
-                    std::unique_ptr<QObject> context{new QObject(flow.get())};
-                    QObject *pcontext = context.get();
-                    connect(
-                      model.data(),
-                      &TimelineModel::updateFlowEventId,
-                      pcontext,
-                      [this, flow, context = std::move(context)](std::string eventId) mutable {
-                          if (context->parent() == flow.get()) {
-                              dvList[QString::fromStdString(eventId)] = flow;
-                              context.reset();
-                          }
-                      });
-                    emit newDeviceVerificationRequest(flow.data());
-                    return;
-                }
+                if ((model = rooms_->loadedRoomById(QString::fromStdString(room_id))))
+                    break;
+                if (firstMatch.isEmpty())
+                    firstMatch = QString::fromStdString(room_id);
             }
         }
     }
+    if (!model && !firstMatch.isEmpty())
+        model = rooms_->getRoomById(firstMatch);
+
+    if (model) {
+        auto flow = DeviceVerificationFlow::InitiateUserVerification(this, model.data(), userid);
+        std::unique_ptr<QObject> context{new QObject(flow.get())};
+        QObject *pcontext = context.get();
+        connect(model.data(),
+                &TimelineModel::updateFlowEventId,
+                pcontext,
+                [this, flow, context = std::move(context)](std::string eventId) mutable {
+                    if (context->parent() == flow.get()) {
+                        dvList[QString::fromStdString(eventId)] = flow;
+                        context.reset();
+                    }
+                });
+        emit newDeviceVerificationRequest(flow.data());
+        return;
+    }
 
     emit ChatPage::instance()->showNotification(
       tr("No encrypted private chat found with this user. Create an "
@@ -121,13 +121,15 @@ EventStore::EventStore(std::string room_id, QObject *)
               }
 
               if constexpr (mtx::events::message_content_to_type<decltype(e.content)> !=
-                            mtx::events::EventType::Unsupported)
+                            mtx::events::EventType::Unsupported) {
+                  beginRequest();
                   http::client()->send_room_message(
                     room_id_,
                     txn_id,
                     e.content,
                     [this, txn_id, e](const mtx::responses::EventId &event_id,
                                       mtx::http::RequestErr err) {
+                        RequestGuard guard(*this);
                         if (err) {
                             const int status_code = static_cast<int>(err->status_code);
                             nhlog::net()->warn("[{}] failed to send message: {} {}",
@@ -151,6 +153,7 @@ EventStore::EventStore(std::string room_id, QObject *)
                             }
                         }
                     });
+              }
           },
           event.value());
     });
@@ -266,10 +269,12 @@ EventStore::EventStore(std::string room_id, QObject *)
               }
           }
 
+          beginRequest();
           http::client()->read_event(
             room_id_,
             event_id,
             [this, event_id](mtx::http::RequestErr err) {
+                RequestGuard guard(*this);
                 if (err) {
                     nhlog::net()->warn("failed to read_event ({}, {})", room_id_, event_id);
                 }
@@ -844,11 +849,13 @@ EventStore::get(const std::string &id,
     if (!event_ptr) {
         auto event = cache::client()->getEvent(room_id_, index.id);
         if (!event) {
+            beginRequest();
             http::client()->get_event(room_id_,
                                       index.id,
                                       [this, relatedTo = std::string(related_to), id = index.id](
                                         const mtx::events::collections::TimelineEvents &timeline,
                                         mtx::http::RequestErr err) {
+                                          RequestGuard guard(*this);
                                           if (err) {
                                               nhlog::net()->error(
                                                 "Failed to retrieve event with id {}, which was "
@@ -928,8 +935,10 @@ EventStore::fetchMore()
 
     nhlog::ui()->debug("Paginating room {}, token {}", opts.room_id, opts.from);
 
+    beginRequest();
     http::client()->messages(
       opts, [this, opts](const mtx::responses::Messages &res, mtx::http::RequestErr err) {
+          RequestGuard guard(*this);
           if (cache::client()->previousBatchToken(room_id_) != opts.from) {
               nhlog::net()->warn("Cache cleared while fetching more messages, dropping "
                                  "/messages response");
@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <limits>
 #include <string>
 
@@ -96,6 +97,26 @@ public:
     std::optional<int> idToIndex(std::string_view id) const;
     std::optional<std::string> indexToId(int idx) const;
 
+    //! If callbacks of requests, that reference this store or its timeline, are still
+    //! outstanding. The store must not be deleted until they returned.
+    bool hasPendingRequests() const { return pendingRequests_ > 0; }
+    //! Call before sending such a request. Its callback then holds a RequestGuard until it returns.
+    void beginRequest() { ++pendingRequests_; }
+
+    //! Counts a request as outstanding until its callback returns.
+    class RequestGuard
+    {
+    public:
+        explicit RequestGuard(EventStore &store)
+          : count_(store.pendingRequests_)
+        {
+        }
+        ~RequestGuard() { --count_; }
+
+    private:
+        std::atomic<int> &count_;
+    };
+
 signals:
     void beginInsertRows(int from, int to);
     void endInsertRows();
@@ -124,6 +145,7 @@ public slots:
     void enableKeyRequests(bool suppressKeyRequests_);
 
 private:
+
     olm::DecryptionResult const *
     decryptEvent(const IdIndex &idx,
                  const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &e);
@@ -149,4 +171,5 @@ private:
     int current_txn_error_count = 0;
     bool noMoreMessages         = false;
     bool suppressKeyRequests    = true;
+    std::atomic<int> pendingRequests_{0};
 };
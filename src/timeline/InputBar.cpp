@@ -9,17 +9,22 @@
 #include <QDropEvent>
 #include <QFileDialog>
 #include <QGuiApplication>
+#include <QImageReader>
 #include <QInputMethod>
 #include <QMediaMetaData>
 #include <QMediaPlayer>
 #include <QMimeData>
 #include <QMimeDatabase>
+#include <QNetworkReply>
 #include <QRegularExpression>
 #include <QStandardPaths>
 #include <QTextBoundaryFinder>
+#include <QThreadPool>
 #include <QVideoFrame>
 #include <QVideoSink>
 
+#include <cstring>
+
 #include <fmt/format.h>
 
 #include <nlohmann/json.hpp>
@@ -30,6 +35,7 @@
 #include "Cache.h"
 #include "Cache_p.h"
 #include "ChatPage.h"
+#include "EncryptedFileDevice.h"
 #include "EventAccessors.h"
 #include "Logging.h"
 #include "MainWindow.h"
@@ -44,6 +50,25 @@
 
 static constexpr size_t INPUT_HISTORY_SIZE = 10;
 
+//! Encodes the blurhash of a thumbnail. This takes a while for larger images, so it should run on a
+//! worker thread.
+static QString
+blurhashFor(QImage img)
+{
+    if (img.height() > 200 && img.width() > 360)
+        img = img.scaled(360, 200, Qt::KeepAspectRatioByExpanding);
+
+    // Let Qt convert to packed RGB in bulk, instead of extracting every pixel separately. The
+    // lines of a QImage are padded to 4 bytes, so they still have to be copied.
+    img.convertTo(QImage::Format_RGB888);
+    const auto lineSize = static_cast<std::size_t>(img.width()) * 3;
+    std::vector<unsigned char> rgb(lineSize * static_cast<std::size_t>(img.height()));
+    for (int y = 0; y < img.height(); y++)
+        std::memcpy(&rgb[lineSize * static_cast<std::size_t>(y)], img.constScanLine(y), lineSize);
+
+    return QString::fromStdString(blurhash::encode(rgb.data(), img.width(), img.height(), 4, 3));
+}
+
 std::string
 threadFallbackEventId(const std::string &room_id, const std::string &thread_id)
 {
@@ -1150,10 +1175,15 @@ MediaUpload::MediaUpload(std::unique_ptr<QIODevice> source_,
     if (!source->isOpen())
         source->open(QIODevice::ReadOnly);
 
-    data = source->readAll();
-    source->reset();
+    // Sequential devices can't be read twice and don't know their size, so keep them in memory.
+    if (source->isSequential()) {
+        auto buffer = std::make_unique<QBuffer>();
+        buffer->setData(source->readAll());
+        buffer->open(QIODevice::ReadOnly);
+        source = std::move(buffer);
+    }
 
-    if (!data.size()) {
+    if (source->size() == 0) {
         nhlog::ui()->warn("Attempted to upload zero-byte file?! Mimetype {}, filename {}",
                           mimetype_.toStdString(),
                           originalFilename_.toStdString());
@@ -1163,24 +1193,64 @@ MediaUpload::MediaUpload(std::unique_ptr<QIODevice> source_,
 
     nhlog::ui()->debug("Mime: {}", mimetype_.toStdString());
     if (mimeClass_ == u"image") {
-        QImage img = utils::readImage(data);
-        setThumbnail(img.scaled(
-          std::min(800, img.width()), std::min(800, img.height()), Qt::KeepAspectRatioByExpanding));
-
-        dimensions_ = img.size();
-        if (img.height() > 200 && img.width() > 360)
-            img = img.scaled(360, 200, Qt::KeepAspectRatioByExpanding);
-        std::vector<unsigned char> data_;
-        for (int y = 0; y < img.height(); y++) {
-            for (int x = 0; x < img.width(); x++) {
-                auto p = img.pixel(x, y);
-                data_.push_back(static_cast<unsigned char>(qRed(p)));
-                data_.push_back(static_cast<unsigned char>(qGreen(p)));
-                data_.push_back(static_cast<unsigned char>(qBlue(p)));
+        // Decoding a large photo takes a while, so don't block the input bar with it. The worker
+        // reads its own copy of the data, the source is shared with the upload.
+        QString fileName;
+        QByteArray data;
+        if (auto file = qobject_cast<QFile *>(source.get()))
+            fileName = file->fileName();
+        else if (auto buffer = qobject_cast<QBuffer *>(source.get()))
+            data = buffer->data();
+
+        metadataPending_           = true;
+        QPointer<MediaUpload> self = this;
+        QThreadPool::globalInstance()->start([self, fileName, data] {
+            QBuffer buffer;
+            QImageReader reader;
+            if (fileName.isEmpty()) {
+                buffer.setData(data);
+                buffer.open(QIODevice::ReadOnly);
+                reader.setDevice(&buffer);
+            } else {
+                reader.setFileName(fileName);
             }
-        }
-        blurhash_ =
-          QString::fromStdString(blurhash::encode(data_.data(), img.width(), img.height(), 4, 3));
+            reader.setAutoTransform(true);
+
+            // Let the decoder produce the thumbnail directly, instead of decoding the full image
+            // and scaling it down. Scaling happens before the exif rotation is applied.
+            QSize dimensions = reader.size();
+            if (dimensions.isValid()) {
+                QSize thumbnailSize = dimensions.scaled(
+                  std::min(800, dimensions.width()),
+                  std::min(800, dimensions.height()),
+                  Qt::KeepAspectRatioByExpanding);
+                if (thumbnailSize != dimensions)
+                    reader.setScaledSize(thumbnailSize);
+                if (reader.transformation() & QImageIOHandler::TransformationRotate90)
+                    dimensions.transpose();
+            }
+
+            QImage thumbnail = reader.read();
+            if (!dimensions.isValid())
+                dimensions = thumbnail.size();
+            QString hash = thumbnail.isNull() ? QString() : blurhashFor(thumbnail);
+
+            QMetaObject::invokeMethod(
+              QCoreApplication::instance(),
+              [self, thumbnail = std::move(thumbnail), dimensions, hash = std::move(hash)] {
+                  if (!self)
+                      return;
+
+                  self->dimensions_ = dimensions;
+                  self->blurhash_   = hash;
+                  self->setThumbnail(thumbnail);
+
+                  self->metadataPending_ = false;
+                  if (self->uploadRequested_)
+                      self->startUpload();
+              },
+              Qt::QueuedConnection);
+        });
     } else if (mimeClass_ == u"video" || mimeClass_ == u"audio") {
         auto mediaPlayer = new QMediaPlayer(this);
         mediaPlayer->setAudioOutput(nullptr);
@@ -1211,19 +1281,25 @@ MediaUpload::MediaUpload(std::unique_ptr<QIODevice> source_,
                         if (!dimensions_.isValid())
                             this->dimensions_ = img.size();
 
-                        if (img.height() > 200 && img.width() > 360)
-                            img = img.scaled(360, 200, Qt::KeepAspectRatioByExpanding);
-                        std::vector<unsigned char> data_;
-                        for (int y = 0; y < img.height(); y++) {
-                            for (int x = 0; x < img.width(); x++) {
-                                auto p = img.pixel(x, y);
-                                data_.push_back(static_cast<unsigned char>(qRed(p)));
-                                data_.push_back(static_cast<unsigned char>(qGreen(p)));
-                                data_.push_back(static_cast<unsigned char>(qBlue(p)));
-                            }
-                        }
-                        blurhash_ = QString::fromStdString(
-                          blurhash::encode(data_.data(), img.width(), img.height(), 4, 3));
+                        // Don't send the thumbnail without its blurhash.
+                        metadataPending_           = true;
+                        auto request               = ++blurhashRequest_;
+                        QPointer<MediaUpload> self = this;
+                        QThreadPool::globalInstance()->start([self, request, img = std::move(img)] {
+                            auto hash = blurhashFor(img);
+                            QMetaObject::invokeMethod(
+                              QCoreApplication::instance(),
+                              [self, request, hash = std::move(hash)] {
+                                  if (!self || self->blurhashRequest_ != request)
+                                      return;
+
+                                  self->blurhash_        = hash;
+                                  self->metadataPending_ = false;
+                                  if (self->uploadRequested_)
+                                      self->startUpload();
+                              },
+                              Qt::QueuedConnection);
+                        });
                     });
             mediaPlayer->setVideoOutput(newSurface);
         }
@@ -1278,19 +1354,36 @@ MediaUpload::MediaUpload(std::unique_ptr<QIODevice> source_,
     }
 }
 
+MediaUpload::~MediaUpload()
+{
+    // The reply reads from devices owned by this.
+    if (reply_) {
+        reply_->disconnect(this);
+        reply_->abort();
+        reply_->deleteLater();
+    }
+}
+
 void
 MediaUpload::startUpload()
 {
+    // The thumbnail is still being generated, upload once it is done.
+    if (metadataPending_) {
+        uploadRequested_ = true;
+        return;
+    }
+    uploadRequested_ = false;
+
     if (!thumbnail_.isNull() && thumbnailUrl_.isEmpty()) {
         QByteArray ba;
         QBuffer buffer(&ba);
         buffer.open(QIODevice::WriteOnly);
         thumbnail_.save(&buffer, "PNG", 0);
-        if (type() == MediaType::Image && ba.size() >= (data.size() - data.size() / 10)) {
+        if (type() == MediaType::Image && ba.size() >= (source->size() - source->size() / 10)) {
             nhlog::ui()->info(
               "Thumbnail is not a lot smaller than original image, not uploading it");
             nhlog::ui()->debug(
-              "\n    Image size: {:9d}\nThumbnail size: {:9d}", data.size(), ba.size());
+              "\n    Image size: {:9d}\nThumbnail size: {:9d}", source->size(), ba.size());
         } else {
             auto payload = std::string(ba.data(), ba.size());
             if (encrypt_) {
@@ -1328,36 +1421,75 @@ MediaUpload::startUpload()
         }
     }
 
-    auto payload = std::string(data.data(), data.size());
+    QIODevice *body = source.get();
+    if (auto file = qobject_cast<QFile *>(source.get()))
+        uploadSource_ = std::make_unique<QFile>(file->fileName());
+    else if (auto buffer = qobject_cast<QBuffer *>(source.get()))
+        uploadSource_ = std::make_unique<QBuffer>(&buffer->buffer());
+
+    if (uploadSource_ && uploadSource_->open(QIODevice::ReadOnly))
+        body = uploadSource_.get();
+    else
+        source->reset();
+
+    // The file is encrypted while it is sent, so that it never has to be in memory completely.
     if (encrypt_) {
-        mtx::crypto::BinaryBuf buf;
-        std::tie(buf, encryptedFile) = mtx::crypto::encrypt_file(std::move(payload));
-        payload                      = mtx::crypto::to_string(buf);
+        encryptor_ = std::make_unique<olm::EncryptingDevice>(body);
+        if (!encryptor_->open(QIODevice::ReadOnly)) {
+            nhlog::net()->warn("failed to encrypt media: {}",
+                               encryptor_->errorString().toStdString());
+            emit uploadFailed(this);
+            return;
+        }
+        body = encryptor_.get();
     }
-    size_ = payload.size();
-
-    http::client()->upload(
-      payload,
-      encryptedFile ? "application/octet-stream" : mimetype_.toStdString(),
-      encrypt_ ? "" : originalFilename_.toStdString(),
-      [this](const mtx::responses::ContentURI &res, mtx::http::RequestErr err) mutable {
-          if (err) {
-              emit ChatPage::instance()->showNotification(
-                tr("Failed to upload media. Please try again."));
-              nhlog::net()->warn("failed to upload media: {} {} ({})",
-                                 err->matrix_error.error,
-                                 to_string(err->matrix_error.errcode),
-                                 static_cast<int>(err->status_code));
-              emit uploadFailed(this);
-              return;
-          }
-
-          auto url = QString::fromStdString(res.content_uri);
-          if (encryptedFile)
-              encryptedFile->url = res.content_uri;
-
-          emit uploadComplete(this, std::move(url));
-      });
+    size_ = static_cast<uint64_t>(body->size());
+
+    reply_ = http::uploadMedia(body,
+                               encrypt_ ? QStringLiteral("application/octet-stream") : mimetype_,
+                               encrypt_ ? QString() : originalFilename_);
+    connect(reply_, &QNetworkReply::uploadProgress, this, [this](qint64 sent, qint64) {
+        bytesSent_ = sent;
+        emit progressChanged();
+    });
+    connect(reply_, &QNetworkReply::finished, this, [this, reply = reply_.data()] {
+        reply->deleteLater();
+
+        const auto response = reply->readAll();
+        std::string url;
+        if (reply->error() == QNetworkReply::NoError) {
+            try {
+                url = nlohmann::json::parse(response.constData(),
+                                            response.constData() + response.size())
+                        .get<mtx::responses::ContentURI>()
+                        .content_uri;
+            } catch (const std::exception &e) {
+                nhlog::net()->warn("failed to parse upload response: {}", e.what());
+            }
+        }
+
+        if (encryptor_ && !url.empty()) {
+            encryptedFile = encryptor_->encryptedFile();
+            if (encryptedFile)
+                encryptedFile->url = url;
+            else
+                url.clear();
+        }
+
+        if (url.empty()) {
+            emit ChatPage::instance()->showNotification(
+              tr("Failed to upload media. Please try again."));
+            nhlog::net()->warn(
+              "failed to upload media: {} ({}): {}",
+              reply->errorString().toStdString(),
+              reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt(),
+              response.toStdString());
+            emit uploadFailed(this);
+            return;
+        }
+
+        emit uploadComplete(this, QString::fromStdString(url));
+    });
 }
 
 void
@@ -1460,6 +1592,7 @@ InputBar::startUpload(std::unique_ptr<QIODevice> dev, const QString &orgPath, co
     auto upload =
       UploadHandle(new MediaUpload(std::move(dev), format, orgPath, room->isEncrypted(), this));
     connect(upload.get(), &MediaUpload::uploadComplete, this, &InputBar::finalizeUpload);
+    connect(upload.get(), &MediaUpload::progressChanged, this, &InputBar::uploadProgressChanged);
     // TODO(Nico): Show a retry option
     connect(upload.get(), &MediaUpload::uploadFailed, this, [this](MediaUpload *up) {
         ChatPage::instance()->showNotification(tr("Upload of '%1' failed").arg(up->filename()));
@@ -7,6 +7,7 @@
 #include <QIODevice>
 #include <QImage>
 #include <QObject>
+#include <QPointer>
 #include <QQmlEngine>
 #include <QSize>
 #include <QStringList>
@@ -24,6 +25,11 @@ class TimelineModel;
 class CombinedImagePackModel;
 class QMimeData;
 class QDropEvent;
+class QNetworkReply;
+
+namespace olm {
+class EncryptingDevice;
+}
 
 struct DeleteLaterDeleter
 {
@@ -54,6 +60,7 @@ class MediaUpload final : public QObject
     Q_PROPERTY(QUrl thumbnail READ thumbnailDataUrl NOTIFY thumbnailChanged)
     //    Q_PROPERTY(QString humanSize READ humanSize NOTIFY huSizeChanged)
     Q_PROPERTY(QString filename READ filename WRITE setFilename NOTIFY filenameChanged)
+    Q_PROPERTY(double progress READ progress NOTIFY progressChanged)
 
     // thumbnail video
     // https://stackoverflow.com/questions/26229633/display-on-screen-using-qabstractvideosurface
@@ -73,6 +80,7 @@ public:
                          const QString &originalFilename,
                          bool encrypt,
                          QObject *parent = nullptr);
+    ~MediaUpload() override;
 
     [[nodiscard]] int type() const
     {
@@ -101,6 +109,13 @@ public:
         return thumbnailEncryptedFile;
     }
     [[nodiscard]] QSize dimensions() const { return dimensions_; }
+    //! The fraction of the file, which was sent already.
+    [[nodiscard]] double progress() const
+    {
+        return source->size() > 0
+                 ? static_cast<double>(bytesSent_) / static_cast<double>(source->size())
+                 : 0;
+    }
 
     QImage thumbnailImg() const { return thumbnail_; }
     QString thumbnailUrl() const { return thumbnailUrl_; }
@@ -121,6 +136,7 @@ signals:
     void filenameChanged();
     void thumbnailChanged();
     void mediaTypeChanged();
+    void progressChanged();
 
 public slots:
     void startUpload();
@@ -136,7 +152,11 @@ public:
     // void uploadThumbnail(QImage img);
 
     std::unique_ptr<QIODevice> source;
-    QByteArray data;
+    //! A second device reading the same data as source, so that uploading doesn't interfere with
+    //! generating the thumbnail of a video.
+    std::unique_ptr<QIODevice> uploadSource_;
+    std::unique_ptr<olm::EncryptingDevice> encryptor_;
+    QPointer<QNetworkReply> reply_;
     QString mimetype_;
     QString mimeClass_;
     QString originalFilename_;
@@ -151,13 +171,21 @@ public:
     uint64_t size_          = 0;
     uint64_t thumbnailSize_ = 0;
     uint64_t duration_      = 0;
+    qint64 bytesSent_       = 0;
     bool encrypt_;
+    //! The thumbnail or the blurhash is generated on a worker thread and the upload has to wait
+    //! for it.
+    bool metadataPending_ = false;
+    bool uploadRequested_ = false;
+    //! Videos can produce more than one frame, only the blurhash of the last one is used.
+    int blurhashRequest_ = 0;
 };
 
 class InputBar final : public QObject
 {
     Q_OBJECT
     Q_PROPERTY(bool uploading READ uploading NOTIFY uploadingChanged)
+    Q_PROPERTY(double uploadProgress READ uploadProgress NOTIFY uploadProgressChanged)
     Q_PROPERTY(
       bool containsInvalidCommand READ containsInvalidCommand NOTIFY containsInvalidCommandChanged)
     Q_PROPERTY(bool containsIncompleteCommand READ containsIncompleteCommand NOTIFY
@@ -234,6 +262,10 @@ public slots:
     void updateState(int selectionStart, int selectionEnd, int cursorPosition, const QString &text);
     void openFileSelection();
     [[nodiscard]] bool uploading() const { return uploading_; }
+    [[nodiscard]] double uploadProgress() const
+    {
+        return runningUploads.empty() ? 0 : runningUploads.front()->progress();
+    }
     void message(const QString &body,
                  MarkdownOverride useMarkdown = MarkdownOverride::NOT_SPECIFIED,
                  bool rainbowify              = false);
@@ -253,6 +285,7 @@ private slots:
 signals:
     void textChanged(QString newText);
     void uploadingChanged(bool value);
+    void uploadProgressChanged();
     void containsInvalidCommandChanged();
     void mentionsChanged();
     void containsIncompleteCommandChanged();
@@ -4,12 +4,15 @@
 
 #include "RoomlistModel.h"
 
+#include <algorithm>
+
 #include <QClipboard>
 #include <QGuiApplication>
 
 #include "Cache.h"
 #include "Cache_p.h"
 #include "ChatPage.h"
+#include "EventAccessors.h"
 #include "Logging.h"
 #include "MainWindow.h"
 #include "MatrixClient.h"
@@ -24,6 +27,94 @@
 #include <QDBusConnection>
 #endif
 
+namespace {
+enum NotificationImportance : short
+{
+    NoPreview          = -3,
+    Preview            = -2,
+    ImportanceDisabled = -1,
+    AllEventsRead      = 0,
+    NewMessage         = 1,
+    NewMentions        = 2,
+    Invite             = 3,
+    SubSpace           = 4,
+    CurrentSpace       = 5,
+};
+
+//! How many room timelines are kept in memory. Rooms open in a window are never unloaded.
+constexpr qsizetype MAX_LOADED_ROOMS = 64;
+
+template<typename... Events, typename Variant>
+bool
+holdsAnyOf(const Variant &v)
+{
+    return (std::holds_alternative<Events>(v) || ...);
+}
+
+//! Describes the last message of a room from the cache, so that the room list doesn't need the
+//! timeline of every room. Like TimelineModel::updateLastMessage(), but only the most recent
+//! events are looked at.
+DescInfo
+lastMessageFromCache(const std::string &room_id, bool decrypt)
+{
+    auto range = cache::client()->getTimelineRange(room_id);
+    if (!range)
+        return {};
+
+    for (uint64_t i = range->last, n = 0; i >= range->first && n < 50; --i, ++n) {
+        auto event_id = cache::client()->getTimelineEventId(room_id, i);
+        auto event    = event_id ? cache::client()->getEvent(room_id, *event_id) : std::nullopt;
+        if (event && decrypt) {
+            if (auto encrypted =
+                  std::get_if<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(&*event)) {
+                auto result =
+                  olm::decryptEvent(MegolmSessionIndex(room_id, encrypted->content), *encrypted);
+                if (result.event)
+                    event = std::move(result.event);
+            }
+        }
+
+        if (event && mtx::accessors::is_message(*event))
+            return utils::getMessageDescription(
+              *event,
+              utils::localUser(),
+              cache::displayName(QString::fromStdString(room_id),
+                                 QString::fromStdString(mtx::accessors::sender(*event))));
+
+        if (i == range->first)
+            break;
+    }
+    return {};
+}
+
+//! Whether a sync contains events, which only a loaded TimelineModel can handle.
+bool
+needsTimeline(const mtx::responses::JoinedRoom &room)
+{
+    using namespace mtx::events;
+    for (const auto &e : room.timeline.events) {
+        if (holdsAnyOf<EncryptedEvent<msg::Encrypted>,
+                       RoomEvent<voip::CallInvite>,
+                       RoomEvent<voip::CallCandidates>,
+                       RoomEvent<voip::CallAnswer>,
+                       RoomEvent<voip::CallHangUp>,
+                       RoomEvent<voip::CallSelectAnswer>,
+                       RoomEvent<voip::CallReject>,
+                       RoomEvent<voip::CallNegotiate>,
+                       RoomEvent<msg::KeyVerificationRequest>,
+                       RoomEvent<msg::KeyVerificationStart>,
+                       RoomEvent<msg::KeyVerificationAccept>,
+                       RoomEvent<msg::KeyVerificationKey>,
+                       RoomEvent<msg::KeyVerificationMac>,
+                       RoomEvent<msg::KeyVerificationCancel>,
+                       RoomEvent<msg::KeyVerificationReady>,
+                       RoomEvent<msg::KeyVerificationDone>>(e))
+            return true;
+    }
+    return false;
+}
+}
+
 RoomlistModel::RoomlistModel(TimelineViewManager *parent)
   : QAbstractListModel(parent)
   , manager(parent)
@@ -39,8 +130,98 @@ RoomlistModel::RoomlistModel(TimelineViewManager *parent)
                 ptr->updateLastMessage();
             }
         }
+
+        for (auto it = joinedRooms.begin(); it != joinedRooms.end(); ++it) {
+            if (models.contains(it.key()))
+                continue;
+            if (auto description = lastMessageFromCache(it.key().toStdString(), decrypt);
+                !description.event_id.isEmpty())
+                it->lastMessage = std::move(description);
+        }
+        if (!roomids.empty())
+            emit dataChanged(index(0), index(rowCount() - 1), {Roles::LastMessage});
     });
 
+    // Keep the room index, sort keys and membership in step with roomids. These are connected
+    // before any proxy model, so they are updated before the proxy sorts or filters.
+    connect(this,
+            &QAbstractItemModel::rowsInserted,
+            this,
+            [this](const QModelIndex &, int first, int last) {
+                sortKeys.insert(sortKeys.begin() + first, last - first + 1, SortKey{});
+                membership.insert(membership.begin() + first * membershipStride,
+                                  (last - first + 1) * membershipStride,
+                                  0);
+                membershipDirty.insert(membershipDirty.begin() + first, last - first + 1, true);
+                reindexRooms(first);
+            });
+    connect(this,
+            &QAbstractItemModel::rowsAboutToBeRemoved,
+            this,
+            [this](const QModelIndex &, int first, int last) {
+                for (int i = first; i <= last; i++)
+                    roomIndex.remove(roomids[i]);
+            });
+    connect(this,
+            &QAbstractItemModel::rowsRemoved,
+            this,
+            [this](const QModelIndex &, int first, int last) {
+                sortKeys.erase(sortKeys.begin() + first, sortKeys.begin() + last + 1);
+                membership.erase(membership.begin() + first * membershipStride,
+                                 membership.begin() + (last + 1) * membershipStride);
+                membershipDirty.erase(membershipDirty.begin() + first,
+                                      membershipDirty.begin() + last + 1);
+                reindexRooms(first);
+            });
+    connect(this, &QAbstractItemModel::modelReset, this, [this]() {
+        sortKeys.assign(roomids.size(), SortKey{});
+        membership.assign(roomids.size() * membershipStride, 0);
+        membershipDirty.assign(roomids.size(), true);
+        roomIndex.clear();
+        reindexRooms(0);
+    });
+    connect(this,
+            &QAbstractItemModel::dataChanged,
+            this,
+            [this](const QModelIndex &topLeft,
+                   const QModelIndex &bottomRight,
+                   const QList<int> &roles) {
+                static const QList<int> sortRoles = {
+                  Roles::RoomName,
+                  Roles::Timestamp,
+                  Roles::HasLoudNotification,
+                  Roles::NotificationCount,
+                  Roles::IsInvite,
+                  Roles::IsSpace,
+                  Roles::IsPreview,
+                  Roles::IsPreviewFetched,
+                };
+                static const QList<int> membershipRoles = {
+                  Roles::Tags,
+                  Roles::ParentSpaces,
+                  Roles::IsDirect,
+                  Roles::IsSpace,
+                  Roles::IsPreview,
+                  Roles::IsPreviewFetched,
+                };
+
+                bool affectsSorting    = roles.isEmpty();
+                bool affectsMembership = roles.isEmpty();
+                for (auto role : roles) {
+                    affectsSorting    = affectsSorting || sortRoles.contains(role);
+                    affectsMembership = affectsMembership || membershipRoles.contains(role);
+                }
+
+                for (int i = std::max(topLeft.row(), 0);
+                     i <= bottomRight.row() && i < (int)sortKeys.size();
+                     i++) {
+                    if (affectsSorting)
+                        sortKeys[i].dirty = true;
+                    if (affectsMembership)
+                        membershipDirty[i] = true;
+                }
+            });
+
     connect(this,
             &RoomlistModel::totalUnreadMessageCountUpdated,
             ChatPage::instance(),
@@ -112,8 +293,46 @@ RoomlistModel::data(const QModelIndex &index, int role) const
                                                   : QLatin1String("");
         }
 
-        if (models.contains(roomid)) {
+        if (auto summary = joinedRooms.constFind(roomid); summary != joinedRooms.constEnd()) {
+            if (role == Roles::Tags) {
+                auto info = cache::singleRoomInfo(roomid.toStdString());
+                QStringList list;
+                list.reserve(static_cast<int>(info.tags.size()));
+                for (const auto &t : info.tags)
+                    list.push_back(QString::fromStdString(t));
+                return list;
+            }
+
             auto room = models.value(roomid);
+            if (!room) {
+                switch (role) {
+                case Roles::AvatarUrl:
+                    return summary->avatarUrl;
+                case Roles::RoomName:
+                    return summary->name;
+                case Roles::LastMessage:
+                    return summary->lastMessage.body;
+                case Roles::Time:
+                    return summary->lastMessage.descriptiveTime;
+                case Roles::Timestamp:
+                    return QVariant{static_cast<quint64>(summary->lastMessage.timestamp)};
+                case Roles::HasUnreadMessages:
+                    return this->roomReadStatus.count(roomid) && this->roomReadStatus.at(roomid);
+                case Roles::HasLoudNotification:
+                    return summary->highlightCount > 0;
+                case Roles::NotificationCount:
+                    return static_cast<int>(summary->notificationCount);
+                case Roles::IsInvite:
+                    return false;
+                case Roles::IsSpace:
+                    return summary->isSpace;
+                case Roles::IsPreview:
+                    return false;
+                default:
+                    return {};
+                }
+            }
+
             switch (role) {
             case Roles::AvatarUrl:
                 return room->roomAvatarUrl();
@@ -137,14 +356,6 @@ RoomlistModel::data(const QModelIndex &index, int role) const
                 return room->isSpace();
             case Roles::IsPreview:
                 return false;
-            case Roles::Tags: {
-                auto info = cache::singleRoomInfo(roomid.toStdString());
-                QStringList list;
-                list.reserve(static_cast<int>(info.tags.size()));
-                for (const auto &t : info.tags)
-                    list.push_back(QString::fromStdString(t));
-                return list;
-            }
             default:
                 return {};
             }
@@ -245,6 +456,98 @@ RoomlistModel::data(const QModelIndex &index, int role) const
     }
 }
 
+const RoomlistModel::SortKey &
+RoomlistModel::sortKey(int row) const
+{
+    auto &key = sortKeys[row];
+    if (!key.dirty)
+        return key;
+
+    auto idx = index(row);
+    if (data(idx, Roles::IsSpace).toBool())
+        key.importance = SubSpace;
+    else if (data(idx, Roles::IsPreview).toBool())
+        key.importance = data(idx, Roles::IsPreviewFetched).toBool() ? Preview : NoPreview;
+    else if (data(idx, Roles::IsInvite).toBool())
+        key.importance = Invite;
+    else if (data(idx, Roles::HasLoudNotification).toBool())
+        key.importance = NewMentions;
+    else if (data(idx, Roles::NotificationCount).toInt() > 0)
+        key.importance = NewMessage;
+    else
+        key.importance = AllEventsRead;
+
+    key.timestamp  = data(idx, Roles::Timestamp).toULongLong();
+    key.foldedName = data(idx, Roles::RoomName).toString().toCaseFolded();
+    key.dirty      = false;
+    return key;
+}
+
+int
+RoomlistModel::membershipBit(const QString &id) const
+{
+    if (auto bit = membershipBits.constFind(id); bit != membershipBits.constEnd())
+        return *bit;
+
+    int bit = FirstTagOrSpaceBit + static_cast<int>(membershipBits.size());
+    membershipBits.insert(id, bit);
+
+    // Widen all rows, if the new bit doesn't fit anymore.
+    auto stride = static_cast<std::size_t>(bit / 64 + 1);
+    if (stride > membershipStride) {
+        std::vector<quint64> widened(roomids.size() * stride, 0);
+        for (std::size_t row = 0; row < roomids.size(); row++)
+            std::copy_n(membership.begin() + row * membershipStride,
+                        membershipStride,
+                        widened.begin() + row * stride);
+        membership       = std::move(widened);
+        membershipStride = stride;
+    }
+
+    return bit;
+}
+
+const quint64 *
+RoomlistModel::membershipOf(int row) const
+{
+    if (membershipDirty[row]) {
+        auto idx = index(row);
+
+        // Look up all bits first, since adding a bit can widen the rows.
+        std::vector<int> bits;
+        if (data(idx, Roles::IsPreview).toBool())
+            bits.push_back(PreviewBit);
+        if (data(idx, Roles::IsPreviewFetched).toBool())
+            bits.push_back(PreviewFetchedBit);
+        if (data(idx, Roles::IsSpace).toBool())
+            bits.push_back(SpaceBit);
+        if (data(idx, Roles::IsDirect).toBool())
+            bits.push_back(DirectBit);
+
+        auto tags = data(idx, Roles::Tags).toStringList();
+        for (const auto &t : std::as_const(tags))
+            bits.push_back(membershipBit(QStringLiteral("tag:") + t));
+        auto parents = data(idx, Roles::ParentSpaces).toStringList();
+        for (const auto &p : std::as_const(parents))
+            bits.push_back(membershipBit(QStringLiteral("space:") + p));
+
+        auto words = membership.begin() + row * membershipStride;
+        std::fill_n(words, membershipStride, 0);
+        for (auto bit : bits)
+            words[bit / 64] |= quint64{1} << (bit % 64);
+        membershipDirty[row] = false;
+    }
+
+    return membership.data() + row * membershipStride;
+}
+
+void
+RoomlistModel::reindexRooms(int from)
+{
+    for (int i = from; i < (int)roomids.size(); i++)
+        roomIndex[roomids[i]] = i;
+}
+
 void
 RoomlistModel::updateReadStatus(const std::map<QString, bool> &roomReadStatus_)
 {
@@ -269,7 +572,7 @@ RoomlistModel::updateReadStatus(const std::map<QString, bool> &roomReadStatus_)
 void
 RoomlistModel::addRoom(const QString &room_id, bool suppressInsertNotification)
 {
-    if (!models.contains(room_id)) {
+    if (!joinedRooms.contains(room_id)) {
         // ensure we get read status updates and are only connected once
         // WORKAROUND(Nico): This is not a lambda, but clazy on alpine currently doesn't
         // believe us...
@@ -279,85 +582,32 @@ RoomlistModel::addRoom(const QString &room_id, bool suppressInsertNotification)
                 &RoomlistModel::updateReadStatus,
                 Qt::UniqueConnection); // clazy:exclude=lambda-unique-connection
 
-        QSharedPointer<TimelineModel> newRoom(new TimelineModel(manager, room_id));
-        newRoom->setDecryptDescription(ChatPage::instance()->userSettings()->decryptSidebar());
-
-        connect(this,
-                &RoomlistModel::currentRoomChanged,
-                newRoom.data(),
-                &TimelineModel::updateLastReadId);
-        connect(MainWindow::instance(),
-                &MainWindow::activeChanged,
-                newRoom.data(),
-                &TimelineModel::lastReadIdOnWindowFocus);
-        connect(newRoom.data(),
-                &TimelineModel::newEncryptedImage,
-                MainWindow::instance()->imageProvider(),
-                &MxcImageProvider::addEncryptionInfo);
-        connect(newRoom.data(),
-                &TimelineModel::forwardToRoom,
-                manager,
-                &TimelineViewManager::forwardMessageToRoom);
-        connect(newRoom.data(), &TimelineModel::lastMessageChanged, this, [room_id, this]() {
-            auto idx = this->roomidToIndex(room_id);
-            emit dataChanged(index(idx),
-                             index(idx),
-                             {
-                               Roles::HasLoudNotification,
-                               Roles::LastMessage,
-                               Roles::Time,
-                               Roles::Timestamp,
-                               Roles::NotificationCount,
-                               Qt::DisplayRole,
-                             });
-        });
-        connect(newRoom.data(), &TimelineModel::roomAvatarUrlChanged, this, [room_id, this]() {
-            auto idx = this->roomidToIndex(room_id);
-            emit dataChanged(index(idx),
-                             index(idx),
-                             {
-                               Roles::AvatarUrl,
-                             });
-        });
-        connect(newRoom.data(), &TimelineModel::roomNameChanged, this, [room_id, this]() {
-            auto idx = this->roomidToIndex(room_id);
-            emit dataChanged(index(idx),
-                             index(idx),
-                             {
-                               Roles::RoomName,
-                             });
-        });
-        connect(newRoom.data(), &TimelineModel::notificationsChanged, this, [room_id, this]() {
-            auto idx = this->roomidToIndex(room_id);
-            emit dataChanged(index(idx),
-                             index(idx),
-                             {
-                               Roles::HasLoudNotification,
-                               Roles::NotificationCount,
-                               Qt::DisplayRole,
-                             });
-
-            if (getRoomById(room_id)->isSpace())
-                return; // no need to update space notifications
-
-            int total_unread_msgs = 0;
-
-            for (const auto &room : std::as_const(models)) {
-                if (!room.isNull() && !room->isSpace())
-                    total_unread_msgs += room->notificationCount();
-            }
-
-            emit totalUnreadMessageCountUpdated(total_unread_msgs);
-        });
-
-        // newRoom->updateLastMessage();
+        // The TimelineModel is only created, once the room is opened. Until then the room list
+        // is served from the cached room info and timeline.
+        auto info = cache::singleRoomInfo(room_id.toStdString());
+        JoinedRoomSummary summary;
+        summary.name        = QString::fromStdString(info.name);
+        summary.avatarUrl   = QString::fromStdString(info.avatar_url);
+        summary.lastMessage = lastMessageFromCache(
+          room_id.toStdString(), ChatPage::instance()->userSettings()->decryptSidebar());
+        if (summary.lastMessage.event_id.isEmpty() && info.approximate_last_modification_ts != 0) {
+            summary.lastMessage.timestamp = info.approximate_last_modification_ts;
+            summary.lastMessage.datetime =
+              QDateTime::fromMSecsSinceEpoch(static_cast<qint64>(summary.lastMessage.timestamp));
+            summary.lastMessage.descriptiveTime =
+              utils::descriptiveTime(summary.lastMessage.datetime);
+        }
+        summary.notificationCount     = info.notification_count;
+        summary.highlightCount        = info.highlight_count;
+        summary.isSpace               = info.is_space;
 
         std::vector<QString> previewsToAdd;
-        if (newRoom->isSpace()) {
+        if (summary.isSpace) {
             auto childs = cache::client()->getChildRoomIds(room_id.toStdString());
             for (const auto &c : childs) {
                 auto id = QString::fromStdString(c);
-                if (!(models.contains(id) || invites.contains(id) || previewedRooms.contains(id))) {
+                if (!(joinedRooms.contains(id) || invites.contains(id) ||
+                      previewedRooms.contains(id))) {
                     previewsToAdd.push_back(std::move(id));
                 }
             }
@@ -373,7 +623,7 @@ RoomlistModel::addRoom(const QString &room_id, bool suppressInsertNotification)
               (int)roomids.size(),
               (int)(roomids.size() + previewsToAdd.size() - ((wasInvite || wasPreview) ? 1 : 0)));
 
-        models.insert(room_id, std::move(newRoom));
+        joinedRooms.insert(room_id, std::move(summary));
         if (wasInvite) {
             auto idx = roomidToIndex(room_id);
             invites.remove(room_id);
@@ -388,7 +638,7 @@ RoomlistModel::addRoom(const QString &room_id, bool suppressInsertNotification)
 
         if ((wasInvite || wasPreview) && currentRoomPreview_ &&
             currentRoomPreview_->roomid() == room_id) {
-            currentRoom_ = models.value(room_id);
+            currentRoom_ = getRoomById(room_id);
             currentRoomPreview_.reset();
             emit currentRoomChanged(room_id);
         }
@@ -405,6 +655,234 @@ RoomlistModel::addRoom(const QString &room_id, bool suppressInsertNotification)
     }
 }
 
+QSharedPointer<TimelineModel>
+RoomlistModel::loadRoom(const QString &room_id)
+{
+    // Deleted from the event loop, a model can be unloaded while one of its signals is handled.
+    QSharedPointer<TimelineModel> newRoom(new TimelineModel(manager, room_id),
+                                          &QObject::deleteLater);
+    newRoom->setDecryptDescription(ChatPage::instance()->userSettings()->decryptSidebar());
+
+    connect(
+      this, &RoomlistModel::currentRoomChanged, newRoom.data(), &TimelineModel::updateLastReadId);
+    connect(MainWindow::instance(),
+            &MainWindow::activeChanged,
+            newRoom.data(),
+            &TimelineModel::lastReadIdOnWindowFocus);
+    connect(newRoom.data(),
+            &TimelineModel::newEncryptedImage,
+            MainWindow::instance()->imageProvider(),
+            &MxcImageProvider::addEncryptionInfo);
+    connect(newRoom.data(),
+            &TimelineModel::forwardToRoom,
+            manager,
+            &TimelineViewManager::forwardMessageToRoom);
+    connect(newRoom.data(),
+            &TimelineModel::newCallEvent,
+            ChatPage::instance()->callManager(),
+            &CallManager::syncEvent);
+
+    // The summary is kept up to date, so that nothing changes in the room list, when the room is
+    // unloaded again. Connections are dropped with their sender, so capturing model is safe.
+    auto model = newRoom.data();
+    connect(model, &TimelineModel::lastMessageChanged, this, [model, room_id, this]() {
+        if (auto summary = joinedRooms.find(room_id); summary != joinedRooms.end())
+            summary->lastMessage = model->lastMessage();
+
+        auto idx = this->roomidToIndex(room_id);
+        emit dataChanged(index(idx),
+                         index(idx),
+                         {
+                           Roles::HasLoudNotification,
+                           Roles::LastMessage,
+                           Roles::Time,
+                           Roles::Timestamp,
+                           Roles::NotificationCount,
+                           Qt::DisplayRole,
+                         });
+    });
+    connect(model, &TimelineModel::roomAvatarUrlChanged, this, [model, room_id, this]() {
+        if (auto summary = joinedRooms.find(room_id); summary != joinedRooms.end())
+            summary->avatarUrl = model->roomAvatarUrl();
+
+        auto idx = this->roomidToIndex(room_id);
+        emit dataChanged(index(idx),
+                         index(idx),
+                         {
+                           Roles::AvatarUrl,
+                         });
+    });
+    connect(model, &TimelineModel::roomNameChanged, this, [model, room_id, this]() {
+        if (auto summary = joinedRooms.find(room_id); summary != joinedRooms.end())
+            summary->name = model->plainRoomName();
+
+        auto idx = this->roomidToIndex(room_id);
+        emit dataChanged(index(idx),
+                         index(idx),
+                         {
+                           Roles::RoomName,
+                         });
+    });
+    connect(model, &TimelineModel::notificationsChanged, this, [model, room_id, this]() {
+        if (auto summary = joinedRooms.find(room_id); summary != joinedRooms.end()) {
+            summary->notificationCount = static_cast<uint64_t>(model->notificationCount());
+            summary->highlightCount    = model->hasMentions() ? 1 : 0;
+        }
+
+        auto idx = this->roomidToIndex(room_id);
+        emit dataChanged(index(idx),
+                         index(idx),
+                         {
+                           Roles::HasLoudNotification,
+                           Roles::NotificationCount,
+                           Qt::DisplayRole,
+                         });
+
+        if (model->isSpace())
+            return; // no need to update space notifications
+
+        emitTotalUnreadMessageCount();
+    });
+
+    models.insert(room_id, newRoom);
+    newRoom->updateLastMessage();
+
+    evictRooms();
+    return newRoom;
+}
+
+QSharedPointer<TimelineModel>
+RoomlistModel::getRoomById(const QString &id)
+{
+    auto summary = joinedRooms.find(id);
+    if (summary == joinedRooms.end())
+        return {};
+
+    summary->lastUsed = ++roomUseCounter;
+
+    if (auto room = models.value(id))
+        return room;
+
+    if (auto room = evictedModels.take(id).toStrongRef()) {
+        models.insert(id, room);
+        evictRooms();
+        return room;
+    }
+    return loadRoom(id);
+}
+
+void
+RoomlistModel::evictRooms()
+{
+    if (models.size() <= MAX_LOADED_ROOMS)
+        return;
+
+    std::vector<std::pair<uint64_t, QString>> candidates;
+    candidates.reserve(models.size());
+    for (auto it = models.cbegin(); it != models.cend(); ++it) {
+        // Rooms shown in a window, including the current room, are never unloaded.
+        if ((currentRoom_ && currentRoom_->roomId() == it.key()) ||
+            MainWindow::instance()->windowForRoom(it.key()))
+            continue;
+        candidates.emplace_back(joinedRooms.value(it.key()).lastUsed, it.key());
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    for (const auto &[lastUsed, id] : candidates) {
+        if (models.size() <= MAX_LOADED_ROOMS)
+            break;
+
+        // Pending messages are sent by the EventStore of the room and callbacks of outstanding
+        // requests reference it, so keep it around.
+        auto model = models.value(id);
+        if (model->hasPendingRequests() ||
+            !cache::client()->pendingEvents(id.toStdString()).empty())
+            continue;
+
+        joinedRooms[id].lastMessage = model->lastMessage();
+        evictedModels.insert(id, model);
+        models.remove(id);
+        nhlog::ui()->debug("Unloaded timeline of {}", id.toStdString());
+    }
+
+    for (auto it = evictedModels.begin(); it != evictedModels.end();) {
+        if (it->isNull())
+            it = evictedModels.erase(it);
+        else
+            ++it;
+    }
+}
+
+void
+RoomlistModel::updateSummary(const QString &room_id, const mtx::responses::JoinedRoom &room)
+{
+    using namespace mtx::events;
+
+    auto summary = joinedRooms.find(room_id);
+    if (summary == joinedRooms.end())
+        return;
+
+    auto idx = roomidToIndex(room_id);
+
+    auto isInfoEvent = [](const auto &e) {
+        return holdsAnyOf<StateEvent<state::Avatar>,
+                          StateEvent<state::Name>,
+                          StateEvent<state::Member>>(e);
+    };
+    if (std::any_of(room.state.events.begin(), room.state.events.end(), isInfoEvent) ||
+        std::any_of(room.timeline.events.begin(), room.timeline.events.end(), isInfoEvent)) {
+        auto info          = cache::singleRoomInfo(room_id.toStdString());
+        summary->name      = QString::fromStdString(info.name);
+        summary->avatarUrl = QString::fromStdString(info.avatar_url);
+        emit dataChanged(
+          index(idx), index(idx), {Roles::AvatarUrl, Roles::RoomName, Qt::DisplayRole});
+    }
+
+    for (auto e = room.timeline.events.rbegin(); e != room.timeline.events.rend(); ++e) {
+        if (!mtx::accessors::is_message(*e))
+            continue;
+
+        auto ts = mtx::accessors::origin_server_ts_ms(*e);
+        if (ts > summary->lastMessage.timestamp) {
+            // The sync was already stored, so the description can be read from the cache.
+            summary->lastMessage = lastMessageFromCache(
+              room_id.toStdString(), ChatPage::instance()->userSettings()->decryptSidebar());
+            emit dataChanged(
+              index(idx), index(idx), {Roles::LastMessage, Roles::Time, Roles::Timestamp});
+        }
+        break;
+    }
+
+    if (room.unread_notifications.notification_count != summary->notificationCount ||
+        room.unread_notifications.highlight_count != summary->highlightCount) {
+        summary->notificationCount = room.unread_notifications.notification_count;
+        summary->highlightCount    = room.unread_notifications.highlight_count;
+        emit dataChanged(index(idx),
+                         index(idx),
+                         {
+                           Roles::HasLoudNotification,
+                           Roles::NotificationCount,
+                           Qt::DisplayRole,
+                         });
+
+        if (!summary->isSpace)
+            emitTotalUnreadMessageCount();
+    }
+}
+
+void
+RoomlistModel::emitTotalUnreadMessageCount()
+{
+    int total_unread_msgs = 0;
+
+    for (const auto &room : std::as_const(joinedRooms)) {
+        if (!room.isSpace)
+            total_unread_msgs += static_cast<int>(room.notificationCount);
+    }
+
+    emit totalUnreadMessageCountUpdated(total_unread_msgs);
+}
+
 void
 RoomlistModel::fetchPreviews(QString roomid_, const std::string &from)
 {
@@ -415,7 +893,7 @@ RoomlistModel::fetchPreviews(QString roomid_, const std::string &from)
         bool fetch    = false;
         for (const auto &c : children) {
             auto id = QString::fromStdString(c);
-            if (invites.contains(id) || models.contains(id) ||
+            if (invites.contains(id) || joinedRooms.contains(id) ||
                 (previewedRooms.contains(id) && previewedRooms.value(id).has_value()))
                 continue;
             else {
@@ -529,19 +1007,18 @@ RoomlistModel::sync(const mtx::responses::Sync &sync_)
 
         // addRoom will only add the room, if it doesn't exist
         addRoom(qroomid);
-        const auto &room_model = models.value(qroomid);
+        auto room_model = loadedRoomById(qroomid);
+        if (!room_model && needsTimeline(room))
+            room_model = getRoomById(qroomid);
 
-        // WORKAROUND(Nico): This is not a lambda, but clazy on alpine currently doesn't
-        // believe us
-        connect(room_model.data(),
-                &TimelineModel::newCallEvent,
-                ChatPage::instance()->callManager(),
-                &CallManager::syncEvent,
-                Qt::UniqueConnection); // clazy:exclude=lambda-unique-connection
-
-        room_model->sync(room);
+        // Unloaded rooms read everything from the cache, once they are loaded again.
+        if (!room_model) {
+            updateSummary(qroomid, room);
+        } else {
+            room_model->sync(room);
+        }
 
-        if (ChatPage::instance()->userSettings()->typingNotifications()) {
+        if (room_model && ChatPage::instance()->userSettings()->typingNotifications()) {
             for (const auto &ev : room.ephemeral.events) {
                 if (auto t =
                       std::get_if<mtx::events::EphemeralEvent<mtx::events::ephemeral::Typing>>(
@@ -563,6 +1040,15 @@ RoomlistModel::sync(const mtx::responses::Sync &sync_)
                     emit dataChanged(index(idx), index(idx), {Tags});
             }
         }
+
+        // Space relations may change the parents of any room, not just this one.
+        auto isSpaceRelation = [](const auto &e) {
+            return holdsAnyOf<mtx::events::StateEvent<mtx::events::state::space::Child>,
+                              mtx::events::StateEvent<mtx::events::state::space::Parent>>(e);
+        };
+        if (std::any_of(room.state.events.begin(), room.state.events.end(), isSpaceRelation) ||
+            std::any_of(room.timeline.events.begin(), room.timeline.events.end(), isSpaceRelation))
+            membershipDirty.assign(membershipDirty.size(), true);
     }
 
     for (const auto &[room_id, room] : sync_.rooms.leave) {
@@ -577,9 +1063,11 @@ RoomlistModel::sync(const mtx::responses::Sync &sync_)
         if (idx != -1) {
             beginRemoveRows(QModelIndex(), idx, idx);
             roomids.erase(roomids.begin() + idx);
-            if (models.contains(qroomid))
+            if (joinedRooms.contains(qroomid)) {
+                joinedRooms.remove(qroomid);
                 models.remove(qroomid);
-            else if (invites.contains(qroomid))
+                evictedModels.remove(qroomid);
+            } else if (invites.contains(qroomid))
                 invites.remove(qroomid);
             endRemoveRows();
         }
@@ -611,7 +1099,10 @@ RoomlistModel::initializeRooms()
 {
     beginResetModel();
     models.clear();
+    evictedModels.clear();
+    joinedRooms.clear();
     roomids.clear();
+    roomIndex.clear();
     invites.clear();
     currentRoom_ = nullptr;
 
@@ -651,8 +1142,11 @@ RoomlistModel::clear()
 {
     beginResetModel();
     models.clear();
+    evictedModels.clear();
+    joinedRooms.clear();
     invites.clear();
     roomids.clear();
+    roomIndex.clear();
     currentRoom_ = nullptr;
     emit currentRoomChanged("");
     endResetModel();
@@ -704,13 +1198,15 @@ RoomlistModel::leave(QString roomid, QString reason)
 {
     // We want to leave in any case, even if this is an invite or similar.
     ChatPage::instance()->leaveRoom(roomid, reason);
-    if (models.contains(roomid)) {
+    if (joinedRooms.contains(roomid)) {
         auto idx = roomidToIndex(roomid);
 
         if (idx != -1) {
             beginRemoveRows(QModelIndex(), idx, idx);
             roomids.erase(roomids.begin() + idx);
+            joinedRooms.remove(roomid);
             models.remove(roomid);
+            evictedModels.remove(roomid);
             endRemoveRows();
         }
     }
@@ -765,8 +1261,8 @@ RoomlistModel::setCurrentRoom(const QString &roomid)
     }
 
     nhlog::ui()->debug("Trying to switch to: {}", roomid.toStdString());
-    if (models.contains(roomid)) {
-        currentRoom_ = models.value(roomid);
+    if (joinedRooms.contains(roomid)) {
+        currentRoom_ = getRoomById(roomid);
         currentRoomPreview_.reset();
         emit currentRoomChanged(currentRoom_->roomId());
         nhlog::ui()->debug("Switched to: {}", roomid.toStdString());
@@ -828,48 +1324,22 @@ RoomlistModel::refetchOnlineKeyBackupKeys()
     }
 }
 
-namespace {
-enum NotificationImportance : short
-{
-    NoPreview          = -3,
-    Preview            = -2,
-    ImportanceDisabled = -1,
-    AllEventsRead      = 0,
-    NewMessage         = 1,
-    NewMentions        = 2,
-    Invite             = 3,
-    SubSpace           = 4,
-    CurrentSpace       = 5,
-};
-}
-
 short int
 FilteredRoomlistModel::calculateImportance(const QModelIndex &idx) const
 {
     // Returns the degree of importance of the unread messages in the room.
     // If sorting by importance is disabled in settings, this only ever
     // returns ImportanceDisabled or Invite
-    if (sourceModel()->data(idx, RoomlistModel::IsSpace).toBool()) {
-        if (filterType == FilterBy::Space &&
-            filterStr == sourceModel()->data(idx, RoomlistModel::RoomId).toString())
+    auto importance = roomlistmodel->sortKey(idx.row()).importance;
+    if (importance == SubSpace) {
+        if (filterType == FilterBy::Space && filterStr == roomlistmodel->roomids[idx.row()])
             return CurrentSpace;
         else
             return SubSpace;
-    } else if (sourceModel()->data(idx, RoomlistModel::IsPreview).toBool()) {
-        if (sourceModel()->data(idx, RoomlistModel::IsPreviewFetched).toBool())
-            return Preview;
-        else
-            return NoPreview;
-    } else if (sourceModel()->data(idx, RoomlistModel::IsInvite).toBool()) {
-        return Invite;
-    } else if (!this->sortByImportance) {
+    } else if (!this->sortByImportance && importance >= AllEventsRead && importance < Invite) {
         return ImportanceDisabled;
-    } else if (sourceModel()->data(idx, RoomlistModel::HasLoudNotification).toBool()) {
-        return NewMentions;
-    } else if (sourceModel()->data(idx, RoomlistModel::NotificationCount).toInt() > 0) {
-        return NewMessage;
     } else {
-        return AllEventsRead;
+        return importance;
     }
 }
 
@@ -893,19 +1363,15 @@ FilteredRoomlistModel::lessThan(const QModelIndex &left, const QModelIndex &righ
     // Now sort by recency or room name
     // Zero if empty, otherwise the time that the event occured
 
+    const auto &a_key = roomlistmodel->sortKey(left.row());
+    const auto &b_key = roomlistmodel->sortKey(right.row());
     if (this->sortByAlphabet) {
-        QString a_order = sourceModel()->data(left_idx, RoomlistModel::RoomName).toString();
-        QString b_order = sourceModel()->data(right_idx, RoomlistModel::RoomName).toString();
-
-        auto comp = a_order.compare(b_order, Qt::CaseInsensitive);
+        auto comp = a_key.foldedName.compare(b_key.foldedName);
         if (comp != 0)
             return comp < 0;
     } else {
-        uint64_t a_order = sourceModel()->data(left_idx, RoomlistModel::Timestamp).toULongLong();
-        uint64_t b_order = sourceModel()->data(right_idx, RoomlistModel::Timestamp).toULongLong();
-
-        if (a_order != b_order)
-            return a_order > b_order;
+        if (a_key.timestamp != b_key.timestamp)
+            return a_key.timestamp > b_key.timestamp;
     }
 
     return left.row() < right.row();
@@ -921,6 +1387,7 @@ FilteredRoomlistModel::FilteredRoomlistModel(RoomlistModel *model, QObject *pare
     this->sortByAlphabet   = UserSettings::instance()->sortByAlphabet();
     setSourceModel(model);
     setDynamicSortFilter(true);
+    updateFilterMasks();
 
     QObject::connect(UserSettings::instance().get(),
                      &UserSettings::roomSortingChangedImportance,
@@ -991,175 +1458,39 @@ FilteredRoomlistModel::updateHiddenTagsAndSpaces()
             hideDMs = true;
     }
 
+    updateFilterMasks();
     invalidateFilter();
 }
 
 bool
 FilteredRoomlistModel::filterAcceptsRow(int sourceRow, const QModelIndex &) const
 {
-    if (filterType == FilterBy::Nothing) {
-        if (sourceModel()
-              ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsPreview)
-              .toBool()) {
-            return false;
-        }
-
-        if (sourceModel()
-              ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsSpace)
-              .toBool()) {
-            return false;
-        }
-
-        if (!hiddenTags.empty()) {
-            auto tags = sourceModel()
-                          ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::Tags)
-                          .toStringList();
-
-            for (const auto &t : std::as_const(tags))
-                if (hiddenTags.contains(t))
-                    return false;
-        }
-
-        if (!hiddenSpaces.empty()) {
-            auto parents = sourceModel()
-                             ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::ParentSpaces)
-                             .toStringList();
-            for (const auto &t : std::as_const(parents))
-                if (hiddenSpaces.contains(t))
-                    return false;
-        }
-
-        if (hideDMs) {
-            return !sourceModel()
-                      ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsDirect)
-                      .toBool();
-        }
-
+    if (filterType == FilterBy::Space && filterStr == roomlistmodel->roomids[sourceRow])
         return true;
-    } else if (filterType == FilterBy::DirectChats) {
-        if (sourceModel()
-              ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsPreview)
-              .toBool()) {
-            return false;
-        }
 
-        if (sourceModel()
-              ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsSpace)
-              .toBool()) {
-            return false;
-        }
-
-        if (!hiddenTags.empty()) {
-            auto tags = sourceModel()
-                          ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::Tags)
-                          .toStringList();
-
-            for (const auto &t : std::as_const(tags))
-                if (hiddenTags.contains(t))
-                    return false;
-        }
+    const quint64 *bits = roomlistmodel->membershipOf(sourceRow);
+    auto hasBit         = [bits](int bit) { return ((bits[bit / 64] >> (bit % 64)) & 1) != 0; };
 
-        if (!hiddenSpaces.empty()) {
-            auto parents = sourceModel()
-                             ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::ParentSpaces)
-                             .toStringList();
-            for (const auto &t : std::as_const(parents))
-                if (hiddenSpaces.contains(t))
-                    return false;
-        }
-
-        return sourceModel()
-          ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsDirect)
-          .toBool();
-    } else if (filterType == FilterBy::Tag) {
-        if (sourceModel()
-              ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsPreview)
-              .toBool()) {
+    for (std::size_t i = 0; i < hiddenMask.size(); i++)
+        if (bits[i] & hiddenMask[i])
             return false;
-        }
-
-        if (sourceModel()
-              ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsSpace)
-              .toBool()) {
-            return false;
-        }
-
-        auto tags = sourceModel()
-                      ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::Tags)
-                      .toStringList();
-
-        if (!tags.contains(filterStr))
-            return false;
-
-        if (!hiddenTags.empty()) {
-            for (const auto &t : std::as_const(tags))
-                if (t != filterStr && hiddenTags.contains(t))
-                    return false;
-        }
-
-        if (!hiddenSpaces.empty()) {
-            auto parents = sourceModel()
-                             ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::ParentSpaces)
-                             .toStringList();
-            for (const auto &t : std::as_const(parents))
-                if (hiddenSpaces.contains(t))
-                    return false;
-        }
-
-        if (hideDMs) {
-            return !sourceModel()
-                      ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsDirect)
-                      .toBool();
-        }
 
+    if (filterType == FilterBy::Nothing) {
         return true;
+    } else if (filterType == FilterBy::DirectChats) {
+        return hasBit(RoomlistModel::DirectBit);
+    } else if (filterType == FilterBy::Tag) {
+        return hasBit(filterBit);
     } else if (filterType == FilterBy::Space) {
-        if (filterStr == sourceModel()
-                           ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::RoomId)
-                           .toString())
-            return true;
-
-        auto parents = sourceModel()
-                         ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::ParentSpaces)
-                         .toStringList();
-
-        if (!parents.contains(filterStr))
+        if (!hasBit(filterBit))
             return false;
 
-        if (!hiddenTags.empty()) {
-            auto tags = sourceModel()
-                          ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::Tags)
-                          .toStringList();
-
-            for (const auto &t : std::as_const(tags))
-                if (hiddenTags.contains(t))
-                    return false;
-        }
-
-        if (!hiddenSpaces.empty()) {
-            for (const auto &t : std::as_const(parents))
-                if (t != filterStr && hiddenSpaces.contains(t))
-                    return false;
-        }
-
-        if (sourceModel()
-              ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsSpace)
-              .toBool() &&
-            !parents.contains(filterStr)) {
-            return false;
-        }
-
-        if (hideDMs) {
-            return !sourceModel()
-                      ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsDirect)
-                      .toBool();
-        }
+        if (hideDMs)
+            return true;
 
         // If it is a preview but it can't be fetched, it is probably an inaccessible private room.
         // Hide it if the user isn't an admin.
-        auto index = sourceModel()->index(sourceRow, 0);
-        if (sourceModel()->data(index, RoomlistModel::IsPreview).toBool() &&
-            !sourceModel()->data(index, RoomlistModel::IsPreviewFetched).toBool() &&
+        if (hasBit(RoomlistModel::PreviewBit) && !hasBit(RoomlistModel::PreviewFetchedBit) &&
             !Permissions(filterStr).canChange(qml_mtx_events::SpaceChild)) {
             return false;
         }
@@ -1170,6 +1501,39 @@ FilteredRoomlistModel::filterAcceptsRow(int sourceRow, const QModelIndex &) cons
     }
 }
 
+void
+FilteredRoomlistModel::updateFilterMasks()
+{
+    hiddenMask.clear();
+    auto hide = [this](int bit) {
+        if (hiddenMask.size() <= static_cast<std::size_t>(bit / 64))
+            hiddenMask.resize(bit / 64 + 1, 0);
+        hiddenMask[bit / 64] |= quint64{1} << (bit % 64);
+    };
+
+    filterBit = -1;
+    if (filterType == FilterBy::Tag)
+        filterBit = roomlistmodel->membershipBit(QStringLiteral("tag:") + filterStr);
+    else if (filterType == FilterBy::Space)
+        filterBit = roomlistmodel->membershipBit(QStringLiteral("space:") + filterStr);
+
+    // Previews and spaces are only shown inside of their space.
+    if (filterType != FilterBy::Space) {
+        hide(RoomlistModel::PreviewBit);
+        hide(RoomlistModel::SpaceBit);
+    }
+
+    for (const auto &t : std::as_const(hiddenTags))
+        if (!(filterType == FilterBy::Tag && t == filterStr))
+            hide(roomlistmodel->membershipBit(QStringLiteral("tag:") + t));
+    for (const auto &t : std::as_const(hiddenSpaces))
+        if (!(filterType == FilterBy::Space && t == filterStr))
+            hide(roomlistmodel->membershipBit(QStringLiteral("space:") + t));
+
+    if (hideDMs && filterType != FilterBy::DirectChats)
+        hide(RoomlistModel::DirectBit);
+}
+
 void
 FilteredRoomlistModel::toggleTag(const QString &roomid, const QString &tag, bool on)
 {
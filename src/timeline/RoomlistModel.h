@@ -91,12 +91,14 @@ public:
         return (int)roomids.size();
     }
     QVariant data(const QModelIndex &index, int role) const override;
-    QSharedPointer<TimelineModel> getRoomById(QString id) const
+    //! Returns the timeline of a joined room, creating it if it is not loaded.
+    QSharedPointer<TimelineModel> getRoomById(const QString &id);
+    //! Returns the timeline of a joined room, if it is currently loaded.
+    QSharedPointer<TimelineModel> loadedRoomById(const QString &id) const
     {
-        if (models.contains(id))
-            return models.value(id);
-        else
-            return {};
+        if (auto room = models.value(id))
+            return room;
+        return evictedModels.value(id).toStrongRef();
     }
     RoomPreview getRoomPreviewById(QString roomid) const;
 
@@ -106,15 +108,7 @@ public slots:
     void initializeRooms();
     void sync(const mtx::responses::Sync &sync_);
     void clear();
-    int roomidToIndex(const QString &roomid)
-    {
-        for (int i = 0; i < (int)roomids.size(); i++) {
-            if (roomids[i] == roomid)
-                return i;
-        }
-
-        return -1;
-    }
+    int roomidToIndex(const QString &roomid) const { return roomIndex.value(roomid, -1); }
     void joinPreview(const QString &roomid);
     void acceptInvite(QString roomid);
     void declineInvite(QString roomid);
@@ -139,14 +133,73 @@ signals:
     void spaceSelected(QString roomId);
 
 private:
+    //! What the room list shows for a joined room, while its TimelineModel is not loaded.
+    struct JoinedRoomSummary
+    {
+        QString name;
+        QString avatarUrl;
+        DescInfo lastMessage;
+        uint64_t notificationCount = 0;
+        uint64_t highlightCount    = 0;
+        bool isSpace               = false;
+        uint64_t lastUsed          = 0;
+    };
+
+    //! What FilteredRoomlistModel sorts by, so that comparisons don't go through data().
+    struct SortKey
+    {
+        //! The NotificationImportance when sorting by importance, with no space selected.
+        short importance   = 0;
+        bool dirty         = true;
+        uint64_t timestamp = 0;
+        QString foldedName;
+    };
+
+    //! Bits of a room's membership. Tags and spaces get bits from FirstTagOrSpaceBit upwards.
+    enum MembershipBit : int
+    {
+        PreviewBit,
+        PreviewFetchedBit,
+        SpaceBit,
+        DirectBit,
+        FirstTagOrSpaceBit,
+    };
+
+    const SortKey &sortKey(int row) const;
+    //! Returns the bit of a "tag:" or "space:" id, assigning a new one if necessary.
+    int membershipBit(const QString &id) const;
+    //! Returns the membershipStride words of membership bits of a row.
+    const quint64 *membershipOf(int row) const;
+    void reindexRooms(int from);
+
     void addRoom(const QString &room_id, bool suppressInsertNotification = false);
+    QSharedPointer<TimelineModel> loadRoom(const QString &room_id);
+    void evictRooms();
+    void updateSummary(const QString &room_id, const mtx::responses::JoinedRoom &room);
+    void emitTotalUnreadMessageCount();
     void fetchPreviews(QString roomid, const std::string &from = "");
     std::set<QString> updateDMs(mtx::events::AccountDataEvent<mtx::events::account_data::Direct> e);
 
     TimelineViewManager *manager = nullptr;
     std::vector<QString> roomids;
+    //! Row of each entry in roomids, kept up to date by the row signals.
+    QHash<QString, int> roomIndex;
+    //! Sort keys parallel to roomids, recomputed when their row changes.
+    mutable std::vector<SortKey> sortKeys;
+    //! Bits of the tag and space ids (as used by CommunitiesModel) rooms are filtered by.
+    mutable QHash<QString, int> membershipBits;
+    //! Membership bits of all rows, membershipStride words per row.
+    mutable std::vector<quint64> membership;
+    mutable std::vector<bool> membershipDirty;
+    mutable std::size_t membershipStride = 1;
     QHash<QString, RoomInfo> invites;
+    QHash<QString, JoinedRoomSummary> joinedRooms;
+    //! The loaded subset of joinedRooms, evicted by JoinedRoomSummary::lastUsed.
     QHash<QString, QSharedPointer<TimelineModel>> models;
+    //! Evicted models, which are still referenced elsewhere. They are loaded again from here, so
+    //! that there is never more than one model per room.
+    QHash<QString, QWeakPointer<TimelineModel>> evictedModels;
+    uint64_t roomUseCounter = 0;
     std::map<QString, bool> roomReadStatus;
     QHash<QString, std::optional<RoomInfo>> previewedRooms;
 
@@ -227,6 +280,7 @@ public slots:
             filterStr.clear();
         }
 
+        updateFilterMasks();
         invalidateFilter();
     }
 
@@ -237,6 +291,7 @@ signals:
 
 private:
     short int calculateImportance(const QModelIndex &idx) const;
+    void updateFilterMasks();
     RoomlistModel *roomlistmodel;
     bool sortByImportance = true;
     bool sortByAlphabet   = false;
@@ -252,6 +307,10 @@ private:
     FilterBy filterType = FilterBy::Nothing;
     QStringList hiddenTags, hiddenSpaces;
     bool hideDMs = false;
+    //! Membership bits, which hide a room with the current filter.
+    std::vector<quint64> hiddenMask;
+    //! Membership bit a room needs to pass the current tag or space filter.
+    int filterBit = -1;
 
     inline static FilteredRoomlistModel *instance_ = nullptr;
 };
@@ -15,6 +15,7 @@
 #include <QGuiApplication>
 #include <QMimeData>
 #include <QMimeDatabase>
+#include <QPointer>
 #include <QRegularExpression>
 #include <QStandardPaths>
 #include <QVariant>
@@ -29,10 +30,12 @@
 #include "Logging.h"
 #include "MainWindow.h"
 #include "MatrixClient.h"
+#include "MediaCache.h"
 #include "ReadReceiptsModel.h"
 #include "RoomlistModel.h"
 #include "TimelineViewManager.h"
 #include "Utils.h"
+#include "emoji/Scanner.h"
 #include "encryption/Olm.h"
 #include "ui/UserProfile.h"
 
@@ -433,6 +436,7 @@ TimelineModel::TimelineModel(TimelineViewManager *manager, QString room_id, QObj
 
     connect(this, &TimelineModel::dataAtIdChanged, this, [this](const QString &id) {
         relatedEventCacheBuster++;
+        rowData_.remove(id);
 
         auto idx = idToIndex(id);
         if (idx != -1) {
@@ -444,6 +448,17 @@ TimelineModel::TimelineModel(TimelineViewManager *manager, QString room_id, QObj
         }
     });
 
+    // Rendered bodies depend on the font (emoticon size) and emoji settings.
+    auto clearRenderedBodies = [this] {
+        renderedBodies_.clear();
+        renderedBodyAscent_ = -1;
+    };
+    auto settings = UserSettings::instance().get();
+    connect(settings, &UserSettings::fontChanged, this, clearRenderedBodies);
+    connect(settings, &UserSettings::fontSizeChanged, this, clearRenderedBodies);
+    connect(settings, &UserSettings::emojiFontChanged, this, clearRenderedBodies);
+    connect(settings, &UserSettings::enlargeEmojiOnlyMessagesChanged, this, clearRenderedBodies);
+
     connect(this,
             &TimelineModel::newMessageToSend,
             this,
@@ -453,6 +468,7 @@ TimelineModel::TimelineModel(TimelineViewManager *manager, QString room_id, QObj
 
     connect(&events, &EventStore::dataChanged, this, [this](int from, int to) {
         relatedEventCacheBuster++;
+        invalidateRowData(from, to);
         nhlog::ui()->debug(
           "data changed {} to {}", events.size() - to - 1, events.size() - from - 1);
         emit dataChanged(index(events.size() - to - 1, 0), index(events.size() - from - 1, 0));
@@ -474,7 +490,10 @@ TimelineModel::TimelineModel(TimelineViewManager *manager, QString room_id, QObj
         beginInsertRows(QModelIndex(), first, last);
     });
     connect(&events, &EventStore::endInsertRows, this, [this]() { endInsertRows(); });
-    connect(&events, &EventStore::beginResetModel, this, [this]() { beginResetModel(); });
+    connect(&events, &EventStore::beginResetModel, this, [this]() {
+        rowData_.clear();
+        beginResetModel();
+    });
     connect(&events, &EventStore::endResetModel, this, [this]() { endResetModel(); });
     connect(&events, &EventStore::newEncryptedImage, this, &TimelineModel::newEncryptedImage);
     connect(&events, &EventStore::fetchedMore, this, [this]() {
@@ -513,9 +532,14 @@ TimelineModel::TimelineModel(TimelineViewManager *manager, QString room_id, QObj
 
     connect(
       manager_, &TimelineViewManager::initialSyncChanged, &events, &EventStore::enableKeyRequests);
+    // Rooms are loaded lazily, so this model may be created after the initial sync finished.
+    if (!manager_->isInitialSync())
+        events.enableKeyRequests(false);
 
     connect(this, &TimelineModel::encryptionChanged, this, &TimelineModel::trustlevelChanged);
     connect(this, &TimelineModel::roomMemberCountChanged, this, &TimelineModel::trustlevelChanged);
+    // Member events can change the display names stored in the row data.
+    connect(this, &TimelineModel::roomMemberCountChanged, this, [this] { rowData_.clear(); });
     connect(
       cache::client(), &Cache::verificationStatusChanged, this, &TimelineModel::trustlevelChanged);
 
@@ -620,92 +644,12 @@ TimelineModel::data(const mtx::events::collections::TimelineEvents &event, int r
         return {toRoomEventType(event)};
     case TypeString:
         return QVariant(toRoomEventTypeString(event));
-    case IsOnlyEmoji: {
-        QString qBody = QString::fromStdString(body(event));
-
-        QVector<uint> utf32_string = qBody.toUcs4();
-        int emojiCount             = 0;
-
-        for (auto &code : utf32_string) {
-            if (utils::codepointIsEmoji(code)) {
-                emojiCount++;
-            } else {
-                return {0};
-            }
-        }
-
-        return {emojiCount};
-    }
+    case IsOnlyEmoji:
+        return {emoji::onlyEmojiCount(QString::fromStdString(body(event)))};
     case Body:
         return QVariant(utils::replaceEmoji(QString::fromStdString(body(event)).toHtmlEscaped()));
-    case FormattedBody: {
-        const static QRegularExpression replyFallback(
-          QStringLiteral("<mx-reply>.*</mx-reply>"),
-          QRegularExpression::DotMatchesEverythingOption);
-
-        auto ascent = QFontMetrics(UserSettings::instance()->font()).ascent();
-
-        bool isReply = mtx::accessors::relations(event).reply_to(false).has_value();
-
-        auto formattedBody_ = QString::fromStdString(formatted_body(event));
-        if (formattedBody_.isEmpty()) {
-            // NOTE(Nico): replies without html can't have a fallback. If they do, eh, who cares.
-            formattedBody_ = QString::fromStdString(body(event))
-                               .toHtmlEscaped()
-                               .replace('\n', QLatin1String("<br>"));
-        } else if (isReply) {
-            formattedBody_ = formattedBody_.remove(replyFallback);
-        }
-        formattedBody_ = utils::escapeBlacklistedHtml(formattedBody_);
-
-        // TODO(Nico): Don't parse html with a regex
-        const static QRegularExpression matchIsImg(QStringLiteral("<img [^>]+>"));
-        auto itIsImg = matchIsImg.globalMatch(formattedBody_);
-        while (itIsImg.hasNext()) {
-            // The current <img> tag.
-            const QString curImg = itIsImg.next().captured(0);
-            // The replacement for the current <img>.
-            auto imgReplacement = curImg;
-
-            // Construct image parameters later used by MxcImageProvider.
-            QString imgParams;
-            if (curImg.contains(QLatin1String("height"))) {
-                const static QRegularExpression matchImgHeight(
-                  QStringLiteral("height=([\"\']?)(\\d+)([\"\']?)"));
-                // Make emoticons twice as high as the font.
-                if (curImg.contains(QLatin1String("data-mx-emoticon"))) {
-                    imgReplacement =
-                      imgReplacement.replace(matchImgHeight, "height=\\1%1\\3").arg(ascent * 2);
-                }
-                const auto height = matchImgHeight.match(imgReplacement).captured(2).toInt();
-                imgParams         = QStringLiteral("?scale&height=%1").arg(height);
-            }
-
-            // Replace src in current <img>.
-            const static QRegularExpression matchImgUri(QStringLiteral("src=\"mxc://([^\"]*)\""));
-            imgReplacement.replace(matchImgUri,
-                                   QStringLiteral(R"(src="image://mxcImage/\1%1")").arg(imgParams));
-            // Same regex but for single quotes around the src
-            const static QRegularExpression matchImgUri2(QStringLiteral("src=\'mxc://([^\']*)\'"));
-            imgReplacement.replace(matchImgUri2,
-                                   QStringLiteral("src=\'image://mxcImage/\\1%1\'").arg(imgParams));
-
-            // Replace <img> in formattedBody_ with our new <img>.
-            formattedBody_.replace(curImg, imgReplacement);
-        }
-
-        if (auto effectMessage =
-              std::get_if<mtx::events::RoomEvent<mtx::events::msg::ElementEffect>>(&event)) {
-            if (effectMessage->content.msgtype == std::string_view("nic.custom.confetti")) {
-                formattedBody_.append(QUtf8StringView(u8"🎊"));
-            } else if (effectMessage->content.msgtype ==
-                       std::string_view("io.element.effect.rainfall")) {
-                formattedBody_.append(QUtf8StringView(u8"🌧️"));
-            }
-        }
-
-        return QVariant(utils::replaceEmoji(utils::linkifyMessage(formattedBody_)));
-    }
+    case FormattedBody:
+        return QVariant(formattedBody(event));
     case FormattedStateEvent: {
         if (mtx::accessors::is_state_event(event)) {
             return std::visit(
@@ -974,6 +918,216 @@ TimelineModel::data(const mtx::events::collections::TimelineEvents &event, int r
     }
 }
 
+QString
+TimelineModel::formattedBody(const mtx::events::collections::TimelineEvents &event) const
+{
+    using namespace mtx::accessors;
+
+    // Edits resolve to the event id of the latest edit, but redactions and late decryption keep
+    // the id, so the content is checked as well.
+    const auto formattedBodyUtf8 = formatted_body(event);
+    const auto bodyUtf8          = body(event);
+    const auto contentHash =
+      std::hash<std::string>{}(formattedBodyUtf8) ^ (std::hash<std::string>{}(bodyUtf8) << 1);
+    const auto id = QString::fromStdString(event_id(event));
+
+    if (++renderedBodyLookups_ % 1000 == 0)
+        nhlog::ui()->debug("Rendered body cache for {}: {} hits, {} misses, {} bytes",
+                           room_id_.toStdString(),
+                           renderedBodyHits_,
+                           renderedBodyLookups_ - renderedBodyHits_,
+                           renderedBodies_.totalCost());
+
+    if (auto cached = renderedBodies_.object(id); cached && cached->contentHash == contentHash) {
+        renderedBodyHits_++;
+        return cached->html;
+    }
+
+    if (renderedBodyAscent_ < 0)
+        renderedBodyAscent_ = QFontMetrics(UserSettings::instance()->font()).ascent();
+
+    auto formattedBody_ = QString::fromStdString(formattedBodyUtf8);
+    if (formattedBody_.isEmpty()) {
+        // NOTE(Nico): replies without html can't have a fallback. If they do, eh, who cares.
+        formattedBody_ = QString::fromStdString(bodyUtf8)
+                           .toHtmlEscaped()
+                           .replace('\n', QLatin1String("<br>"));
+    }
+    formattedBody_ = utils::escapeBlacklistedHtml(
+      formattedBody_,
+      {
+        .stripReplyFallback  = mtx::accessors::relations(event).reply_to(false).has_value(),
+        .rewriteImageSources = true,
+        // Make emoticons twice as high as the font.
+        .emoticonHeight = renderedBodyAscent_ * 2,
+      });
+
+    if (auto effectMessage =
+          std::get_if<mtx::events::RoomEvent<mtx::events::msg::ElementEffect>>(&event)) {
+        if (effectMessage->content.msgtype == std::string_view("nic.custom.confetti")) {
+            formattedBody_.append(QUtf8StringView(u8"🎊"));
+        } else if (effectMessage->content.msgtype ==
+                   std::string_view("io.element.effect.rainfall")) {
+            formattedBody_.append(QUtf8StringView(u8"🌧️"));
+        }
+    }
+
+    auto rendered = utils::replaceEmoji(utils::linkifyMessage(formattedBody_));
+    renderedBodies_.insert(
+      id, new RenderedBody{contentHash, rendered}, rendered.size() * sizeof(QChar));
+    return rendered;
+}
+
+const TimelineModel::RowData *
+TimelineModel::rowData(const mtx::events::collections::TimelineEvents &event) const
+{
+    using namespace mtx::accessors;
+    namespace acc = mtx::accessors;
+
+    const auto &rels   = relations(event);
+    const auto eventId = QString::fromStdString(rels.replaces().value_or(event_id(event)));
+    if (auto cached = rowData_.object(eventId))
+        return cached;
+
+    auto row     = new RowData;
+    row->eventId = eventId;
+
+    const auto sender = acc::sender(event);
+    row->isSender     = sender == http::client()->user_id().to_string();
+    row->userId       = QString::fromStdString(sender);
+    row->userName     = displayName(row->userId);
+
+    row->timestamp = origin_server_ts(event);
+    QDateTime day  = row->timestamp;
+    day.setTime(QTime());
+    row->day = day.toMSecsSinceEpoch();
+
+    row->type         = toRoomEventType(event);
+    row->typeString   = toRoomEventTypeString(event);
+    row->isStateEvent = is_state_event(event);
+    row->isEdited     = rels.replaces().has_value();
+    row->isEditable   = !row->isStateEvent && row->isSender;
+    row->replyTo      = QString::fromStdString(rels.reply_to(!rels.thread()).value_or(""));
+    row->threadId     = QString::fromStdString(rels.thread().value_or(""));
+
+    row->url            = QString::fromStdString(url(event));
+    row->thumbnailUrl   = QString::fromStdString(thumbnail_url(event));
+    row->blurhash       = QString::fromStdString(blurhash(event));
+    row->filename       = QString::fromStdString(filename(event));
+    row->filesize       = utils::humanReadableFileSize(filesize(event));
+    row->mimetype       = QString::fromStdString(mimetype(event));
+    row->callType       = QString::fromStdString(call_type(event));
+    row->duration       = duration(event);
+    row->originalWidth  = media_width(event);
+    row->originalHeight = media_height(event);
+
+    double prop = (double)row->originalHeight / (double)std::max(row->originalWidth, 1ull);
+    row->proportionalHeight = prop > 0 ? prop : 1.;
+
+    row->isOnlyEmoji = emoji::onlyEmojiCount(QString::fromStdString(body(event)));
+
+    rowData_.insert(eventId, row);
+    return row;
+}
+
+bool
+TimelineModel::setRowDataRole(const RowData &row, QModelRoleData &roleData)
+{
+    switch (roleData.role()) {
+    case IsSender:
+        roleData.setData(QVariant{row.isSender});
+        return true;
+    case UserId:
+        roleData.setData(row.userId);
+        return true;
+    case UserName:
+        roleData.setData(row.userName);
+        return true;
+    case Day:
+        roleData.setData(QVariant(row.day));
+        return true;
+    case Timestamp:
+        roleData.setData(row.timestamp);
+        return true;
+    case Type:
+        roleData.setData(QVariant{row.type});
+        return true;
+    case TypeString:
+        roleData.setData(row.typeString);
+        return true;
+    case IsOnlyEmoji:
+        roleData.setData(QVariant{row.isOnlyEmoji});
+        return true;
+    case Url:
+        roleData.setData(row.url);
+        return true;
+    case ThumbnailUrl:
+        roleData.setData(row.thumbnailUrl);
+        return true;
+    case Duration:
+        roleData.setData(QVariant(row.duration));
+        return true;
+    case Blurhash:
+        roleData.setData(row.blurhash);
+        return true;
+    case Filename:
+        roleData.setData(row.filename);
+        return true;
+    case Filesize:
+        roleData.setData(row.filesize);
+        return true;
+    case MimeType:
+        roleData.setData(row.mimetype);
+        return true;
+    case OriginalHeight:
+        roleData.setData(QVariant(row.originalHeight));
+        return true;
+    case OriginalWidth:
+        roleData.setData(QVariant(row.originalWidth));
+        return true;
+    case ProportionalHeight:
+        roleData.setData(QVariant(row.proportionalHeight));
+        return true;
+    case EventId:
+        roleData.setData(row.eventId);
+        return true;
+    case IsEdited:
+        roleData.setData(QVariant{row.isEdited});
+        return true;
+    case IsEditable:
+        roleData.setData(QVariant{row.isEditable});
+        return true;
+    case IsStateEvent:
+        roleData.setData(QVariant{row.isStateEvent});
+        return true;
+    case ReplyTo:
+        roleData.setData(row.replyTo);
+        return true;
+    case ThreadId:
+        roleData.setData(row.threadId);
+        return true;
+    case CallType:
+        roleData.setData(row.callType);
+        return true;
+    default:
+        return false;
+    }
+}
+
+void
+TimelineModel::invalidateRowData(int from, int to)
+{
+    // Looking up the ids is only worth it for a few rows.
+    if (to - from >= 16) {
+        rowData_.clear();
+        return;
+    }
+
+    for (int i = from; i <= to; i++)
+        if (auto id = events.indexToId(i))
+            rowData_.remove(QString::fromStdString(*id));
+}
+
 QVariant
 TimelineModel::data(const QModelIndex &index, int role) const
 {
@@ -1016,8 +1170,10 @@ TimelineModel::multiData(const QModelIndex &index, QModelRoleDataSpan roleDataSp
         return;
     }
 
+    const auto row = rowData(*event);
     for (QModelRoleData &roleData : roleDataSpan) {
-        roleData.setData(data(*event, roleData.role()));
+        if (!setRowDataRole(*row, roleData))
+            roleData.setData(data(*event, roleData.role()));
     }
 }
 
@@ -1042,10 +1198,10 @@ TimelineModel::multiData(const QString &id,
         return;
     }
 
+    const auto row = rowData(*event);
     for (QModelRoleData &roleData : roleDataSpan) {
-        int role = roleData.role();
-
-        roleData.setData(data(*event, role));
+        if (!setRowDataRole(*row, roleData))
+            roleData.setData(data(*event, roleData.role()));
     }
 }
 
@@ -1398,10 +1554,12 @@ TimelineModel::setCurrentIndex(int index, bool ignoreInactiveState)
 void
 TimelineModel::readEvent(const std::string &id)
 {
+    events.beginRequest();
     http::client()->read_event(
       room_id_.toStdString(),
       id,
       [this, newId = id, oldId = currentReadId](mtx::http::RequestErr err) {
+          EventStore::RequestGuard guard(events);
           if (err) {
               nhlog::net()->warn("failed to read_event ({}, {})", room_id_.toStdString(), newId);
 
@@ -1588,16 +1746,24 @@ TimelineModel::redactEvent(const QString &id, const QString &reason)
 {
     if (!id.isEmpty()) {
         auto edits = events.edits(id.toStdString());
+        events.beginRequest();
         http::client()->redact_event(
           room_id_.toStdString(),
           id.toStdString(),
           [this, id, reason](const mtx::responses::EventId &, mtx::http::RequestErr err) {
+              EventStore::RequestGuard guard(events);
               if (err) {
                   if (err->status_code == 429 && err->matrix_error.retry_after.count() != 0) {
+                      // The model may be unloaded, before this runs on the GUI thread.
                       ChatPage::instance()->callFunctionOnGuiThread(
-                        [this, id, reason, interval = err->matrix_error.retry_after] {
-                            QTimer::singleShot(interval * 2, this, [this, id, reason]() {
-                                this->redactEvent(id, reason);
+                        [self = QPointer<TimelineModel>(this),
+                         id,
+                         reason,
+                         interval = err->matrix_error.retry_after] {
+                            if (!self)
+                                return;
+                            QTimer::singleShot(interval * 2, self.data(), [self, id, reason]() {
+                                self->redactEvent(id, reason);
                             });
                         });
                       return;
@@ -1614,10 +1780,12 @@ TimelineModel::redactEvent(const QString &id, const QString &reason)
         // redact all edits to prevent leaks
         for (const auto &e : edits) {
             const auto &id_ = mtx::accessors::event_id(e);
+            events.beginRequest();
             http::client()->redact_event(
               room_id_.toStdString(),
               id_,
               [this, id, id_](const mtx::responses::EventId &, mtx::http::RequestErr err) {
+                  EventStore::RequestGuard guard(events);
                   if (err) {
                       emit redactionFailed(tr("Message redaction failed: %1")
                                              .arg(QString::fromStdString(err->matrix_error.error)));
@@ -2093,7 +2261,7 @@ TimelineModel::cacheMedia(const QString &eventId,
 
     QDir().mkpath(filename.path());
 
-    if (filename.isReadable()) {
+    if (MediaCache::instance().contains(filename.filePath())) {
 #if defined(Q_OS_WIN)
         emit mediaCached(mxcUrl, filename.filePath());
 #else
@@ -2105,12 +2273,14 @@ TimelineModel::cacheMedia(const QString &eventId,
         return;
     }
 
+    events.beginRequest();
     http::client()->download(
       url,
       [this, callback, mxcUrl, filename, url, encryptionInfo](const std::string &data,
                                                               const std::string &,
                                                               const std::string &,
                                                               mtx::http::RequestErr err) {
+          EventStore::RequestGuard guard(events);
           if (err) {
               nhlog::net()->warn("failed to retrieve image {}: {} {}",
                                  url,
@@ -2132,6 +2302,7 @@ TimelineModel::cacheMedia(const QString &eventId,
 
               file.write(QByteArray(temp.data(), (int)temp.size()));
               file.close();
+              MediaCache::instance().insert(filename.filePath(), "original", false);
 
               if (callback) {
                   callback(filename.filePath());
@@ -3200,9 +3371,11 @@ TimelineModel::resetEdit()
 void
 TimelineModel::resetState()
 {
+    events.beginRequest();
     http::client()->get_state(
       room_id_.toStdString(),
       [this](const mtx::responses::StateEvents &events_, mtx::http::RequestErr e) {
+          EventStore::RequestGuard guard(events);
           if (e) {
               nhlog::net()->error("Failed to retrieve current room state: {}", *e);
               return;
@@ -3377,6 +3550,19 @@ TimelineModel::pushrulesRoomContext() const
     };
 }
 
+mtx::pushrules::PushRuleEvaluator::RoomContext
+TimelineModel::pushrulesRoomContext(const std::string &roomId)
+{
+    return mtx::pushrules::PushRuleEvaluator::RoomContext{
+      .user_display_name = cache::displayName(roomId, http::client()->user_id().to_string()),
+      .member_count      = cache::client()->memberCount(roomId),
+      .power_levels      = cache::client()
+                        ->getStateEvent<mtx::events::state::PowerLevels>(roomId)
+                        .value_or(mtx::events::StateEvent<mtx::events::state::PowerLevels>{})
+                        .content,
+    };
+}
+
 RoomSummary *
 TimelineModel::parentSpace()
 {
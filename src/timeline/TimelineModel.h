@@ -5,8 +5,10 @@
 #pragma once
 
 #include <QAbstractListModel>
+#include <QCache>
 #include <QColor>
 #include <QDate>
+#include <QDateTime>
 #include <QSet>
 #include <QTimer>
 #include <QVariant>
@@ -385,7 +387,13 @@ public:
     bool isDirect() const { return roomMemberCount() <= 2; }
     QString directChatOtherUserId() const;
 
+    //! If requests of the timeline are still outstanding, see EventStore::hasPendingRequests().
+    bool hasPendingRequests() const { return events.hasPendingRequests(); }
+
     mtx::pushrules::PushRuleEvaluator::RoomContext pushrulesRoomContext() const;
+    //! The same for a room, which may not be loaded, read from the cache.
+    static mtx::pushrules::PushRuleEvaluator::RoomContext
+    pushrulesRoomContext(const std::string &roomId);
 
     std::optional<mtx::events::collections::TimelineEvents> eventById(const QString &id)
     {
@@ -524,6 +532,42 @@ private:
 
     void setPaginationInProgress(const bool paginationInProgress);
 
+    QString formattedBody(const mtx::events::collections::TimelineEvents &event) const;
+
+    //! Roles, which only depend on the event content (and the sender's display name).
+    struct RowData
+    {
+        QString userId;
+        QString userName;
+        QString eventId;
+        QString typeString;
+        QString replyTo;
+        QString threadId;
+        QString url;
+        QString thumbnailUrl;
+        QString blurhash;
+        QString filename;
+        QString filesize;
+        QString mimetype;
+        QString callType;
+        QDateTime timestamp;
+        qint64 day;
+        qulonglong duration;
+        qulonglong originalWidth;
+        qulonglong originalHeight;
+        double proportionalHeight;
+        int isOnlyEmoji;
+        qml_mtx_events::EventType type;
+        bool isSender;
+        bool isEdited;
+        bool isEditable;
+        bool isStateEvent;
+    };
+    //! The returned row is owned by the cache and only valid until the next call.
+    const RowData *rowData(const mtx::events::collections::TimelineEvents &event) const;
+    static bool setRowDataRole(const RowData &row, QModelRoleData &roleData);
+    void invalidateRowData(int from, int to);
+
     QString room_id_;
 
     QSet<QString> read;
@@ -552,6 +596,19 @@ private:
 
     unsigned int relatedEventCacheBuster = 0;
 
+    struct RenderedBody
+    {
+        std::size_t contentHash;
+        QString html;
+    };
+    //! FormattedBody role by event id, the cost is the size of the html in bytes.
+    mutable QCache<QString, RenderedBody> renderedBodies_{1024 * 1024};
+    mutable int renderedBodyAscent_            = -1;
+    mutable std::uint64_t renderedBodyLookups_ = 0;
+    mutable std::uint64_t renderedBodyHits_    = 0;
+    //! RowData by EventId role, i.e. the id of the original event for edits.
+    mutable QCache<QString, RowData> rowData_{256};
+
     bool decryptDescription     = true;
     bool m_paginationInProgress = false;
     bool isSpace_               = false;
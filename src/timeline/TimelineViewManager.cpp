@@ -413,7 +413,7 @@ void
 TimelineViewManager::updateReadReceipts(const QString &room_id,
                                         const std::vector<QString> &event_ids)
 {
-    if (auto room = rooms_->getRoomById(room_id)) {
+    if (auto room = rooms_->loadedRoomById(room_id)) {
         room->markEventsAsRead(event_ids);
     }
 }
@@ -421,7 +421,7 @@ TimelineViewManager::updateReadReceipts(const QString &room_id,
 void
 TimelineViewManager::receivedSessionKey(const std::string &room_id, const std::string &session_id)
 {
-    if (auto room = rooms_->getRoomById(QString::fromStdString(room_id))) {
+    if (auto room = rooms_->loadedRoomById(QString::fromStdString(room_id))) {
         room->receivedSessionKey(session_id);
     }
 }
@@ -508,6 +508,10 @@ QAbstractItemModel *
 TimelineViewManager::completerFor(const QString &completerName, const QString &roomId)
 {
     if (completerName == QLatin1String("user")) {
+        // Room members are searched in the cache, so they don't need a proxy.
+        if (roomId != QLatin1String("friends"))
+            return new UsersModel(roomId.toStdString());
+
         auto userModel = new UsersModel(roomId.toStdString());
         auto proxy     = new CompletionProxyModel(userModel);
         userModel->setParent(proxy);
@@ -121,6 +121,7 @@ signals:
     void ignoredUsersChanged(const QVector<QString> &ignoredUsers);
 
 public slots:
+    //! Only update loaded rooms, the others read receipts and keys from the cache once loaded.
     void updateReadReceipts(const QString &room_id, const std::vector<QString> &event_ids);
     void receivedSessionKey(const std::string &room_id, const std::string &session_id);
     void initializeRoomlist();
@@ -4,30 +4,234 @@
 
 #include "MxcAnimatedImage.h"
 
+#include <QBuffer>
+#include <QCoreApplication>
 #include <QDir>
+#include <QFile>
 #include <QFileInfo>
+#include <QHash>
+#include <QImageReader>
 #include <QMimeDatabase>
 #include <QQuickWindow>
 #include <QSGImageNode>
 #include <QStandardPaths>
+#include <QTimer>
 
+#include <algorithm>
+#include <set>
+
+#include "EncryptedFileDevice.h"
 #include "EventAccessors.h"
+#include "ImageCache.h"
 #include "Logging.h"
 #include "MatrixClient.h"
+#include "MediaCache.h"
 #include "timeline/TimelineModel.h"
 
+namespace {
+//! Cached frames of all animations together may use this much memory.
+constexpr qint64 FRAME_CACHE_BUDGET = 256 * 1024 * 1024;
+//! Animations with more frame data than this are never cached, so that a single one can't use up
+//! the budget.
+constexpr qint64 FRAME_CACHE_MAX = 32 * 1024 * 1024;
+//! Interval in ms to check, if paused animations scrolled back into view.
+constexpr int OFFSCREEN_CHECK_INTERVAL = 500;
+
+// Only used from the GUI thread.
+qint64 frameCacheUsed = 0;
+QHash<QString, std::weak_ptr<MxcAnimation>> animations;
+std::set<MxcAnimatedImage *> offscreenItems;
+QTimer *offscreenTimer = nullptr;
+}
+
+std::shared_ptr<MxcAnimation>
+MxcAnimation::get(const QString &mxcUrl)
+{
+    if (auto animation = animations.value(mxcUrl).lock())
+        return animation;
+
+    std::shared_ptr<MxcAnimation> animation(new MxcAnimation);
+    animation->mxcUrl_ = mxcUrl;
+    animations.insert(mxcUrl, animation);
+    return animation;
+}
+
+MxcAnimation::~MxcAnimation()
+{
+    movie.stop();
+    movie.setDevice(nullptr);
+    frameCacheUsed -= cachedBytes_;
+
+    if (auto it = animations.find(mxcUrl_); it != animations.end() && it->expired())
+        animations.erase(it);
+}
+
 void
-MxcAnimatedImage::startDownload()
+MxcAnimation::setSource(std::unique_ptr<QIODevice> device, const QByteArray &format)
+{
+    movie.stop();
+    movie.setDevice(nullptr);
+    frameCacheUsed -= cachedBytes_;
+    cachedBytes_ = 0;
+    source_      = std::move(device);
+    loading_     = false;
+
+    // Decide, if the frames should be cached, before any of them is decoded. Counting the frames
+    // only parses the headers of the frames for the usual formats.
+    QImageReader probe(source_.get(), format);
+    frameSize_  = probe.size();
+    frameCount_ = probe.imageCount();
+    source_->reset();
+
+    movie.setFormat(format);
+    movie.setDevice(source_.get());
+    updateScaledSize();
+    updateCacheMode();
+
+    nhlog::ui()->debug("Playing animation of size {} with {} frames, cached: {} ({} bytes in use)",
+                       source_->size(),
+                       frameCount_,
+                       cachedBytes_ > 0,
+                       frameCacheUsed);
+
+    movie.jumpToFrame(0);
+    updatePlaying();
+    emit loadedChanged();
+}
+
+void
+MxcAnimation::addViewer(MxcAnimatedImage *viewer)
+{
+    viewers_.push_back(viewer);
+    updateScaledSize();
+    updatePlaying();
+}
+
+void
+MxcAnimation::removeViewer(MxcAnimatedImage *viewer)
+{
+    std::erase(viewers_, viewer);
+    updatePlaying();
+}
+
+void
+MxcAnimation::updatePlaying()
+{
+    if (!loaded())
+        return;
+
+    bool wanted = std::any_of(
+      viewers_.begin(), viewers_.end(), [](MxcAnimatedImage *v) { return v->wantsFrames(); });
+    if (wanted && movie.frameCount() > 1) {
+        if (movie.state() == QMovie::NotRunning)
+            movie.start();
+        else
+            movie.setPaused(false);
+    } else if (movie.state() == QMovie::Running) {
+        movie.setPaused(true);
+    }
+}
+
+void
+MxcAnimation::updateScaledSize()
 {
-    if (!room_)
+    QSizeF largest;
+    for (auto viewer : viewers_)
+        if (viewer->width() * viewer->height() > largest.width() * largest.height())
+            largest = viewer->size();
+
+    if (largest.isEmpty() || !frameSize_.isValid())
         return;
-    if (eventId_.isEmpty())
+
+    const auto scaledSize = frameSize_.scaled(largest.toSize(), Qt::KeepAspectRatio);
+    if (scaledSize == movie.scaledSize())
+        return;
+
+    if (cachedBytes_ > 0) {
+        // Setting the device again drops the frames cached at the old size.
+        movie.stop();
+        source_->reset();
+        movie.setDevice(source_.get());
+        movie.setScaledSize(scaledSize);
+        updateCacheMode();
+        movie.jumpToFrame(0);
+        updatePlaying();
+    } else {
+        movie.setScaledSize(scaledSize);
+        if (loaded())
+            updateCacheMode();
+    }
+}
+
+void
+MxcAnimation::updateCacheMode()
+{
+    frameCacheUsed -= cachedBytes_;
+    cachedBytes_ = 0;
+
+    const auto size = movie.scaledSize().isValid() ? movie.scaledSize() : frameSize_;
+    const auto frameBytes =
+      static_cast<qint64>(size.width()) * size.height() * 4 * std::max(frameCount_, 0);
+    if (frameCount_ > 0 && frameBytes <= FRAME_CACHE_MAX &&
+        frameCacheUsed + frameBytes <= FRAME_CACHE_BUDGET) {
+        cachedBytes_ = frameBytes;
+        frameCacheUsed += frameBytes;
+    }
+
+    const auto mode = cachedBytes_ > 0 ? QMovie::CacheAll : QMovie::CacheNone;
+    if (movie.cacheMode() != mode)
+        movie.setCacheMode(mode);
+}
+
+MxcAnimatedImage::~MxcAnimatedImage()
+{
+    offscreenItems.erase(this);
+    if (animation_)
+        animation_->removeViewer(this);
+}
+
+void
+MxcAnimatedImage::setAnimation(std::shared_ptr<MxcAnimation> animation)
+{
+    if (animation_ == animation)
         return;
 
+    if (animation_) {
+        animation_->movie.disconnect(this);
+        animation_->disconnect(this);
+        animation_->removeViewer(this);
+    }
+
+    animation_ = std::move(animation);
+
+    if (animation_) {
+        connect(&animation_->movie, &QMovie::frameChanged, this, &MxcAnimatedImage::newFrame);
+        connect(animation_.get(), &MxcAnimation::loadedChanged, this, [this] {
+            imageDirty = true;
+            emit loadedChanged();
+            update();
+        });
+        animation_->addViewer(this);
+    }
+
+    imageDirty = true;
+    emit loadedChanged();
+    update();
+}
+
+void
+MxcAnimatedImage::startDownload()
+{
+    if (!room_ || eventId_.isEmpty()) {
+        setAnimation(nullptr);
+        return;
+    }
+
     auto event = room_->eventById(eventId_);
     if (!event) {
         nhlog::ui()->error("Failed to load media for event {}, event not found.",
                            eventId_.toStdString());
+        setAnimation(nullptr);
         return;
     }
 
@@ -37,8 +241,10 @@ MxcAnimatedImage::startDownload()
     animatable_               = formats.contains(mimeType.split('/').back());
     animatableChanged();
 
-    if (!animatable_)
+    if (!animatable_) {
+        setAnimation(nullptr);
         return;
+    }
 
     QString mxcUrl = QString::fromStdString(mtx::accessors::url(*event));
 
@@ -46,6 +252,7 @@ MxcAnimatedImage::startDownload()
 
     // If the message is a link to a non mxcUrl, don't download it
     if (!mxcUrl.startsWith(QLatin1String("mxc://"))) {
+        setAnimation(nullptr);
         return;
     }
 
@@ -60,99 +267,171 @@ MxcAnimatedImage::startDownload()
                               suffix));
     if (QDir::cleanPath(filename.filePath()) != filename.filePath()) {
         nhlog::net()->warn("mxcUrl '{}' is not safe, not downloading file", url);
+        setAnimation(nullptr);
         return;
     }
 
     QDir().mkpath(filename.path());
 
-    QPointer<MxcAnimatedImage> self = this;
-
-    auto processBuffer = [this, mimeType, encryptionInfo, self](QIODevice &device) {
-        if (!self)
-            return;
+    setAnimation(MxcAnimation::get(mxcUrl));
+    if (animation_->loaded() || animation_->loading())
+        return;
 
-        try {
-            if (buffer.isOpen()) {
-                movie.stop();
-                movie.setDevice(nullptr);
-                buffer.close();
+    const auto format = mimeType.split('/').back();
+
+    // Encrypted files are decrypted while decoding, so their plaintext is never completely in
+    // memory.
+    auto openFile = [weak = std::weak_ptr<MxcAnimation>(animation_),
+                     mxcUrl,
+                     encryptionInfo,
+                     filename,
+                     format] {
+        auto animation = weak.lock();
+        if (!animation)
+            return true;
+
+        std::unique_ptr<QIODevice> device;
+        if (encryptionInfo) {
+            device =
+              std::make_unique<olm::EncryptedFileDevice>(filename.filePath(), *encryptionInfo);
+            if (!device->open(QIODevice::ReadOnly)) {
+                animation->setLoading(false);
+                return false;
             }
-
-            if (encryptionInfo) {
-                QByteArray ba = device.readAll();
-                std::string temp(ba.constData(), ba.size());
-                temp =
-                  mtx::crypto::to_string(mtx::crypto::decrypt_file(temp, encryptionInfo.value()));
-                buffer.setData(temp.data(), static_cast<int>(temp.size()));
-            } else {
-                buffer.setData(device.readAll());
+        } else {
+            QFile f(filename.filePath());
+            if (!f.open(QIODevice::ReadOnly)) {
+                animation->setLoading(false);
+                return false;
             }
-            buffer.open(QIODevice::ReadOnly);
-            buffer.reset();
-        } catch (const std::exception &e) {
-            nhlog::net()->error("Failed to setup animated image buffer: {}", e.what());
+
+            auto buffer = std::make_unique<QBuffer>();
+            buffer->setData(f.readAll());
+            ImageCache::insertData(mxcUrl, buffer->data());
+            buffer->open(QIODevice::ReadOnly);
+            device = std::move(buffer);
         }
 
-        QTimer::singleShot(0, this, [this, mimeType] {
-            nhlog::ui()->info(
-              "Playing movie with size: {}, {}", buffer.bytesAvailable(), buffer.isOpen());
-            movie.setFormat(mimeType);
-            movie.setDevice(&buffer);
-
-            if (height() != 0 && width() != 0)
-                movie.setScaledSize(this->size().toSize());
-            if (buffer.bytesAvailable() <
-                4LL * 1024 * 1024 * 1024) // cache images smaller than 4MB in RAM
-                movie.setCacheMode(QMovie::CacheAll);
-            if (play_ && movie.frameCount() > 1)
-                movie.start();
-            else {
-                movie.jumpToFrame(0);
-                movie.setPaused(true);
-            }
-            emit loadedChanged();
-            update();
+        animation->setSource(std::move(device), format);
+        return true;
+    };
+
+    if (auto data = ImageCache::findData(mxcUrl)) {
+        auto buffer = std::make_unique<QBuffer>();
+        buffer->setData(*data);
+        buffer->open(QIODevice::ReadOnly);
+        animation_->setSource(std::move(buffer), format);
+        return;
+    }
+
+    if (MediaCache::instance().contains(filename.filePath()) && openFile())
+        return;
+
+    animation_->setLoading(true);
+    auto loadingFailed = [weak = std::weak_ptr<MxcAnimation>(animation_)] {
+        QTimer::singleShot(0, QCoreApplication::instance(), [weak] {
+            if (auto animation = weak.lock())
+                animation->setLoading(false);
         });
     };
 
-    if (filename.isReadable()) {
-        QFile f(filename.filePath());
-        if (f.open(QIODevice::ReadOnly)) {
-            processBuffer(f);
-            return;
+    bool encrypted = encryptionInfo.has_value();
+    http::client()->download(
+      url,
+      [filename, url, openFile, loadingFailed, encrypted](const std::string &data,
+                                                          const std::string &,
+                                                          const std::string &,
+                                                          mtx::http::RequestErr err) {
+          if (err) {
+              nhlog::net()->warn("failed to retrieve media {}: {} {}",
+                                 url,
+                                 err->matrix_error.error,
+                                 static_cast<int>(err->status_code));
+              loadingFailed();
+              return;
+          }
+
+          QFile file(filename.filePath());
+          if (!file.open(QIODevice::WriteOnly)) {
+              nhlog::ui()->warn("Error while saving file to: {}", file.errorString().toStdString());
+              loadingFailed();
+              return;
+          }
+
+          file.write(data.data(), static_cast<qint64>(data.size()));
+          file.close();
+          MediaCache::instance().insert(filename.filePath(), "original", encrypted);
+
+          QTimer::singleShot(0, QCoreApplication::instance(), [openFile] { openFile(); });
+      });
+}
+
+void
+MxcAnimatedImage::newFrame(int frame)
+{
+    currentFrame = frame;
+    imageDirty   = true;
+
+    updateOnScreen();
+    if (onScreen_)
+        update();
+}
+
+bool
+MxcAnimatedImage::isOnScreen() const
+{
+    return isVisible() && window() && window()->isExposed() && !clipRect().isEmpty();
+}
+
+void
+MxcAnimatedImage::updateOnScreen()
+{
+    const bool onScreen = isOnScreen();
+    if (onScreen == onScreen_)
+        return;
+
+    onScreen_ = onScreen;
+    if (onScreen_) {
+        offscreenItems.erase(this);
+    } else {
+        // There is no notification, when an item scrolls back into view, so check periodically.
+        offscreenItems.insert(this);
+        if (!offscreenTimer) {
+            offscreenTimer = new QTimer(QCoreApplication::instance());
+            offscreenTimer->setInterval(OFFSCREEN_CHECK_INTERVAL);
+            QObject::connect(
+              offscreenTimer, &QTimer::timeout, &MxcAnimatedImage::checkOffscreenItems);
         }
+        if (!offscreenTimer->isActive())
+            offscreenTimer->start();
     }
 
-    http::client()->download(url,
-                             [filename, url, processBuffer](const std::string &data,
-                                                            const std::string &,
-                                                            const std::string &,
-                                                            mtx::http::RequestErr err) {
-                                 if (err) {
-                                     nhlog::net()->warn("failed to retrieve media {}: {} {}",
-                                                        url,
-                                                        err->matrix_error.error,
-                                                        static_cast<int>(err->status_code));
-                                     return;
-                                 }
+    if (animation_)
+        animation_->updatePlaying();
+}
 
-                                 try {
-                                     QFile file(filename.filePath());
+void
+MxcAnimatedImage::checkOffscreenItems()
+{
+    // updateOnScreen() modifies the set
+    auto items = offscreenItems;
+    for (auto item : items)
+        item->updateOnScreen();
 
-                                     if (!file.open(QIODevice::WriteOnly))
-                                         return;
+    if (offscreenItems.empty())
+        offscreenTimer->stop();
+}
 
-                                     QByteArray ba(data.data(), (int)data.size());
-                                     file.write(ba);
-                                     file.close();
+void
+MxcAnimatedImage::itemChange(ItemChange change, const ItemChangeData &value)
+{
+    QQuickItem::itemChange(change, value);
 
-                                     QBuffer buf(&ba);
-                                     buf.open(QBuffer::ReadOnly);
-                                     processBuffer(buf);
-                                 } catch (const std::exception &e) {
-                                     nhlog::ui()->warn("Error while saving file to: {}", e.what());
-                                 }
-                             });
+    if (change == ItemVisibleHasChanged || change == ItemSceneChange) {
+        updateOnScreen();
+        if (onScreen_)
+            update();
+    }
 }
 
 void
@@ -160,11 +439,9 @@ MxcAnimatedImage::geometryChange(const QRectF &newGeometry, const QRectF &oldGeo
 {
     QQuickItem::geometryChange(newGeometry, oldGeometry);
 
-    if (newGeometry.size() != oldGeometry.size()) {
+    if (newGeometry.size() != oldGeometry.size() && animation_) {
         if (height() != 0 && width() != 0) {
-            QSizeF r = movie.scaledSize();
-            r.scale(newGeometry.size(), Qt::KeepAspectRatio);
-            movie.setScaledSize(r.toSize());
+            animation_->updateScaledSize();
             imageDirty = true;
             update();
         }
@@ -174,7 +451,7 @@ MxcAnimatedImage::geometryChange(const QRectF &newGeometry, const QRectF &oldGeo
 QSGNode *
 MxcAnimatedImage::updatePaintNode(QSGNode *oldNode, QQuickItem::UpdatePaintNodeData *)
 {
-    if (!imageDirty)
+    if (!imageDirty || !animation_)
         return oldNode;
 
     // If the image is offscreen, just return the old node (if it exists) to save on animation CPU
@@ -192,7 +469,7 @@ MxcAnimatedImage::updatePaintNode(QSGNode *oldNode, QQuickItem::UpdatePaintNodeD
         n->setFlags(QSGNode::OwnedByParent);
     }
 
-    auto img = movie.currentImage();
+    auto img = animation_->movie.currentImage();
     n->setSourceRect(img.rect());
     if (!img.isNull())
         n->setTexture(window()->createTextureFromImage(std::move(img)));
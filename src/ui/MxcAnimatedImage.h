@@ -4,13 +4,66 @@
 
 #pragma once
 
-#include <QBuffer>
+#include <QIODevice>
 #include <QMovie>
 #include <QObject>
 #include <QQuickItem>
 
+#include <memory>
+#include <vector>
+
+class MxcAnimatedImage;
 class TimelineModel;
 
+//! The decoder of one animated image. It is shared by all items showing the same media, so that
+//! the file is only loaded and decoded once. Frames are only cached in memory, while all cached
+//! frames stay below a global budget. Otherwise every frame is decoded again when it is shown. The
+//! animation is paused, while none of the items showing it is on screen.
+class MxcAnimation final : public QObject
+{
+    Q_OBJECT
+
+public:
+    //! Returns the animation of mxcUrl, which is created if nobody shows it yet.
+    static std::shared_ptr<MxcAnimation> get(const QString &mxcUrl);
+    ~MxcAnimation() override;
+
+    bool loaded() const { return source_ && source_->size() > 0; }
+    //! If a download was started for this animation already.
+    bool loading() const { return loading_; }
+    void setLoading(bool loading) { loading_ = loading; }
+
+    //! Starts playing from device, which contains an image of format.
+    void setSource(std::unique_ptr<QIODevice> device, const QByteArray &format);
+
+    void addViewer(MxcAnimatedImage *viewer);
+    void removeViewer(MxcAnimatedImage *viewer);
+    //! Plays or pauses the animation depending on whether any viewer wants to see it move.
+    void updatePlaying();
+    //! Scales frames to the largest viewer.
+    void updateScaledSize();
+
+    QMovie movie;
+
+signals:
+    void loadedChanged();
+
+private:
+    MxcAnimation() = default;
+
+    //! Caches the frames, if they fit into the budget at the current scaled size.
+    void updateCacheMode();
+
+    QString mxcUrl_;
+    std::unique_ptr<QIODevice> source_;
+    std::vector<MxcAnimatedImage *> viewers_;
+    QSize frameSize_;
+    int frameCount_     = 0;
+    //! The part of the frame cache budget used by this animation.
+    qint64 cachedBytes_ = 0;
+    bool loading_       = false;
+};
+
 // This is an AnimatedImage, that can draw encrypted images
 class MxcAnimatedImage : public QQuickItem
 {
@@ -27,15 +80,17 @@ public:
     {
         connect(this, &MxcAnimatedImage::eventIdChanged, &MxcAnimatedImage::startDownload);
         connect(this, &MxcAnimatedImage::roomChanged, &MxcAnimatedImage::startDownload);
-        connect(&movie, &QMovie::frameChanged, this, &MxcAnimatedImage::newFrame);
         setFlag(QQuickItem::ItemHasContents);
         setFlag(QQuickItem::ItemObservesViewport);
         // setAcceptHoverEvents(true);
     }
+    ~MxcAnimatedImage() override;
 
     bool animatable() const { return animatable_; }
-    bool loaded() const { return buffer.size() > 0; }
+    bool loaded() const { return animation_ && animation_->loaded(); }
     bool play() const { return play_; }
+    //! If this item is on screen and wants its animation to play.
+    bool wantsFrames() const { return play_ && onScreen_; }
     QString eventId() const { return eventId_; }
     TimelineModel *room() const { return room_; }
     void setEventId(QString newEventId)
@@ -56,17 +111,14 @@ public:
     {
         if (play_ != newPlay) {
             play_ = newPlay;
-            if (movie.frameCount() > 1)
-                movie.setPaused(!play_);
-            else {
-                movie.jumpToFrame(0);
-                movie.setPaused(true);
-            }
+            if (animation_)
+                animation_->updatePlaying();
             emit playChanged();
         }
     }
 
     void geometryChange(const QRectF &newGeometry, const QRectF &oldGeometry) override;
+    void itemChange(ItemChange change, const ItemChangeData &value) override;
     QSGNode *updatePaintNode(QSGNode *oldNode,
                              QQuickItem::UpdatePaintNodeData *updatePaintNodeData) override;
 
@@ -79,22 +131,23 @@ signals:
 
 private slots:
     void startDownload();
-    void newFrame(int frame)
-    {
-        currentFrame = frame;
-        imageDirty   = true;
-        if (!clipRect().isEmpty())
-            update();
-    }
+    void newFrame(int frame);
 
 private:
+    void setAnimation(std::shared_ptr<MxcAnimation> animation);
+    bool isOnScreen() const;
+    //! Updates onScreen_ and tells the animation, if it changed.
+    void updateOnScreen();
+    //! Resumes the animations of items, which scrolled back into view.
+    static void checkOffscreenItems();
+
     TimelineModel *room_ = nullptr;
     QString eventId_;
     QString filename_;
     bool animatable_ = false;
-    QBuffer buffer;
-    QMovie movie;
+    std::shared_ptr<MxcAnimation> animation_;
     int currentFrame = 0;
     bool imageDirty  = true;
     bool play_       = true;
+    bool onScreen_   = true;
 };
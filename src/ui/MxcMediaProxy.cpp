@@ -11,12 +11,15 @@
 #include <QMediaPlayer>
 #include <QMimeDatabase>
 #include <QStandardPaths>
+#include <QTimer>
 #include <QUrl>
 
 #include "ChatPage.h"
+#include "EncryptedFileDevice.h"
 #include "EventAccessors.h"
 #include "Logging.h"
 #include "MatrixClient.h"
+#include "MediaCache.h"
 #include "timeline/RoomlistModel.h"
 #include "timeline/TimelineModel.h"
 #include "timeline/TimelineViewManager.h"
@@ -108,47 +111,43 @@ MxcMediaProxy::startDownload(bool onlyCached)
 
     QDir().mkpath(filename.path());
 
-    QPointer<MxcMediaProxy> self = this;
-
-    auto processBuffer = [this, encryptionInfo, filename, self, suffix](QIODevice &device) {
-        if (!self)
-            return;
-
-        if (encryptionInfo) {
-            QByteArray ba = device.readAll();
-            std::string temp(ba.constData(), ba.size());
-            temp = mtx::crypto::to_string(mtx::crypto::decrypt_file(temp, encryptionInfo.value()));
-            buffer.setData(temp.data(), static_cast<int>(temp.size()));
-        } else {
-            buffer.setData(device.readAll());
+    // Plays the file from the cache. Encrypted files are decrypted while playing, so that large
+    // videos are never completely in memory.
+    auto openFile = [this, encryptionInfo, filename] {
+        std::unique_ptr<QIODevice> device;
+        if (encryptionInfo)
+            device =
+              std::make_unique<olm::EncryptedFileDevice>(filename.filePath(), *encryptionInfo);
+        else
+            device = std::make_unique<QFile>(filename.filePath());
+
+        if (!device->open(QIODevice::ReadOnly)) {
+            nhlog::ui()->warn("Failed to open media {}: {}",
+                              filename.filePath().toStdString(),
+                              device->errorString().toStdString());
+            return false;
         }
-        buffer.open(QIODevice::ReadOnly);
-        buffer.reset();
-
-        QTimer::singleShot(0, this, [this, filename] {
-            nhlog::ui()->info(
-              "Playing buffer with size: {}, {}", buffer.bytesAvailable(), buffer.isOpen());
-            this->setSourceDevice(&buffer, QUrl(filename.fileName()));
-            emit loadedChanged();
-        });
+
+        nhlog::ui()->info("Playing media with size: {}", device->size());
+        this->setSourceDevice(device.get(), QUrl(filename.fileName()));
+        source_ = std::move(device);
+        emit loadedChanged();
+        return true;
     };
 
-    if (filename.isReadable()) {
-        QFile f(filename.filePath());
-        if (f.open(QIODevice::ReadOnly)) {
-            processBuffer(f);
-            return;
-        }
-    }
+    if (MediaCache::instance().contains(filename.filePath()) && openFile())
+        return;
 
     if (onlyCached)
         return;
 
+    QPointer<MxcMediaProxy> self = this;
+    bool encrypted               = encryptionInfo.has_value();
     http::client()->download(url,
-                             [filename, url, processBuffer](const std::string &data,
-                                                            const std::string &,
-                                                            const std::string &,
-                                                            mtx::http::RequestErr err) {
+                             [filename, url, openFile, self, encrypted](const std::string &data,
+                                                                        const std::string &,
+                                                                        const std::string &,
+                                                                        mtx::http::RequestErr err) {
                                  if (err) {
                                      nhlog::net()->warn("failed to retrieve media {}: {} {}",
                                                         url,
@@ -157,22 +156,20 @@ MxcMediaProxy::startDownload(bool onlyCached)
                                      return;
                                  }
 
-                                 try {
-                                     QFile file(filename.filePath());
-
-                                     if (!file.open(QIODevice::WriteOnly))
-                                         return;
+                                 QFile file(filename.filePath());
+                                 if (!file.open(QIODevice::WriteOnly)) {
+                                     nhlog::ui()->warn("Error while saving file to: {}",
+                                                       file.errorString().toStdString());
+                                     return;
+                                 }
 
-                                     QByteArray ba(data.data(), (int)data.size());
-                                     file.write(ba);
-                                     file.close();
+                                 file.write(data.data(), static_cast<qint64>(data.size()));
+                                 file.close();
+                                 MediaCache::instance().insert(
+                                   filename.filePath(), "original", encrypted);
 
-                                     QBuffer buf(&ba);
-                                     buf.open(QBuffer::ReadOnly);
-                                     processBuffer(buf);
-                                 } catch (const std::exception &e) {
-                                     nhlog::ui()->warn("Error while saving file to: {}", e.what());
-                                 }
+                                 if (self)
+                                     QTimer::singleShot(0, self.data(), [openFile] { openFile(); });
                              });
 }
 
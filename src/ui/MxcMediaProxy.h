@@ -5,7 +5,7 @@
 #pragma once
 
 #include <QAudioOutput>
-#include <QBuffer>
+#include <QIODevice>
 #include <QMediaPlayer>
 #include <QObject>
 #include <QPointer>
@@ -14,6 +14,8 @@
 #include <QUrl>
 #include <QVideoSink>
 
+#include <memory>
+
 class TimelineModel;
 
 // I failed to get my own buffer into the MediaPlayer in qml, so just make our own. For that we just
@@ -38,7 +40,7 @@ public:
         this->setSourceDevice(nullptr);
     }
 
-    bool loaded() const { return buffer.size() > 0; }
+    bool loaded() const { return source_ && source_->size() > 0; }
     QString eventId() const { return eventId_; }
     TimelineModel *room() const { return room_; }
     void setEventId(QString newEventId)
@@ -91,7 +93,7 @@ private:
     TimelineModel *room_ = nullptr;
     QString eventId_;
     QString filename_;
-    QBuffer buffer;
+    std::unique_ptr<QIODevice> source_;
     float volume_ = 1.f;
     bool muted_   = false;
 };
@@ -2,8 +2,10 @@
 
 #include <algorithm>
 #include <array>
+#include <bit>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
 #include <numbers>
 #include <stdexcept>
 
@@ -124,6 +126,14 @@ srgbToLinear(int value) noexcept
         return srgbToLinearF(static_cast<float>(value) / 255.f);
 }
 
+// srgbToLinear for every possible channel value, the pow() dominates encoding otherwise.
+const std::array<float, 256> srgbToLinearTable = []() {
+        std::array<float, 256> a{};
+        for (int i = 0; i < 256; i++)
+                a[i] = srgbToLinear(i);
+        return a;
+}();
+
 int
 linearToSrgb(float value) noexcept
 {
@@ -141,6 +151,54 @@ linearToSrgb(float value) noexcept
         return int(linearToSrgbF(value) * 255.f + 0.5f);
 }
 
+// The smallest linear value, that linearToSrgb maps to each sRGB value. Positive floats sort like
+// their bit patterns, so the boundaries can be found exactly by bisecting those.
+const std::array<float, 256> linearToSrgbThresholds = []() {
+        std::array<float, 256> t{};
+        t[0] = 0.f;
+        for (int v = 1; v < 256; v++) {
+                uint32_t lo = 0, hi = std::bit_cast<uint32_t>(1.0f);
+                while (lo < hi) {
+                        uint32_t mid = lo + (hi - lo) / 2;
+                        if (linearToSrgb(std::bit_cast<float>(mid)) >= v)
+                                hi = mid;
+                        else
+                                lo = mid + 1;
+                }
+                t[v] = std::bit_cast<float>(lo);
+        }
+        return t;
+}();
+
+// The sRGB value at the start of each of a number of equally sized intervals of linear values.
+// They are small enough, that the value within one has to be adjusted by at most a step or two.
+constexpr int linearToSrgbBucketCount = 4096;
+const std::array<unsigned char, linearToSrgbBucketCount> linearToSrgbBuckets = []() {
+        std::array<unsigned char, linearToSrgbBucketCount> b{};
+        for (int i = 0; i < linearToSrgbBucketCount; i++)
+                b[i] = static_cast<unsigned char>(
+                  linearToSrgb(static_cast<float>(i) / linearToSrgbBucketCount));
+        return b;
+}();
+
+// Same as linearToSrgb, but without the pow(), which dominates decoding otherwise.
+unsigned char
+linearToSrgbFast(float value) noexcept
+{
+        if (!(value > 0.f))
+                return 0;
+        if (value >= 1.f)
+                return 255;
+
+        int v = linearToSrgbBuckets[std::min(int(value * linearToSrgbBucketCount),
+                                             linearToSrgbBucketCount - 1)];
+        while (v < 255 && linearToSrgbThresholds[v + 1] <= value)
+                v++;
+        while (v > 0 && linearToSrgbThresholds[v] > value)
+                v--;
+        return static_cast<unsigned char>(v);
+}
+
 struct Color
 {
         float r, g, b;
@@ -276,24 +334,33 @@ decode(std::string_view blurhash, size_t width, size_t height, size_t bytesPerPi
         std::vector<float> basis_x = bases_for(width, components.x);
         std::vector<float> basis_y = bases_for(height, components.y);
 
+        // The basis is separable, so the y basis only has to be applied to the components once
+        // per row. The remaining loop over the x basis is simple enough to be vectorized.
+        const size_t cx = size_t(components.x), cy = size_t(components.y);
+        std::vector<float> row_r(cx), row_g(cx), row_b(cx);
         for (size_t y = 0; y < height; y++) {
-                for (size_t x = 0; x < width; x++) {
+                for (size_t nx = 0; nx < cx; nx++) {
                         Color c{};
+                        for (size_t ny = 0; ny < cy; ny++)
+                                c += values[nx + ny * cx] * basis_y[y * cy + ny];
+                        row_r[nx] = c.r;
+                        row_g[nx] = c.g;
+                        row_b[nx] = c.b;
+                }
 
-                        for (size_t nx = 0; nx < size_t(components.x); nx++) {
-                                for (size_t ny = 0; ny < size_t(components.y); ny++) {
-                                        float basis = basis_x[x * components.x + nx] *
-                                                      basis_y[y * components.y + ny];
-                                        c += values[nx + ny * components.x] * basis;
-                                }
+                unsigned char *line = i.image.data() + y * width * bytesPerPixel;
+                for (size_t x = 0; x < width; x++) {
+                        const float *basis = &basis_x[x * cx];
+                        float r = 0, g = 0, b = 0;
+                        for (size_t nx = 0; nx < cx; nx++) {
+                                r += row_r[nx] * basis[nx];
+                                g += row_g[nx] * basis[nx];
+                                b += row_b[nx] * basis[nx];
                         }
 
-                        i.image[(y * width + x) * bytesPerPixel + 0] =
-                          static_cast<unsigned char>(linearToSrgb(c.r));
-                        i.image[(y * width + x) * bytesPerPixel + 1] =
-                          static_cast<unsigned char>(linearToSrgb(c.g));
-                        i.image[(y * width + x) * bytesPerPixel + 2] =
-                          static_cast<unsigned char>(linearToSrgb(c.b));
+                        line[x * bytesPerPixel + 0] = linearToSrgbFast(r);
+                        line[x * bytesPerPixel + 1] = linearToSrgbFast(g);
+                        line[x * bytesPerPixel + 2] = linearToSrgbFast(b);
                 }
         }
 
@@ -313,23 +380,38 @@ encode(unsigned char *image, size_t width, size_t height, int components_x, int
         std::vector<float> basis_x = bases_for(width, components_x);
         std::vector<float> basis_y = bases_for(height, components_y);
 
-        std::vector<Color> factors(components_x * components_y, Color{});
+        // The basis is separable, so first sum up each row weighted by the x basis and then
+        // weight the row sums by the y basis. That takes width * components_x multiplications per
+        // row instead of width * components_x * components_y and keeps the inner loops simple
+        // enough to be vectorized.
+        const size_t cx = size_t(components_x), cy = size_t(components_y);
+        std::vector<Color> factors(cx * cy, Color{});
+        std::vector<float> row_r(cx), row_g(cx), row_b(cx);
         for (size_t y = 0; y < height; y++) {
+                std::fill(row_r.begin(), row_r.end(), 0.f);
+                std::fill(row_g.begin(), row_g.end(), 0.f);
+                std::fill(row_b.begin(), row_b.end(), 0.f);
+
+                const unsigned char *line = image + y * width * 3;
                 for (size_t x = 0; x < width; x++) {
-                        Color linear{srgbToLinear(image[3 * x + 0 + y * width * 3]),
-                                     srgbToLinear(image[3 * x + 1 + y * width * 3]),
-                                     srgbToLinear(image[3 * x + 2 + y * width * 3])};
+                        const float r = srgbToLinearTable[line[3 * x + 0]];
+                        const float g = srgbToLinearTable[line[3 * x + 1]];
+                        const float b = srgbToLinearTable[line[3 * x + 2]];
+
+                        const float *basis = &basis_x[x * cx];
+                        for (size_t nx = 0; nx < cx; nx++) {
+                                row_r[nx] += r * basis[nx];
+                                row_g[nx] += g * basis[nx];
+                                row_b[nx] += b * basis[nx];
+                        }
+                }
 
+                for (size_t ny = 0; ny < cy; ny++) {
                         // other half of normalization.
-                        linear *= 1.f / static_cast<float>(width);
-
-                        for (size_t ny = 0; ny < size_t(components_y); ny++) {
-                                for (size_t nx = 0; nx < size_t(components_x); nx++) {
-                                        float basis = basis_x[x * size_t(components_x) + nx] *
-                                                      basis_y[y * size_t(components_y) + ny];
-                                        factors[ny * components_x + nx] += linear * basis;
-                                }
-                        }
+                        const float basis = basis_y[y * cy + ny] / static_cast<float>(width);
+                        for (size_t nx = 0; nx < cx; nx++)
+                                factors[ny * cx + nx] +=
+                                  Color{row_r[nx], row_g[nx], row_b[nx]} * basis;
                 }
         }
 